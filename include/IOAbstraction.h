@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <sys/dirent.h>
 #include <vector>
 
@@ -28,6 +30,11 @@ public:
 
 	static int lstat (const char *path, struct stat *buf);
 
+	// Stats an entry of a directory opened with opendir; dirPath is the path it was opened with.
+	// Uses the open handle where the platform allows, otherwise joins the path on the stack.
+	// Never reads or fills the stat cache
+	static int statAt (DIR *dirp, std::string_view dirPath, const char *name, struct stat *buf);
+
 	static int mkdir (const char *path, mode_t mode);
 
 	static int rmdir (const char *path);
@@ -39,5 +46,20 @@ public:
 	static void addVirtualPath (const std::string &virtualPath,
 	    const std::vector<std::string> &subDirectories);
 
+	// Builds the lookup table for the paths added with addVirtualPath; call once they are all added
+	static void finalizeVirtualPaths ();
+
 	static void clear ();
+
+	// Drops cached metadata for a path whose contents changed outside of this class, e.g. through
+	// writes to an open FILE
+	static void invalidate (const char *path);
+
+	static void setStatCacheEnabled (bool enabled);
+
+	static bool statCacheEnabled ();
+
+	static uint64_t statCacheHits ();
+
+	static uint64_t statCacheMisses ();
 };
@@ -0,0 +1,129 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "bufferPool.h"
+#include "fs.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/// \brief Block of file data
+struct FileBlock
+{
+	/// \brief Data
+	BufferPool::UniqueBuffer data;
+
+	/// \brief Size of data; less than BlockCache::BLOCK_SIZE only at the end of the file
+	std::size_t size = 0;
+};
+
+using SharedFileBlock = std::shared_ptr<FileBlock const>;
+
+/// \brief Memory-bounded LRU cache of file blocks shared by all sessions
+/// Entries are keyed by resolved path and block index. A lookup misses if the file's mtime or size
+/// changed, and every command that changes a file invalidates it explicitly, since an upload can
+/// finish within the mtime resolution.
+class BlockCache
+{
+public:
+#ifdef __NDS__
+	/// \brief Size of a cached block
+	constexpr static std::size_t BLOCK_SIZE = 8192;
+#else
+	/// \brief Size of a cached block
+	constexpr static std::size_t BLOCK_SIZE = 64 * 1024;
+#endif
+
+	/// \brief Set memory to use for cached blocks
+	/// \param bytes_ Memory cap in bytes; less than one block disables the cache
+	static void setCapacity (std::size_t bytes_);
+
+	/// \brief Whether the cache is enabled
+	static bool enabled ();
+
+	/// \brief Look up a block
+	/// \param path_ Resolved file path
+	/// \param mtime_ Current file mtime
+	/// \param size_ Current file size
+	/// \param index_ Block index
+	/// \returns nullptr on a miss
+	static SharedFileBlock lookup (std::string const &path_,
+	    std::time_t mtime_,
+	    std::uint64_t size_,
+	    std::uint64_t index_);
+
+	/// \brief Whether a block is cached
+	/// \param path_ Resolved file path
+	/// \param mtime_ Current file mtime
+	/// \param size_ Current file size
+	/// \param index_ Block index
+	/// \note Unlike lookup (), does not count as a use
+	static bool contains (std::string const &path_,
+	    std::time_t mtime_,
+	    std::uint64_t size_,
+	    std::uint64_t index_);
+
+	/// \brief Current invalidation generation
+	/// \note Pass to store () so a block read across an invalidation is not cached
+	static std::uint64_t generation ();
+
+	/// \brief Store a block
+	/// \param path_ Resolved file path
+	/// \param mtime_ File mtime when the block was read
+	/// \param size_ File size when the block was read
+	/// \param index_ Block index
+	/// \param block_ Block to store
+	/// \param generation_ generation () from before the block was read
+	static void store (std::string const &path_,
+	    std::time_t mtime_,
+	    std::uint64_t size_,
+	    std::uint64_t index_,
+	    SharedFileBlock block_,
+	    std::uint64_t generation_);
+
+	/// \brief Read a block from a file
+	/// \param file_ File to read
+	/// \param size_ File size
+	/// \param index_ Block index
+	/// \returns nullptr on error; check errno
+	/// \note Moves the file position
+	static SharedFileBlock read (fs::File &file_, std::uint64_t size_, std::uint64_t index_);
+
+	/// \brief Invalidate a changed path
+	/// \param path_ Resolved path that was written, renamed or removed
+	/// \note Drops the path itself and anything below it
+	static void invalidate (std::string_view path_);
+
+	/// \brief Bytes currently cached
+	static std::size_t size ();
+
+	/// \brief Number of lookups that hit
+	static std::uint64_t hits ();
+
+	/// \brief Number of lookups that missed
+	static std::uint64_t misses ();
+};
@@ -0,0 +1,86 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/// \brief Recycles fixed-size buffers
+/// Sessions and files allocate the same few buffer sizes over and over; keeping released buffers
+/// around for reuse avoids churning and fragmenting a small heap.
+class BufferPool
+{
+public:
+	/// \brief Deleter that returns a buffer to the pool
+	class Deleter
+	{
+	public:
+		Deleter () = default;
+
+		/// \brief Parameterized constructor
+		/// \param size_ Buffer size
+		explicit Deleter (std::size_t size_);
+
+		/// \brief Return buffer to the pool
+		/// \param buffer_ Buffer to return
+		void operator() (char *buffer_) const;
+
+	private:
+		/// \brief Buffer size
+		std::size_t m_size = 0;
+	};
+
+	/// \brief Pooled buffer
+	using UniqueBuffer = std::unique_ptr<char[], Deleter>;
+
+	/// \brief Usage of one buffer size
+	struct Stats
+	{
+		/// \brief Buffer size
+		std::size_t size;
+
+		/// \brief Number of buffers handed out
+		std::size_t inUse;
+
+		/// \brief Highest number of buffers handed out at once
+		std::size_t highWater;
+
+		/// \brief Number of released buffers kept for reuse
+		std::size_t cached;
+	};
+
+	/// \brief Get a buffer, reusing a released one if possible
+	/// \param size_ Buffer size
+	static UniqueBuffer acquire (std::size_t size_);
+
+	/// \brief Free released buffers kept for reuse
+	static void trim ();
+
+	/// \brief Get usage of each buffer size
+	static std::vector<Stats> stats ();
+
+private:
+	/// \brief Return buffer to the pool
+	/// \param buffer_ Buffer to return
+	/// \param size_ Buffer size
+	static void release (char *buffer_, std::size_t size_);
+};
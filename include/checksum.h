@@ -0,0 +1,100 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// \brief Incremental checksum for HASH and the XCRC/XMD5/XSHA commands
+class Checksum
+{
+public:
+	/// \brief Checksum algorithm
+	enum class Algorithm
+	{
+		CRC32,
+		MD5,
+		SHA1,
+		SHA256,
+	};
+
+	/// \brief Parameterized constructor
+	/// \param algorithm_ Checksum algorithm
+	explicit Checksum (Algorithm algorithm_);
+
+	/// \brief Find algorithm by its HASH name
+	/// \param name_ Name to look up (case-insensitive)
+	static std::optional<Algorithm> find (std::string_view name_);
+
+	/// \brief Get HASH name of algorithm
+	/// \param algorithm_ Algorithm to name
+	static char const *name (Algorithm algorithm_);
+
+	/// \brief Get algorithm
+	Algorithm algorithm () const;
+
+	/// \brief Add data
+	/// \param data_ Data to add
+	/// \param size_ Size of data
+	void update (void const *data_, std::size_t size_);
+
+	/// \brief Finish checksum
+	/// \returns Digest as lowercase hex
+	/// \note The checksum must not be updated afterwards
+	std::string finish ();
+
+private:
+	/// \brief Process one MD5 block
+	/// \param block_ 64-byte block
+	void md5Block (std::uint8_t const *block_);
+
+	/// \brief Process one SHA-1 block
+	/// \param block_ 64-byte block
+	void sha1Block (std::uint8_t const *block_);
+
+	/// \brief Process one SHA-256 block
+	/// \param block_ 64-byte block
+	void sha256Block (std::uint8_t const *block_);
+
+	/// \brief Process one block with the selected algorithm
+	/// \param block_ 64-byte block
+	void block (std::uint8_t const *block_);
+
+	/// \brief Checksum algorithm
+	Algorithm m_algorithm;
+
+	/// \brief Running state; CRC32 only uses the first word
+	std::array<std::uint32_t, 8> m_state{};
+
+	/// \brief Partial block
+	std::array<std::uint8_t, 64> m_block{};
+
+	/// \brief Bytes in the partial block
+	std::size_t m_blockSize = 0;
+
+	/// \brief Total bytes added
+	std::uint64_t m_length = 0;
+};
@@ -0,0 +1,482 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "blockCache.h"
+#include "checksum.h"
+#include "fs.h"
+#include "ioBuffer.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// \brief Blocking file I/O job run by a file worker
+class FileJob
+{
+public:
+	virtual ~FileJob ();
+
+	FileJob ();
+
+	FileJob (FileJob const &that_) = delete;
+
+	FileJob &operator= (FileJob const &that_) = delete;
+
+	/// \brief Run job
+	/// \returns Whether the job wants to run again
+	/// \note Called on a file worker thread
+	virtual bool run () = 0;
+
+private:
+	friend class FileWorkers;
+
+	/// \brief Next queued job
+	FileJob *m_next = nullptr;
+
+	/// \brief Number of workers currently running this job
+	unsigned m_running = 0;
+
+	/// \brief Whether job is queued
+	bool m_queued = false;
+
+	/// \brief Whether job has been cancelled
+	bool m_cancelled = false;
+};
+
+/// \brief Pool of threads that run blocking file I/O off the network thread
+class FileWorkers
+{
+public:
+	/// \brief Start workers
+	/// \param count_ Number of workers
+	static void start (unsigned count_);
+
+	/// \brief Stop workers
+	/// \note Queued jobs are dropped
+	static void stop ();
+
+	/// \brief Whether any workers are running
+	static bool running ();
+
+	/// \brief Queue job
+	/// \param job_ Job to queue
+	/// \returns false if no workers are running or the job was cancelled
+	static bool submit (FileJob &job_);
+
+	/// \brief Cancel job
+	/// \param job_ Job to cancel
+	/// \note Returns once no worker is running or will run the job
+	static void cancel (FileJob &job_);
+
+private:
+	/// \brief Append job to the queue
+	/// \param job_ Job to append
+	/// \note Pool lock must be held
+	static void enqueue (FileJob &job_);
+
+	/// \brief Worker thread entry point
+	static void workerFunc ();
+};
+
+/// \brief Ring of blocks read ahead of a download by the file workers
+/// The network thread consumes blocks from the front of the ring while a file worker fills free
+/// blocks at the back, so disk latency overlaps with network sends.
+class ReadAhead : public FileJob
+{
+public:
+	~ReadAhead () override;
+
+	/// \brief Parameterized constructor
+	/// \param file_ File to read; its descriptor must be positioned at the first byte to send
+	/// with seekDirect (), since blocks are read with readDirect ()
+	/// \param blockSize_ Size of each block
+	/// \param blocks_ Number of blocks
+	ReadAhead (fs::File &file_, std::size_t blockSize_, unsigned blocks_);
+
+	/// \brief Start reading
+	/// \returns false if no workers are running
+	bool start ();
+
+	/// \brief Get the oldest block that has not been consumed
+	/// \returns nullptr if no block is ready yet
+	IOBuffer *front ();
+
+	/// \brief Consume the front block
+	void pop ();
+
+	/// \brief Whether front () has a block or reading has finished
+	bool ready ();
+
+	/// \brief Whether the whole file has been read and consumed
+	bool done ();
+
+	/// \brief Read error, or 0 if none occurred
+	int error ();
+
+	bool run () override;
+
+private:
+	/// \brief Mutex
+	std::mutex m_lock;
+
+	/// \brief File being read
+	fs::File &m_file;
+
+	/// \brief Blocks
+	std::vector<std::unique_ptr<IOBuffer>> m_blocks;
+
+	/// \brief Index of the oldest filled block
+	std::size_t m_head = 0;
+
+	/// \brief Index of the next block to fill
+	std::size_t m_tail = 0;
+
+	/// \brief Number of filled blocks
+	std::size_t m_count = 0;
+
+	/// \brief Read error
+	int m_error = 0;
+
+	/// \brief Whether end-of-file was reached
+	bool m_eof = false;
+
+	/// \brief Whether job is queued or running
+	bool m_active = false;
+};
+
+/// \brief Ring of received blocks written behind an upload by the file workers
+/// The network thread receives into the block at the back of the ring while a file worker writes
+/// full blocks from the front, so the data connection keeps draining while storage catches up.
+class WriteBehind : public FileJob
+{
+public:
+	~WriteBehind () override;
+
+	/// \brief Parameterized constructor
+	/// \param file_ File to write; must be positioned at the first byte to store
+	/// \param blockSize_ Size of each block
+	/// \param blocks_ Number of blocks
+	WriteBehind (fs::File &file_, std::size_t blockSize_, unsigned blocks_);
+
+	/// \brief Get the block to receive into
+	/// \returns nullptr if every block is waiting to be written
+	IOBuffer *back ();
+
+	/// \brief Hand the back block to the writer if it is full
+	/// \returns false if no workers are running
+	bool push ();
+
+	/// \brief Hand any remaining data to the writer and flush the file
+	/// \returns false if no workers are running
+	bool finish ();
+
+	/// \brief Whether back () has room and finish () has not been called
+	bool ready ();
+
+	/// \brief Whether the writer has stopped, either flushed or failed
+	bool settled ();
+
+	/// \brief Write error, or 0 if none occurred
+	int error ();
+
+	bool run () override;
+
+private:
+	/// \brief Queue job if it is idle
+	/// \note Lock must be held
+	bool wake ();
+
+	/// \brief Mutex
+	std::mutex m_lock;
+
+	/// \brief File being written
+	fs::File &m_file;
+
+	/// \brief Blocks
+	std::vector<std::unique_ptr<IOBuffer>> m_blocks;
+
+	/// \brief Index of the oldest block waiting to be written
+	std::size_t m_head = 0;
+
+	/// \brief Index of the block being received into
+	std::size_t m_tail = 0;
+
+	/// \brief Number of blocks waiting to be written
+	std::size_t m_count = 0;
+
+	/// \brief Write error
+	int m_error = 0;
+
+	/// \brief Whether finish () was called
+	bool m_finish = false;
+
+	/// \brief Whether all data has been written and flushed
+	bool m_flushed = false;
+
+	/// \brief Whether job is queued or running
+	bool m_active = false;
+};
+
+/// \brief Loads the blocks of a cached download into the block cache
+/// Loads the block the session is waiting for and the next few after it, skipping blocks other
+/// sessions have already cached. The session never reads the file itself, so a miss never blocks
+/// the network thread.
+class CachePrefetch : public FileJob
+{
+public:
+	~CachePrefetch () override;
+
+	/// \brief Parameterized constructor
+	/// \param file_ File to read; separate from the session's so positions don't clash
+	/// \param path_ Resolved file path
+	/// \param mtime_ File mtime
+	/// \param size_ File size
+	/// \param depth_ Number of blocks to keep loaded ahead of the reader
+	CachePrefetch (fs::File file_,
+	    std::string path_,
+	    std::time_t mtime_,
+	    std::uint64_t size_,
+	    unsigned depth_);
+
+	/// \brief Note that the reader needs a block
+	/// \param index_ Block index
+	/// \note Reloads the block if it was evicted since it was loaded
+	void advance (std::uint64_t index_);
+
+	/// \brief Whether the block the reader needs is loaded or loading has stopped
+	bool ready ();
+
+	/// \brief Take the block the reader needs if it was loaded but the cache did not keep it
+	/// \param index_ Block index
+	/// \returns nullptr if the block is not held
+	SharedFileBlock take (std::uint64_t index_);
+
+	/// \brief Read error, or 0 if none occurred
+	int error ();
+
+	bool run () override;
+
+private:
+	/// \brief Mutex
+	std::mutex m_lock;
+
+	/// \brief File being read
+	fs::File m_file;
+
+	/// \brief Resolved file path
+	std::string const m_path;
+
+	/// \brief File mtime
+	std::time_t const m_mtime;
+
+	/// \brief File size
+	std::uint64_t const m_size;
+
+	/// \brief Number of blocks to keep loaded ahead of the reader
+	unsigned const m_depth;
+
+	/// \brief Next block to load
+	std::uint64_t m_next = 0;
+
+	/// \brief Block to stop loading at
+	std::uint64_t m_end = 0;
+
+	/// \brief Block the reader needs
+	std::uint64_t m_want = 0;
+
+	/// \brief Loaded copy of the block the reader needs, in case the cache drops it
+	SharedFileBlock m_block;
+
+	/// \brief Index of m_block
+	std::uint64_t m_blockIndex = 0;
+
+	/// \brief Read error
+	int m_error = 0;
+
+	/// \brief Whether job is queued or running
+	bool m_active = false;
+};
+
+/// \brief Checksum of a file range computed by the file workers
+/// Each run hashes one block and requeues, so a large file does not hold a worker while other
+/// sessions wait. Without workers the network thread calls run () itself.
+class FileHash : public FileJob
+{
+public:
+	~FileHash () override;
+
+	/// \brief Parameterized constructor
+	/// \param file_ File to hash; must be positioned at the first byte to hash, with seekDirect ()
+	/// if it has a descriptor
+	/// \param algorithm_ Checksum algorithm
+	/// \param size_ Number of bytes to hash
+	FileHash (fs::File file_, Checksum::Algorithm algorithm_, std::uint64_t size_);
+
+	/// \brief Start hashing
+	/// \returns false if no workers are running
+	bool start ();
+
+	/// \brief Whether hashing has finished or failed
+	bool done ();
+
+	/// \brief Read error, or 0 if none occurred
+	int error ();
+
+	/// \brief Get digest
+	/// \note Empty until hashing has finished
+	std::string digest ();
+
+	bool run () override;
+
+private:
+	/// \brief Mutex
+	std::mutex m_lock;
+
+	/// \brief File being hashed
+	fs::File m_file;
+
+	/// \brief Running checksum
+	Checksum m_checksum;
+
+	/// \brief Read buffer
+	IOBuffer m_buffer;
+
+	/// \brief Bytes left to hash
+	std::uint64_t m_remaining;
+
+	/// \brief Finished digest
+	std::string m_digest;
+
+	/// \brief Read error
+	int m_error = 0;
+
+	/// \brief Whether hashing has finished
+	bool m_done = false;
+};
+
+/// \brief Listing entries statted ahead of the sender by the file workers
+/// Entries are read from the directory in order into a ring, then statted outside the lock, so
+/// with several workers the stats for the next few entries are in flight at once. The network
+/// thread consumes entries from the front of the ring in directory order once they are statted.
+/// On fast storage a stat finishes sooner than the network thread wakes up to collect it, so while
+/// stats are quick the workers leave the entries to the network thread, which calls run () itself.
+class StatPrefetch : public FileJob
+{
+public:
+	~StatPrefetch () override;
+
+	/// \brief Parameterized constructor
+	/// \param dir_ Open directory
+	/// \param path_ Path the directory was opened with
+	/// \param depth_ Number of entries to stat ahead
+	/// \param quickStat_ Average stat time below which the network thread runs the stats
+	StatPrefetch (fs::Dir dir_,
+	    std::string path_,
+	    unsigned depth_,
+	    std::chrono::microseconds quickStat_);
+
+	/// \brief Start reading
+	/// \returns false if no workers are running
+	bool start ();
+
+	/// \brief Get the next entry
+	/// \returns nullptr if no entry is ready yet
+	/// \note A failed stat is reported in the entry's error
+	fs::DirLister::Entry const *front ();
+
+	/// \brief Consume the front entry
+	void pop ();
+
+	/// \brief Whether front () has an entry or reading has finished
+	bool ready ();
+
+	/// \brief Whether the whole directory has been read and consumed
+	bool done ();
+
+	/// \brief Read error, or 0 if none occurred
+	int error ();
+
+	/// \brief Whether stats are quick enough for the network thread to call run () itself
+	/// \note The workers stop picking up entries while this holds
+	bool quick ();
+
+	bool run () override;
+
+private:
+	/// \brief Whether stats are quick
+	/// \note Lock must be held
+	bool quickLocked () const;
+
+	/// \brief Ring slot
+	struct Slot
+	{
+		/// \brief Entry
+		fs::DirLister::Entry entry;
+
+		/// \brief Whether the entry has been statted
+		bool ready = false;
+	};
+
+	/// \brief Mutex
+	std::mutex m_lock;
+
+	/// \brief Serializes directory reads, which are not thread-safe
+	std::mutex m_dirLock;
+
+	/// \brief Directory being read
+	fs::Dir m_dir;
+
+	/// \brief Path the directory was opened with
+	std::string const m_path;
+
+	/// \brief Slots
+	std::vector<Slot> m_slots;
+
+	/// \brief Index of the oldest entry
+	std::size_t m_head = 0;
+
+	/// \brief Index of the next slot to read into
+	std::size_t m_tail = 0;
+
+	/// \brief Number of entries read, statted or not
+	std::size_t m_count = 0;
+
+	/// \brief Average stat time below which the network thread runs the stats
+	std::chrono::microseconds const m_quickStat;
+
+	/// \brief Moving average of the stat time; unknown until an entry has been statted
+	std::chrono::microseconds m_statTime = std::chrono::microseconds::max ();
+
+	/// \brief Read error
+	int m_error = 0;
+
+	/// \brief Whether the end of the directory was reached
+	bool m_eof = false;
+
+	/// \brief Whether the workers stopped before the directory was read
+	bool m_stopped = false;
+};
@@ -20,16 +20,27 @@
 
 #pragma once
 
+#include "bufferPool.h"
 #include "ioBuffer.h"
 
 #include <gsl/gsl>
 
 #include <dirent.h>
 
+#if defined(__linux__) && __has_include(<fcntl.h>)
+#define FTPD_HAS_FALLOCATE 1
+#else
+#define FTPD_HAS_FALLOCATE 0
+#endif
+
+#include <sys/stat.h>
+
+#include <array>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <memory>
+#include <string>
 #include <string_view>
 #include <vector>
 
@@ -65,6 +76,10 @@ public:
 	/// \brief std::FILE* cast operator
 	operator std::FILE * () const;
 
+	/// \brief Underlying file descriptor
+	/// \note Returns -1 if the file is not open
+	int fd () const;
+
 	/// \brief Set buffer size
 	/// \param size_ Buffer size
 	void setBufferSize (std::size_t size_);
@@ -82,6 +97,12 @@ public:
 	/// \param origin_ Reference position (\sa std::fseek)
 	std::make_signed_t<std::size_t> seek (std::make_signed_t<std::size_t> pos_, int origin_);
 
+	/// \brief Move the file descriptor to an absolute position, bypassing stdio
+	/// \param pos_ File position
+	/// \note Use this instead of seek () before readDirect (); fseek does not promise where it
+	/// leaves the descriptor
+	bool seekDirect (std::uint64_t pos_);
+
 	/// \brief Read data
 	/// \param buffer_ Output buffer
 	/// \param size_ Size to read
@@ -93,6 +114,23 @@ public:
 	/// \note Can return partial reads
 	std::make_signed_t<std::size_t> read (IOBuffer &buffer_);
 
+	/// \brief Read data into the contiguous writable area
+	/// \param buffer_ Output buffer
+	/// \note Can return partial reads
+	std::make_signed_t<std::size_t> read (RingBuffer &buffer_);
+
+	/// \brief Read data directly from the file descriptor, bypassing stdio
+	/// \param buffer_ Output buffer
+	/// \note Can return partial reads
+	/// \note Must not be mixed with buffered reads or seek () on the same file; see seekDirect ()
+	std::make_signed_t<std::size_t> readDirect (IOBuffer &buffer_);
+
+	/// \brief Read data directly from the file descriptor into the contiguous writable area
+	/// \param buffer_ Output buffer
+	/// \note Can return partial reads
+	/// \note Must not be mixed with buffered reads or seek () on the same file; see seekDirect ()
+	std::make_signed_t<std::size_t> readDirect (RingBuffer &buffer_);
+
 	/// \brief Read line
 	std::string_view readLine ();
 
@@ -113,18 +151,46 @@ public:
 	/// \note Can return partial writes
 	std::make_signed_t<std::size_t> write (IOBuffer &buffer_);
 
+	/// \brief Write data from the contiguous readable area
+	/// \param buffer_ Input data
+	/// \note Can return partial writes
+	std::make_signed_t<std::size_t> write (RingBuffer &buffer_);
+
 	/// \brief Write data
 	/// \param buffer_ Input data
 	/// \param size_ Size to write
 	/// \note Fails on partials writes and errors
 	bool writeAll (gsl::not_null<void const *> buffer_, std::size_t size_);
 
+	/// \brief Flush buffered writes
+	/// \returns false on error; check errno
+	bool flush ();
+
+	/// \brief Get file position
+	/// \returns -1 on error; check errno
+	std::int64_t tell ();
+
+	/// \brief Reserve storage so the file can grow to a size without further allocation
+	/// \param size_ Size to reserve
+	/// \returns false on error; check errno
+	/// \note Extends the file to size_; truncate () back to what was written
+	bool preallocate (std::uint64_t size_);
+
+	/// \brief Set file size
+	/// \param size_ New size
+	/// \returns false on error; check errno
+	/// \note Flushes buffered writes first
+	bool truncate (std::uint64_t size_);
+
 private:
 	/// \brief Underlying std::FILE*
 	std::unique_ptr<std::FILE, int (*) (std::FILE *)> m_fp{nullptr, nullptr};
 
 	/// \brief Buffer
-	std::vector<char> m_buffer;
+	BufferPool::UniqueBuffer m_buffer;
+
+	/// \brief Buffer size
+	std::size_t m_bufferSize = 0;
 
 	/// \brief Line buffer
 	gsl::owner<char *> m_lineBuffer = nullptr;
@@ -174,4 +240,82 @@ private:
 	/// \brief Underlying DIR*
 	std::unique_ptr<DIR, int (*) (DIR *)> m_dp{nullptr, nullptr};
 };
+
+/// \brief Directory reader for listings
+/// Entries are read a batch at a time into storage that is reused across batches and listings,
+/// and are statted relative to the open directory, so a listing does no per-entry allocation or
+/// path building.
+class DirLister
+{
+public:
+#ifdef __NDS__
+	/// \brief Entries read per batch
+	constexpr static std::size_t BATCH_SIZE = 8;
+#else
+	/// \brief Entries read per batch
+	constexpr static std::size_t BATCH_SIZE = 32;
+#endif
+
+	/// \brief Directory entry
+	struct Entry
+	{
+		/// \brief Entry name
+		char name[sizeof (dirent::d_name)];
+
+		/// \brief Entry status, if requested
+		struct stat st;
+
+		/// \brief Stat error, or 0 if none occurred
+		int error;
+	};
+
+	~DirLister ();
+
+	DirLister ();
+
+	DirLister (DirLister const &that_) = delete;
+
+	DirLister &operator= (DirLister const &that_) = delete;
+
+	/// \brief bool cast operator
+	explicit operator bool () const;
+
+	/// \brief Open directory
+	/// \param path_ Path to open
+	/// \param stat_ Whether to stat entries
+	bool open (std::string_view path_, bool stat_);
+
+	/// \brief Close directory
+	void close ();
+
+	/// \brief Read the next entry, excluding . and ..
+	/// \returns nullptr at end of directory
+	/// \note The entry is valid until the next call
+	Entry const *read ();
+
+private:
+	/// \brief Read the next batch
+	void fill ();
+
+	/// \brief Directory
+	Dir m_dir;
+
+	/// \brief Directory path
+	std::string m_path;
+
+	/// \brief Batch storage
+	std::unique_ptr<std::array<Entry, BATCH_SIZE>> m_batch;
+
+	/// \brief Number of entries in the batch
+	std::size_t m_count = 0;
+
+	/// \brief Next entry in the batch
+	std::size_t m_index = 0;
+
+	/// \brief Whether to stat entries
+	bool m_stat = false;
+
+	/// \brief Whether the end of the directory was reached
+	bool m_eof = false;
+};
 }
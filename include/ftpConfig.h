@@ -37,6 +37,13 @@ using UniqueFtpConfig = std::unique_ptr<FtpConfig>;
 class FtpConfig
 {
 public:
+	/// \brief How new sessions are spread across session workers
+	enum class SessionBalance
+	{
+		LEAST_LOADED, ///< Worker with the fewest sessions
+		ROUND_ROBIN,  ///< Each worker in turn
+	};
+
 	~FtpConfig ();
 
 	/// \brief Create config
@@ -66,6 +73,45 @@ public:
 	/// \brief Get port
 	std::uint16_t port () const;
 
+	/// \brief Get number of file I/O workers
+	unsigned ioWorkers () const;
+
+	/// \brief Get number of blocks to read ahead of a download
+	unsigned readAhead () const;
+
+	/// \brief Get number of listing entries to stat ahead of the sender
+	unsigned listPrefetch () const;
+
+	/// \brief Get memory cap for data received but not yet written, in KiB
+	unsigned writeBehind () const;
+
+	/// \brief Get number of session workers
+	unsigned sessionWorkers () const;
+
+	/// \brief Get cores session workers may run on, one bit per core
+	unsigned workerAffinity () const;
+
+	/// \brief Get session balance policy
+	SessionBalance sessionBalance () const;
+
+	/// \brief Get number of directory listings to cache
+	unsigned listingCache () const;
+
+	/// \brief Whether uploads announced with ALLO are preallocated
+	bool preallocate () const;
+
+	/// \brief Get block cache size in KiB
+	unsigned blockCache () const;
+
+	/// \brief Get MODE Z compression level
+	unsigned compressLevel () const;
+
+	/// \brief Get smallest data socket buffer in KiB
+	unsigned sockBufferMin () const;
+
+	/// \brief Get largest data socket buffer in KiB
+	unsigned sockBufferMax () const;
+
 #ifdef __3DS__
 	/// \brief Whether to get mtime
 	/// \note only effective on 3DS
@@ -103,6 +149,58 @@ public:
 	/// \param port_ Listen port
 	bool setPort (std::uint16_t port_);
 
+	/// \brief Set number of file I/O workers
+	/// \param workers_ Number of workers; 0 disables background file I/O
+	/// \note Takes effect when the server restarts
+	void setIOWorkers (unsigned workers_);
+
+	/// \brief Set number of blocks to read ahead of a download
+	/// \param blocks_ Number of blocks; 0 disables read-ahead
+	void setReadAhead (unsigned blocks_);
+
+	/// \brief Set number of listing entries to stat ahead of the sender
+	/// \param entries_ Number of entries; 0 disables stat prefetch
+	void setListPrefetch (unsigned entries_);
+
+	/// \brief Set memory cap for data received but not yet written
+	/// \param kib_ Cap in KiB per upload; 0 disables write-behind
+	void setWriteBehind (unsigned kib_);
+
+	/// \brief Set number of session workers
+	/// \param workers_ Number of workers; 0 runs sessions on the server thread
+	/// \note Takes effect when the server restarts
+	void setSessionWorkers (unsigned workers_);
+
+	/// \brief Set cores session workers may run on
+	/// \param cpuMask_ One bit per core; 0 uses the platform default
+	/// \note Takes effect when the server restarts
+	void setWorkerAffinity (unsigned cpuMask_);
+
+	/// \brief Set session balance policy
+	/// \param balance_ Balance policy
+	void setSessionBalance (SessionBalance balance_);
+
+	/// \brief Set number of directory listings to cache
+	/// \param entries_ Number of directories; 0 disables the cache
+	void setListingCache (unsigned entries_);
+
+	/// \brief Set whether uploads announced with ALLO are preallocated
+	/// \param preallocate_ Whether to preallocate
+	void setPreallocate (bool preallocate_);
+
+	/// \brief Set block cache size
+	/// \param kib_ Size in KiB; 0 disables the cache
+	void setBlockCache (unsigned kib_);
+
+	/// \brief Set MODE Z compression level
+	/// \param level_ zlib level from 0 (store) to 9 (smallest)
+	void setCompressLevel (unsigned level_);
+
+	/// \brief Set bounds for data socket buffer tuning
+	/// \param min_ Smallest buffer in KiB
+	/// \param max_ Largest buffer in KiB; equal bounds disable tuning
+	void setSockBufferBounds (unsigned min_, unsigned max_);
+
 #ifdef __3DS__
 	/// \brief Set whether to get mtime
 	/// \param getMTime_ Whether to get mtime
@@ -143,6 +241,45 @@ private:
 	/// \brief Listen port
 	std::uint16_t m_port;
 
+	/// \brief Number of file I/O workers
+	unsigned m_ioWorkers;
+
+	/// \brief Number of blocks to read ahead of a download
+	unsigned m_readAhead;
+
+	/// \brief Number of listing entries to stat ahead of the sender
+	unsigned m_listPrefetch;
+
+	/// \brief Write-behind memory cap in KiB
+	unsigned m_writeBehind;
+
+	/// \brief Number of session workers
+	unsigned m_sessionWorkers = 0;
+
+	/// \brief Session worker affinity mask
+	unsigned m_workerAffinity = 0;
+
+	/// \brief Session balance policy
+	SessionBalance m_sessionBalance = SessionBalance::LEAST_LOADED;
+
+	/// \brief Number of directory listings to cache
+	unsigned m_listingCache = 16;
+
+	/// \brief Whether uploads announced with ALLO are preallocated
+	bool m_preallocate = true;
+
+	/// \brief Block cache size in KiB
+	unsigned m_blockCache;
+
+	/// \brief Smallest data socket buffer in KiB
+	unsigned m_sockBufferMin;
+
+	/// \brief Largest data socket buffer in KiB
+	unsigned m_sockBufferMax;
+
+	/// \brief MODE Z compression level
+	unsigned m_compressLevel;
+
 #ifdef __3DS__
 	/// \brief Whether to get mtime
 	bool m_getMTime = true;
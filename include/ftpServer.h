@@ -23,6 +23,8 @@
 #include "ftpConfig.h"
 #include "ftpSession.h"
 #include "platform.h"
+#include "pollSet.h"
+#include "sessionWorker.h"
 #include "socket.h"
 
 #ifndef CLASSIC
@@ -96,6 +98,10 @@ private:
 	/// \brief Thread entry point
 	void threadFunc ();
 
+	/// \brief Hand new session to the server thread or a session worker
+	/// \param session_ Session to add
+	void addSession (UniqueFtpSession session_);
+
 #ifndef __NDS__
 	/// \brief Thread
 	platform::Thread m_thread;
@@ -118,9 +124,23 @@ private:
 	/// \brief ImGui window name
 	std::string m_name;
 
+	/// \brief Poll set for sessions run on the server thread
+	PollSet m_pollSet;
+
 	/// \brief Sessions
 	std::vector<UniqueFtpSession> m_sessions;
 
+#ifndef __NDS__
+	/// \brief Session workers; empty when sessions run on the server thread
+	std::vector<UniqueSessionWorker> m_workers;
+
+	/// \brief Session balance policy
+	FtpConfig::SessionBalance m_sessionBalance = FtpConfig::SessionBalance::LEAST_LOADED;
+
+	/// \brief Worker that gets the next session under round-robin
+	std::size_t m_nextWorker = 0;
+#endif
+
 	/// \brief Whether thread should quit
 	std::atomic_bool m_quit = false;
 
@@ -20,11 +20,15 @@
 
 #pragma once
 
+#include "fileWorker.h"
 #include "fs.h"
 #include "ftpConfig.h"
 #include "ioBuffer.h"
+#include "listingCache.h"
 #include "platform.h"
+#include "pollSet.h"
 #include "socket.h"
+#include "zStream.h"
 
 #if __has_include(<glob.h>)
 #include <glob.h>
@@ -37,6 +41,7 @@
 using stat_t = struct stat;
 
 #include <chrono>
+#include <cstdint>
 #include <ctime>
 #include <memory>
 #include <optional>
@@ -68,8 +73,9 @@ public:
 	static UniqueFtpSession create (FtpConfig &config_, UniqueSocket commandSocket_);
 
 	/// \brief Poll for activity
+	/// \param pollSet_ Poll set owned by the calling thread
 	/// \param sessions_ Sessions to poll
-	static bool poll (std::vector<UniqueFtpSession> const &sessions_);
+	static bool poll (PollSet &pollSet_, std::vector<UniqueFtpSession> const &sessions_);
 
 private:
 	/// \brief Command buffer size
@@ -112,6 +118,12 @@ private:
 	constexpr static auto POSITION_HISTORY = 300;
 #endif
 
+	/// \brief Bytes a data transfer may move per scheduling round
+	constexpr static std::int64_t TRANSFER_QUANTUM = 2 * XFER_BUFFERSIZE;
+
+	/// \brief Smallest amount to read from or write to a file at once
+	constexpr static std::size_t MIN_XFER_CHUNK = 4096;
+
 	/// \brief Session state
 	enum class State
 	{
@@ -128,6 +140,16 @@ private:
 		APPE,
 	};
 
+	/// \brief Download I/O path
+	enum class RetrieveMode
+	{
+		STDIO,     ///< Buffered stdio reads
+		DIRECT,    ///< Unbuffered reads straight into the transfer buffer
+		READAHEAD, ///< Blocks read ahead by the file workers
+		SENDFILE,  ///< Kernel copy from file to socket
+		CACHED,    ///< Blocks shared through the block cache
+	};
+
 	/// \brief Transfer directory mode
 	enum class XferDirMode
 	{
@@ -171,6 +193,60 @@ private:
 	/// \brief Connect data socket
 	bool dataConnect ();
 
+	/// \brief Apply the tuned buffer size and window scale to a data or listening socket
+	/// \param socket_ Socket to set up
+	void setupDataSocket (Socket &socket_);
+
+	/// \brief Resize the transfer chunk and data socket buffer to the measured throughput
+	void tuneTransfer ();
+
+	/// \brief Send data from m_xferBuffer, compressing it in MODE Z
+	/// \returns Number of bytes consumed from m_xferBuffer, or -1 with errno set
+	std::make_signed_t<std::size_t> sendData ();
+
+	/// \brief Send whatever MODE Z still holds back at the end of a transfer
+	/// \returns false with errno set if the data could not be sent yet (EWOULDBLOCK) or failed
+	bool flushData ();
+
+	/// \brief Receive data into m_xferBuffer, decompressing it in MODE Z
+	/// \returns Number of bytes added to m_xferBuffer, 0 at end of data, or -1 with errno set
+	std::make_signed_t<std::size_t> recvData ();
+
+	/// \brief Finish a list or download transfer
+	/// \param code_ Success response code
+	/// \returns false
+	bool endTransfer (int code_);
+
+#if FTPD_HAS_ZLIB
+	/// \brief Start MODE Z stream for the current transfer
+	/// \param direction_ Whether to compress or decompress
+	bool startZStream (ZStream::Direction direction_);
+#endif
+
+	/// \brief Start checksumming a file for HASH or XCRC/XMD5/XSHA
+	/// \param path_ Path argument
+	/// \param algorithm_ Checksum algorithm
+	/// \param start_ First byte to hash
+	/// \param end_ One past the last byte to hash, clamped to the file size
+	/// \param hash_ Whether to reply in HASH format
+	void startHash (char const *path_,
+	    Checksum::Algorithm algorithm_,
+	    std::uint64_t start_,
+	    std::uint64_t end_,
+	    bool hash_);
+
+	/// \brief Parse and run an XCRC/XMD5/XSHA command
+	/// \param args_ Command arguments: path, optionally quoted and followed by a range
+	/// \param algorithm_ Checksum algorithm
+	void xhash (char const *args_, Checksum::Algorithm algorithm_);
+
+	/// \brief Advance the pending checksum and reply once it is done
+	void pollHash ();
+
+	/// \brief Get printable name of a download I/O path
+	/// \param mode_ Download I/O path
+	static char const *retrieveModeName (RetrieveMode mode_);
+
 	/// \brief Perform stat and apply tz offset to mtime
 	/// \param path_ Path to stat
 	/// \param st_ Output stat
@@ -192,6 +268,11 @@ private:
 	/// \param type_ MLST type
 	int fillDirent (std::string const &path_, char const *type_ = nullptr);
 
+	/// \brief Start reading a directory listing, from the listing cache if possible
+	/// \param path_ Resolved directory path
+	/// \param st_ Directory status; nullptr bypasses the cache
+	bool openListing (std::string const &path_, stat_t const *st_);
+
 	/// \brief Transfer file
 	/// \param args_ Command arguments
 	/// \param mode_ Transfer file mode
@@ -210,6 +291,13 @@ private:
 	/// \brief Write response
 	void writeResponse ();
 
+	/// \brief Write queued responses without waiting for the socket to poll writable
+	void flushResponses ();
+
+	/// \brief Make room for a response by writing queued ones early if the buffer is half full
+	/// \returns false if the command socket closed
+	bool reserveResponse ();
+
 	/// \brief Send response
 	/// \param fmt_ Message format
 	__attribute__ ((format (printf, 2, 3))) void sendResponse (char const *fmt_, ...);
@@ -221,6 +309,33 @@ private:
 	/// \brief Transfer function
 	bool (FtpSession::*m_transfer) () = nullptr;
 
+	/// \brief Bytes the transfer may still move before yielding to other sessions
+	std::int64_t m_deficit = 0;
+
+	/// \brief Data socket buffer size; carried over between transfers
+	std::size_t m_sockBufferSize = SOCK_BUFFERSIZE;
+
+	/// \brief Smallest data socket buffer size
+	std::size_t m_sockBufferMin = SOCK_BUFFERSIZE;
+
+	/// \brief Largest data socket buffer size
+	std::size_t m_sockBufferMax = SOCK_BUFFERSIZE;
+
+	/// \brief Amount to read from or write to the file at once
+	std::size_t m_xferChunk = XFER_BUFFERSIZE / 2;
+
+	/// \brief Start of the current transfer
+	platform::steady_clock::time_point m_xferStart;
+
+	/// \brief Time of the last tuning sample
+	platform::steady_clock::time_point m_tuneTime;
+
+	/// \brief File position at the last tuning sample
+	std::uint64_t m_tunePosition = 0;
+
+	/// \brief Whether any of the session's sockets were ready in the current poll
+	bool m_handled = false;
+
 	/// \brief Transfer directory list
 	bool listTransfer ();
 
@@ -262,7 +377,7 @@ private:
 	IOBuffer m_responseBuffer;
 
 	/// \brief Transfer buffer
-	IOBuffer m_xferBuffer;
+	RingBuffer m_xferBuffer;
 
 	/// \brief Address from last PORT command
 	SockAddr m_portAddr;
@@ -313,7 +428,84 @@ private:
 	fs::File m_file;
 
 	/// \brief Directory being transferred
-	fs::Dir m_dir;
+	fs::DirLister m_dir;
+
+	/// \brief Cached listing being transferred instead of m_dir
+	SharedDirSnapshot m_listing;
+
+	/// \brief Next entry of m_listing to send
+	std::size_t m_listingIndex = 0;
+
+	/// \brief Snapshot of m_dir being collected for the listing cache
+	std::shared_ptr<DirSnapshot> m_listingBuild;
+
+	/// \brief Listing cache generation when m_dir was opened
+	std::uint64_t m_listingGeneration = 0;
+
+	/// \brief Entries statted ahead of the current listing, used instead of m_dir
+	std::unique_ptr<StatPrefetch> m_statPrefetch;
+
+	/// \brief Blocks read ahead of the current download
+	std::unique_ptr<ReadAhead> m_readAhead;
+
+	/// \brief Blocks waiting to be written for the current upload
+	std::unique_ptr<WriteBehind> m_writeBehind;
+
+	/// \brief Blocks loaded ahead of the current download into the block cache
+	std::unique_ptr<CachePrefetch> m_cachePrefetch;
+
+	/// \brief Block cache block being sent
+	SharedFileBlock m_cacheBlock;
+
+	/// \brief Index of m_cacheBlock
+	std::uint64_t m_cacheIndex = 0;
+
+	/// \brief Mtime of the file being sent through the block cache
+	std::time_t m_cacheMtime = 0;
+
+	/// \brief Size announced with ALLO for the next upload
+	std::uint64_t m_allocSize = 0;
+
+	/// \brief Size of the file being uploaded before it was preallocated
+	std::uint64_t m_preallocFloor = 0;
+
+	/// \brief Whether the file being uploaded was preallocated
+	bool m_preallocated = false;
+
+	/// \brief Pending checksum; later commands wait until it has been answered
+	std::unique_ptr<FileHash> m_fileHash;
+
+	/// \brief Reply to send before the digest
+	std::string m_hashPrefix;
+
+	/// \brief Reply to send after the digest
+	std::string m_hashSuffix;
+
+	/// \brief Algorithm selected with OPTS HASH
+	Checksum::Algorithm m_hashAlgorithm = Checksum::Algorithm::SHA1;
+
+	/// \brief Start of the range set with RANG
+	std::uint64_t m_rangeStart = 0;
+
+	/// \brief End of the range set with RANG (exclusive), or 0 if none is set
+	std::uint64_t m_rangeEnd = 0;
+
+	/// \brief Whether m_fileHash is run from the network thread
+	bool m_hashInline = false;
+
+#if FTPD_HAS_ZLIB
+	/// \brief MODE Z stream of the current transfer
+	std::unique_ptr<ZStream> m_zStream;
+
+	/// \brief Compressed side of the current transfer
+	std::unique_ptr<RingBuffer> m_zBuffer;
+#endif
+
+	/// \brief MODE Z compression level set with OPTS, or -1 to use the config
+	int m_zLevel = -1;
+
+	/// \brief Whether MODE Z is active
+	bool m_modeZ = false;
 
 #if FTPD_HAS_GLOB
 	/// \brief Glob wrappre
@@ -349,6 +541,9 @@ private:
 	/// \brief Directory transfer mode
 	XferDirMode m_xferDirMode;
 
+	/// \brief Download I/O path of the current RETR
+	RetrieveMode m_retrieveMode = RetrieveMode::STDIO;
+
 	/// \brief Last activity timestamp
 	time_t m_timestamp;
 
@@ -409,6 +604,10 @@ private:
 	/// \param args_ Command arguments
 	void FEAT (char const *args_);
 
+	/// \brief Checksum a file
+	/// \param args_ Command arguments
+	void HASH (char const *args_);
+
 	/// \brief Print server help
 	/// \param args_ Command arguments
 	void HELP (char const *args_);
@@ -469,6 +668,10 @@ private:
 	/// \param args_ Command arguments
 	void QUIT (char const *args_);
 
+	/// \brief Set byte range for HASH
+	/// \param args_ Command arguments
+	void RANG (char const *args_);
+
 	/// \brief Restart a file transfer
 	/// \param args_ Command arguments
 	void REST (char const *args_);
@@ -530,7 +733,47 @@ private:
 	/// \param args_ Command arguments
 	void USER (char const *args_);
 
-	/// \brief Map of command handlers
-	static std::vector<std::pair<std::string_view, void (FtpSession::*) (char const *)>> const
-	    handlers;
+	/// \brief CRC32 of a file
+	/// \param args_ Command arguments
+	void XCRC (char const *args_);
+
+	/// \brief MD5 of a file
+	/// \param args_ Command arguments
+	void XMD5 (char const *args_);
+
+	/// \brief SHA-1 of a file
+	/// \param args_ Command arguments
+	void XSHA1 (char const *args_);
+
+	/// \brief SHA-256 of a file
+	/// \param args_ Command arguments
+	void XSHA256 (char const *args_);
+
+	/// \brief Command may be issued during a data transfer
+	constexpr static unsigned CMD_TRANSFER = 1u << 0;
+	/// \brief Command requires a login
+	constexpr static unsigned CMD_AUTH = 1u << 1;
+	/// \brief Command clears a pending RNFR
+	constexpr static unsigned CMD_CLEAR_RNFR = 1u << 2;
+
+	/// \brief Command handler
+	struct CommandHandler
+	{
+		/// \brief Command name
+		std::string_view name;
+
+		/// \brief Handler
+		void (FtpSession::*handler) (char const *);
+
+		/// \brief CMD_* flags
+		unsigned flags;
+	};
+
+	/// \brief Find command handler
+	/// \param name_ Command name, in any case
+	/// \returns nullptr if there is no such command
+	static CommandHandler const *findHandler (std::string_view name_);
+
+	/// \brief Command handlers
+	static CommandHandler const handlers[];
 };
@@ -20,8 +20,12 @@
 
 #pragma once
 
+#include "bufferPool.h"
+
+#include <array>
 #include <cstddef>
 #include <memory>
+#include <span>
 
 /// \brief I/O buffer
 /// [unusable][usedArea][freeArea]
@@ -76,7 +80,7 @@ public:
 
 private:
 	/// \brief Buffer
-	std::unique_ptr<char[]> m_buffer;
+	BufferPool::UniqueBuffer m_buffer;
 
 	/// \brief Buffer size
 	std::size_t const m_size;
@@ -86,3 +90,69 @@ private:
 	/// \brief Start of freeArea
 	std::size_t m_end = 0;
 };
+
+/// \brief Wrap-around buffer
+/// Consumed space is reused in place, so data is never moved to make room. The readable and
+/// writable regions may each be split in two where they wrap past the end of the buffer.
+class RingBuffer
+{
+public:
+	/// \brief Up to two areas, in order
+	using Areas = std::array<std::span<char>, 2>;
+
+	~RingBuffer ();
+
+	/// \brief Parameterized constructor
+	/// \param size_ Buffer size
+	RingBuffer (std::size_t size_);
+
+	/// \brief Get pointer to contiguous writable area
+	char *freeArea () const;
+	/// \brief Get size of contiguous writable area
+	std::size_t freeSize () const;
+	/// \brief Get total size of writable areas
+	std::size_t freeTotal () const;
+	/// \brief Get writable areas
+	/// \param[out] areas_ Writable areas
+	/// \returns Number of areas
+	unsigned freeAreas (Areas &areas_) const;
+
+	/// \brief Get pointer to contiguous readable area
+	char *usedArea () const;
+	/// \brief Get size of contiguous readable area
+	std::size_t usedSize () const;
+	/// \brief Get total size of readable areas
+	std::size_t usedTotal () const;
+	/// \brief Get readable areas
+	/// \param[out] areas_ Readable areas
+	/// \returns Number of areas
+	unsigned usedAreas (Areas &areas_) const;
+
+	/// \brief Consume data from the beginning of the readable areas
+	/// \param size_ Size to consume
+	void markFree (std::size_t size_);
+	/// \brief Produce data to the end of the readable areas from the writable areas
+	/// \param size_ Size to produce
+	void markUsed (std::size_t size_);
+
+	/// \brief Whether readable areas are empty
+	bool empty () const;
+
+	/// \brief Get buffer capacity
+	std::size_t capacity () const;
+
+	/// \brief Clear buffer; readable areas become empty
+	void clear ();
+
+private:
+	/// \brief Buffer
+	BufferPool::UniqueBuffer m_buffer;
+
+	/// \brief Buffer size
+	std::size_t const m_size;
+
+	/// \brief Start of readable areas
+	std::size_t m_start = 0;
+	/// \brief Size of readable areas
+	std::size_t m_used = 0;
+};
@@ -0,0 +1,95 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// \brief Snapshot of a directory listing
+struct DirSnapshot
+{
+	/// \brief Directory entry
+	struct Entry
+	{
+		/// \brief Entry name
+		std::string name;
+
+		/// \brief Entry status
+		struct stat st;
+	};
+
+	/// \brief Entries, excluding . and ..
+	std::vector<Entry> entries;
+
+	/// \brief Directory mtime when the snapshot was taken
+	std::time_t mtime = 0;
+};
+
+using SharedDirSnapshot = std::shared_ptr<DirSnapshot const>;
+
+/// \brief LRU cache of directory snapshots shared by all sessions
+/// Entries are keyed by resolved path. A lookup misses if the directory mtime changed, and every
+/// command that changes a directory invalidates it explicitly, since not every filesystem updates
+/// directory mtimes. Snapshots also expire after a short time, since files rewritten in place by
+/// something other than ftpd leave the directory mtime alone.
+class ListingCache
+{
+public:
+	/// \brief Set number of directories to keep
+	/// \param capacity_ Number of directories; 0 disables the cache
+	static void setCapacity (std::size_t capacity_);
+
+	/// \brief Look up a directory
+	/// \param path_ Resolved directory path
+	/// \param mtime_ Current directory mtime
+	/// \returns nullptr on a miss
+	/// \note Drops the snapshot if it is stale or expired
+	static SharedDirSnapshot lookup (std::string const &path_, std::time_t mtime_);
+
+	/// \brief Current invalidation generation
+	/// \note Pass to store () so a listing read across an invalidation is not cached
+	static std::uint64_t generation ();
+
+	/// \brief Store a directory
+	/// \param path_ Resolved directory path
+	/// \param snapshot_ Snapshot to store
+	/// \param generation_ generation () from before the directory was read
+	static void
+	    store (std::string const &path_, SharedDirSnapshot snapshot_, std::uint64_t generation_);
+
+	/// \brief Invalidate a changed path
+	/// \param path_ Resolved path that was created, changed or removed
+	/// \note Drops the path itself, its parent directory and anything below it
+	static void invalidate (std::string_view path_);
+
+	/// \brief Number of lookups that hit
+	static std::uint64_t hits ();
+
+	/// \brief Number of lookups that missed
+	static std::uint64_t misses ();
+};
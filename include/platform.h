@@ -126,6 +126,11 @@ public:
 	/// \param func_ Thread entrypoint
 	Thread (std::function<void ()> &&func_);
 
+	/// \brief Parameterized constructor
+	/// \param func_ Thread entrypoint
+	/// \param cpuMask_ Cores the thread may run on, one bit per core; 0 uses the default
+	Thread (std::function<void ()> &&func_, unsigned cpuMask_);
+
 	Thread (Thread const &that_) = delete;
 
 	/// \brief Move constructor
@@ -0,0 +1,115 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "socket.h"
+
+#if __has_include(<sys/epoll.h>)
+#include <sys/epoll.h>
+#define FTPD_HAS_EPOLL 1
+#else
+#define FTPD_HAS_EPOLL 0
+#endif
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+/// \brief Set of sockets polled together
+/// Interest is kept between polls and only changed through update (), so a poll does not rebuild
+/// the descriptor list. Each ready socket is reported with the user pointer it was registered
+/// with, so callers can dispatch without searching.
+/// Uses level-triggered epoll where available, so a poll only costs the ready sockets; other
+/// targets use ::poll.
+class PollSet
+{
+public:
+	/// \brief Ready socket
+	struct Event
+	{
+		/// \brief Ready socket; nullptr if it was removed after the poll
+		Socket *socket;
+
+		/// \brief User pointer passed to update ()
+		void *user;
+
+		/// \brief Output events
+		int revents;
+	};
+
+	~PollSet ();
+
+	PollSet ();
+
+	PollSet (PollSet const &that_) = delete;
+
+	PollSet &operator= (PollSet const &that_) = delete;
+
+	/// \brief Set the events to poll for on a socket
+	/// \param socket_ Socket to poll
+	/// \param events_ Input events; 0 removes the socket
+	/// \param user_ User pointer reported with events
+	/// \note A socket can belong to only one set at a time
+	void update (Socket &socket_, int events_, void *user_);
+
+	/// \brief Stop polling a socket
+	/// \param socket_ Socket to remove
+	void remove (Socket &socket_);
+
+	/// \brief Whether no sockets are registered
+	bool empty () const;
+
+	/// \brief Poll registered sockets
+	/// \param timeout_ Poll timeout
+	/// \returns Number of ready sockets, or -1 on error
+	int poll (std::chrono::milliseconds timeout_);
+
+	/// \brief Sockets that were ready after the last poll ()
+	std::vector<Event> const &ready () const;
+
+private:
+	/// \brief Registered socket
+	struct Entry
+	{
+		/// \brief Socket
+		Socket *socket;
+
+		/// \brief User pointer
+		void *user;
+	};
+
+	/// \brief Registered descriptors and their events; parallel to m_entries
+	std::vector<pollfd> m_pollfds;
+
+	/// \brief Registered sockets
+	std::vector<Entry> m_entries;
+
+	/// \brief Ready sockets
+	std::vector<Event> m_ready;
+
+#if FTPD_HAS_EPOLL
+	/// \brief epoll instance; -1 falls back to ::poll
+	int m_epollFd = -1;
+
+	/// \brief epoll_wait output
+	std::vector<epoll_event> m_epollEvents;
+#endif
+};
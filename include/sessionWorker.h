@@ -0,0 +1,96 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#ifndef __NDS__
+#include "ftpSession.h"
+#include "platform.h"
+#include "pollSet.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class SessionWorker;
+using UniqueSessionWorker = std::unique_ptr<SessionWorker>;
+
+/// \brief Thread that polls its own set of sessions
+/// The server thread accepts connections and hands each new session to a worker, so transfers
+/// for different clients can run on different cores.
+class SessionWorker
+{
+public:
+	~SessionWorker ();
+
+	/// \brief Parameterized constructor
+	/// \param cpuMask_ Cores the worker may run on; 0 uses the platform default
+	explicit SessionWorker (unsigned cpuMask_);
+
+	SessionWorker (SessionWorker const &that_) = delete;
+
+	SessionWorker &operator= (SessionWorker const &that_) = delete;
+
+	/// \brief Hand session to worker
+	/// \param session_ Session to add
+	void add (UniqueFtpSession session_);
+
+	/// \brief Destroy all sessions
+	void clear ();
+
+	/// \brief Number of sessions owned by the worker
+	std::size_t load () const;
+
+	/// \brief Draw sessions
+	void draw ();
+
+private:
+	/// \brief Worker loop
+	void loop ();
+
+	/// \brief Thread entry point
+	void threadFunc ();
+
+	/// \brief Mutex
+	platform::Mutex m_lock;
+
+	/// \brief Poll set for the worker's sessions
+	PollSet m_pollSet;
+
+	/// \brief Sessions being polled
+	std::vector<UniqueFtpSession> m_sessions;
+
+	/// \brief Sessions handed over since the last loop
+	std::vector<UniqueFtpSession> m_pending;
+
+	/// \brief Number of sessions, including pending ones
+	std::atomic<std::size_t> m_load = 0;
+
+	/// \brief Whether clear () was requested
+	std::atomic_bool m_clear = false;
+
+	/// \brief Whether thread should quit
+	std::atomic_bool m_quit = false;
+
+	/// \brief Thread
+	platform::Thread m_thread;
+};
+#endif
@@ -24,6 +24,7 @@
 #include "sockAddr.h"
 
 #include <chrono>
+#include <cstdint>
 #include <memory>
 
 #ifdef __NDS__
@@ -47,6 +48,26 @@ extern "C" int poll (pollfd *fds_, nfds_t nfds_, int timeout_);
 #include <poll.h>
 #endif
 
+#if __has_include(<sys/sendfile.h>)
+#define FTPD_HAS_SENDFILE 1
+#else
+#define FTPD_HAS_SENDFILE 0
+#endif
+
+#if __has_include(<netinet/tcp.h>) && defined(__linux__)
+#define FTPD_HAS_TCP_INFO 1
+#else
+#define FTPD_HAS_TCP_INFO 0
+#endif
+
+// the Wii U socket layer has no vectored I/O; RingBuffer falls back to one area per call
+#if __has_include(<sys/uio.h>) && !defined(__WIIU__)
+#define FTPD_HAS_READV 1
+#else
+#define FTPD_HAS_READV 0
+#endif
+
+class PollSet;
 class Socket;
 using UniqueSocket = std::unique_ptr<Socket>;
 using SharedSocket = std::shared_ptr<Socket>;
@@ -109,6 +130,10 @@ public:
 
 	bool setWinScale (const int val);
 
+	/// \brief Set whether small writes are sent without waiting to coalesce them (TCP_NODELAY)
+	/// \param noDelay_ Whether to disable Nagle's algorithm
+	bool setNoDelay (bool noDelay_ = true);
+
 	/// \brief Set reuse address in subsequent bind
 	/// \param reuse_ Whether to reuse address
 	bool setReuseAddress (bool reuse_ = true);
@@ -121,6 +146,10 @@ public:
 	/// \param size_ Buffer size
 	bool setSendBufferSize (std::size_t size_);
 
+	/// \brief Smoothed round-trip time reported by the TCP stack
+	/// \returns 0 if unknown
+	std::chrono::microseconds rtt () const;
+
 #ifndef __NDS__
 	/// \brief Join multicast group
 	/// \param addr_ Multicast group address
@@ -144,6 +173,11 @@ public:
 	/// \param oob_ Whether to read from out-of-band
 	std::make_signed_t<std::size_t> read (IOBuffer &buffer_, bool oob_ = false);
 
+	/// \brief Read data
+	/// \param buffer_ Output buffer
+	/// \note Fills both writable areas in one call where supported
+	std::make_signed_t<std::size_t> read (RingBuffer &buffer_);
+
 	/// \brief Read data
 	/// \param buffer_ Output buffer
 	/// \param size_ Size to read
@@ -160,6 +194,20 @@ public:
 	/// \param size_ Size to write
 	std::make_signed_t<std::size_t> write (IOBuffer &buffer_);
 
+	/// \brief Write data
+	/// \param buffer_ Input buffer
+	/// \note Sends both readable areas in one call where supported
+	std::make_signed_t<std::size_t> write (RingBuffer &buffer_);
+
+#if FTPD_HAS_SENDFILE
+	/// \brief Send data directly from a file
+	/// \param fd_ Source file descriptor
+	/// \param[in,out] offset_ File offset to send from; advanced by the amount sent
+	/// \param size_ Maximum size to send
+	/// \note Fails with EINVAL or ENOSYS if the file cannot be sent this way
+	std::make_signed_t<std::size_t> sendFile (int fd_, std::uint64_t &offset_, std::size_t size_);
+#endif
+
 	/// \brief Write data
 	/// \param buffer_ Input buffer
 	/// \param size_ Size to write
@@ -183,6 +231,8 @@ public:
 	static int poll (PollInfo *info_, std::size_t count_, std::chrono::milliseconds timeout_);
 
 private:
+	friend class PollSet;
+
 	Socket () = delete;
 
 	/// \brief Parameterized constructor
@@ -211,6 +261,12 @@ private:
 	/// \param Socket fd
 	int const m_fd;
 
+	/// \param Poll set the socket is registered with
+	PollSet *m_pollSet = nullptr;
+
+	/// \param Index in the poll set
+	std::size_t m_pollSlot = 0;
+
 	/// \param Whether listening
 	bool m_listening : 1;
 
@@ -0,0 +1,106 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ioBuffer.h"
+
+#if __has_include(<zlib.h>)
+#define FTPD_HAS_ZLIB 1
+#include <zlib.h>
+#else
+#define FTPD_HAS_ZLIB 0
+#endif
+
+#if FTPD_HAS_ZLIB
+/// \brief Streaming deflate/inflate for MODE Z transfers
+class ZStream
+{
+public:
+	/// \brief Stream direction
+	enum class Direction
+	{
+		DEFLATE,
+		INFLATE,
+	};
+
+	~ZStream ();
+
+	/// \brief Parameterized constructor
+	/// \param direction_ Stream direction
+	/// \param level_ Compression level; ignored for inflate
+	ZStream (Direction direction_, int level_);
+
+	ZStream (ZStream const &that_) = delete;
+
+	ZStream &operator= (ZStream const &that_) = delete;
+
+	/// \brief Whether zlib initialized
+	bool valid () const;
+
+	/// \brief Whether the end of the compressed stream was reached
+	bool done () const;
+
+	/// \brief Move data through the stream
+	/// \param in_ Input; consumed data is freed
+	/// \param out_ Output; produced data is marked used
+	/// \param finish_ Whether no more input will follow
+	/// \returns false on a stream error
+	bool process (RingBuffer &in_, RingBuffer &out_, bool finish_);
+
+	/// \brief Number of input samples sent uncompressed
+	unsigned skipped () const;
+
+private:
+	/// \brief Pick the level for the next input sample
+	void adapt ();
+
+	/// \brief zlib stream
+	z_stream m_stream{};
+
+	/// \brief Stream direction
+	Direction const m_direction;
+
+	/// \brief Configured compression level
+	int const m_level;
+
+	/// \brief Level to switch to before the next deflate call, or -1
+	int m_pendingLevel = -1;
+
+	/// \brief Input consumed at the start of the current sample
+	/// \note zlib's counters wrap, so these are only compared by difference
+	uLong m_sampleIn = 0;
+
+	/// \brief Output produced at the start of the current sample
+	uLong m_sampleOut = 0;
+
+	/// \brief Samples left to send uncompressed
+	unsigned m_skip = 0;
+
+	/// \brief Number of samples sent uncompressed
+	unsigned m_skipped = 0;
+
+	/// \brief Whether zlib initialized
+	bool m_valid = false;
+
+	/// \brief Whether the end of the stream was reached
+	bool m_done = false;
+};
+#endif
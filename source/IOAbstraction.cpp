@@ -1,141 +1,408 @@
 #include "IOAbstraction.h"
-#include <algorithm>
-#include <map>
-#include <memory>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <string_view>
 #include <sys/dirent.h>
 #include <sys/unistd.h>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#define FTPD_HAS_FSTATAT 1
+#else
+#define FTPD_HAS_FSTATAT 0
+#endif
+
 class VirtualDirectory
 {
 public:
-	VirtualDirectory (const std::vector<std::string> &directories)
+	[[nodiscard]] DIR *getAsDir ()
 	{
-		mDirectories.push_back (".");
-		mDirectories.push_back ("..");
-		mDirectories.insert (mDirectories.end (), directories.begin (), directories.end ());
+		return &mDirPtr;
+	}
 
-		mCurIterator = mDirectories.begin ();
+	bool acquire ()
+	{
+		bool expected = false;
+		return mInUse.compare_exchange_strong (expected, true);
 	}
 
-	[[nodiscard]] const DIR *getAsDir () const
+	void open (const std::vector<std::string> &directories)
 	{
-		return &mDirPtr;
+		mDirPtr      = {};
+		mDirectories = &directories;
+		mIndex       = 0;
+	}
+
+	void release ()
+	{
+		mDirectories = nullptr;
+		mInUse       = false;
 	}
 
 	struct dirent *readdir ()
 	{
-		if (mCurIterator == mDirectories.end ())
+		// "." and ".." come before the entries
+		if (mIndex >= mDirectories->size () + 2)
 		{
 			return nullptr;
 		}
+		const char *name = mIndex == 0 ? "." :
+		                   mIndex == 1 ? ".." :
+		                                 (*mDirectories)[mIndex - 2].c_str ();
 		mDir = {};
-		snprintf (mDir.d_name, sizeof (mDir.d_name), "%s", mCurIterator->c_str ());
+		snprintf (mDir.d_name, sizeof (mDir.d_name), "%s", name);
 #ifdef _DIRENT_HAVE_D_STAT
 		mDir.d_stat.st_mode = _IFDIR;
 #endif
-		mCurIterator++;
+		mIndex++;
 		mDirPtr.position++;
 		return &mDir;
 	}
 
 private:
-	DIR mDirPtr = {};
-	std::vector<std::string> mDirectories;
-	struct dirent mDir = {};
-	std::vector<std::string>::iterator mCurIterator{};
+	DIR mDirPtr                                  = {};
+	struct dirent mDir                           = {};
+	size_t mIndex                                = 0;
+	const std::vector<std::string> *mDirectories = nullptr;
+	std::atomic_bool mInUse                      = false;
 };
 
-std::vector<std::unique_ptr<VirtualDirectory>> sOpenVirtualDirectories;
-std::mutex sOpenVirtualDirectoriesMutex;
-std::map<std::string, std::vector<std::string>> sVirtualDirs;
-
-template <typename Container, typename Predicate>
-typename std::enable_if<std::is_same<Container, std::vector<typename Container::value_type>>::value,
-    bool>::type
-    remove_first_if (Container &container, Predicate pred)
+// Translated path kept on the stack, so filesystem calls don't allocate
+class ConvertedPath
 {
-	auto it = container.begin ();
-	while (it != container.end ())
+public:
+	explicit ConvertedPath (std::string_view inPath)
+	{
+#ifdef __WIIU__
+		// "/dev/rest" becomes "dev:/rest" and "/dev" becomes "dev:/"
+		if (inPath.starts_with ('/') && inPath.find (':') == std::string_view::npos)
+		{
+			auto const secondSlashPos = inPath.find ('/', 1);
+			auto const device         = inPath.substr (1, secondSlashPos - 1);
+			auto const rest = secondSlashPos == std::string_view::npos ? std::string_view ("/") :
+			                                                             inPath.substr (secondSlashPos);
+			append (device);
+			append (":");
+			append (rest);
+		}
+		else
+#endif
+		{
+			append (inPath);
+		}
+		mBuffer[mSize] = '\0';
+	}
+
+	[[nodiscard]] bool valid () const
+	{
+		return mValid;
+	}
+
+	[[nodiscard]] const char *c_str () const
+	{
+		return mBuffer.data ();
+	}
+
+	[[nodiscard]] std::string_view view () const
+	{
+		return {mBuffer.data (), mSize};
+	}
+
+private:
+	void append (std::string_view str)
 	{
-		if (pred (*it))
+		if (str.size () >= mBuffer.size () - mSize)
 		{
-			container.erase (it);
-			return true;
+			mValid = false;
+			return;
 		}
-		++it;
+		std::memcpy (mBuffer.data () + mSize, str.data (), str.size ());
+		mSize += str.size ();
 	}
 
-	return false;
+	std::array<char, 1024> mBuffer;
+	size_t mSize = 0;
+	bool mValid  = true;
+};
+
+// Lets the path tables be searched with a std::string_view
+struct PathHash
+{
+	using is_transparent = void;
+
+	size_t operator() (std::string_view path) const
+	{
+		return std::hash<std::string_view>{}(path);
+	}
+};
+
+// Open virtual directories live in a fixed pool, so a DIR* can be recognized as one by its
+// address alone instead of searching a locked list on every readdir/closedir.
+constexpr size_t VIRTUAL_DIRECTORY_SLOTS = 32;
+std::array<VirtualDirectory, VIRTUAL_DIRECTORY_SLOTS> sVirtualDirectoryPool;
+
+static VirtualDirectory *findVirtualDirectory (DIR *dirp)
+{
+	auto const addr  = reinterpret_cast<uintptr_t> (dirp);
+	auto const begin = reinterpret_cast<uintptr_t> (sVirtualDirectoryPool.data ());
+	if (addr < begin || addr >= begin + sizeof (sVirtualDirectoryPool))
+	{
+		return nullptr;
+	}
+	return &sVirtualDirectoryPool[(addr - begin) / sizeof (VirtualDirectory)];
 }
 
-template <typename Container, typename Predicate>
-bool remove_locked_first_if (std::mutex &mutex, Container &container, Predicate pred)
+struct VirtualPath
 {
-	std::lock_guard<std::mutex> lock (mutex);
-	return remove_first_if (container, pred);
+	std::string path;
+	std::vector<std::string> subDirectories;
+	size_t hash;
+};
+
+// Virtual paths are registered before the server starts, then finalizeVirtualPaths builds an
+// open-addressed index over them (slot holds entry index + 1, 0 is empty). Both are read-only
+// while the server runs, so lookups don't lock.
+std::vector<VirtualPath> sVirtualDirs;
+std::vector<uint16_t> sVirtualDirsIndex;
+
+static const VirtualPath *findVirtualPath (std::string_view path)
+{
+	if (sVirtualDirsIndex.empty ())
+	{
+		return nullptr;
+	}
+
+	auto const hash = PathHash{}(path);
+	auto const mask = sVirtualDirsIndex.size () - 1;
+	for (auto slot = hash & mask; sVirtualDirsIndex[slot] != 0; slot = (slot + 1) & mask)
+	{
+		auto const &entry = sVirtualDirs[sVirtualDirsIndex[slot] - 1];
+		if (entry.hash == hash && entry.path == path)
+		{
+			return &entry;
+		}
+	}
+	return nullptr;
 }
 
-static const DIR *getVirtualDir (const std::vector<std::string> &subDirectories)
+// Metadata cache keyed by converted path. Holds successful results (including EPERM directories
+// and virtual directories) and ENOENT misses for a short time, since the underlying stat can be
+// very slow on some devices.
+constexpr size_t STAT_CACHE_SIZE = 128;
+constexpr auto STAT_CACHE_TTL    = std::chrono::seconds (2);
+
+struct StatCacheEntry
+{
+	int result;
+	int error;
+	struct stat st;
+	std::chrono::steady_clock::time_point expires;
+	std::list<std::string>::iterator lruIt;
+};
+
+std::mutex sStatCacheMutex;
+std::unordered_map<std::string, StatCacheEntry, PathHash, std::equal_to<>> sStatCache;
+std::list<std::string> sStatCacheLRU;
+std::atomic_bool sStatCacheEnabled = true;
+std::atomic<uint64_t> sStatCacheHits   = 0;
+std::atomic<uint64_t> sStatCacheMisses = 0;
+
+static void eraseStatCacheEntry (decltype (sStatCache)::iterator it)
 {
-	auto virtDir = std::make_unique<VirtualDirectory> (subDirectories);
-	auto *result = virtDir->getAsDir ();
-	std::lock_guard lock (sOpenVirtualDirectoriesMutex);
-	sOpenVirtualDirectories.push_back (std::move (virtDir));
-	return result;
+	sStatCacheLRU.erase (it->second.lruIt);
+	sStatCache.erase (it);
 }
 
-std::string IOAbstraction::convertPath (std::string_view inPath)
+static bool lookupStatCache (std::string_view convertedPath, struct stat *sbuf, int &result)
 {
-#ifdef __WIIU__
-	if (!inPath.starts_with ('/') || inPath.find (':') != std::string::npos)
+	if (!sStatCacheEnabled)
 	{
-		return std::string (inPath);
+		return false;
 	}
-	std::string path      = std::string (inPath);
-	size_t secondSlashPos = path.find ('/', 1);
-	if (secondSlashPos != std::string::npos)
+
+	std::lock_guard lock (sStatCacheMutex);
+	auto it = sStatCache.find (convertedPath);
+	if (it == sStatCache.end ())
 	{
-		// Extract the substring between the first and second slashes
-		std::string prefix = path.substr (1, secondSlashPos - 1);
-		std::string suffix = path.substr (secondSlashPos);
+		++sStatCacheMisses;
+		return false;
+	}
 
-		// Concatenate the modified prefix and suffix
-		path = prefix + ":" + suffix;
+	if (std::chrono::steady_clock::now () >= it->second.expires)
+	{
+		eraseStatCacheEntry (it);
+		++sStatCacheMisses;
+		return false;
+	}
+
+	++sStatCacheHits;
+	sStatCacheLRU.splice (sStatCacheLRU.begin (), sStatCacheLRU, it->second.lruIt);
+
+	result = it->second.result;
+	if (result == 0)
+	{
+		*sbuf = it->second.st;
 	}
 	else
 	{
-		path = std::string (inPath.substr (1)) + ":/";
+		errno = it->second.error;
 	}
-	return path;
-#else
-	return std::string (inPath);
-#endif
+	return true;
 }
 
-int IOAbstraction::closedir (DIR *dirp)
+static void storeStatCache (std::string_view convertedPath,
+    const struct stat *sbuf,
+    int result,
+    int error)
+{
+	if (!sStatCacheEnabled)
+	{
+		return;
+	}
+
+	std::lock_guard lock (sStatCacheMutex);
+	auto it = sStatCache.find (convertedPath);
+	if (it != sStatCache.end ())
+	{
+		eraseStatCacheEntry (it);
+	}
+
+	sStatCacheLRU.emplace_front (convertedPath);
+
+	StatCacheEntry entry{};
+	entry.result  = result;
+	entry.error   = error;
+	entry.expires = std::chrono::steady_clock::now () + STAT_CACHE_TTL;
+	entry.lruIt   = sStatCacheLRU.begin ();
+	if (result == 0)
+	{
+		entry.st = *sbuf;
+	}
+	sStatCache.emplace (sStatCacheLRU.front (), entry);
+
+	while (sStatCache.size () > STAT_CACHE_SIZE)
+	{
+		sStatCache.erase (sStatCacheLRU.back ());
+		sStatCacheLRU.pop_back ();
+	}
+}
+
+// Drops the path, everything below it and its parent directory, whose mtime changed too.
+static void invalidateStatCache (std::string_view convertedPath)
+{
+	std::lock_guard lock (sStatCacheMutex);
+
+	std::string_view parent;
+	auto pos = convertedPath.find_last_of ('/');
+	if (pos != std::string_view::npos)
+	{
+		parent = convertedPath.substr (0, pos);
+		// keep the trailing slash of a device root like "sd:/"
+		if (!parent.empty () && parent.back () == ':')
+		{
+			parent = convertedPath.substr (0, pos + 1);
+		}
+	}
+
+	auto it = sStatCache.begin ();
+	while (it != sStatCache.end ())
+	{
+		std::string_view cached = it->first;
+		bool below = cached.size () > convertedPath.size () && cached.starts_with (convertedPath) &&
+		             cached[convertedPath.size ()] == '/';
+		if (cached == convertedPath || cached == parent || below)
+		{
+			auto next = std::next (it);
+			eraseStatCacheEntry (it);
+			it = next;
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+static DIR *getVirtualDir (const std::vector<std::string> &subDirectories)
 {
+	for (auto &dir : sVirtualDirectoryPool)
 	{
-		std::lock_guard lock (sOpenVirtualDirectoriesMutex);
-		if (remove_locked_first_if (sOpenVirtualDirectoriesMutex,
-		        sOpenVirtualDirectories,
-		        [dirp] (auto &cur) { return cur->getAsDir () == dirp; }))
+		if (dir.acquire ())
 		{
+			dir.open (subDirectories);
+			return dir.getAsDir ();
+		}
+	}
+	errno = EMFILE;
+	return nullptr;
+}
+
+// Stats an already converted path without touching the stat cache
+static int statConverted (const ConvertedPath &convertedPath, struct stat *sbuf)
+{
+	auto r = ::stat (convertedPath.c_str (), sbuf);
+	if (r < 0)
+	{
+		auto error = errno;
+		if (error == EPERM)
+		{
+			auto *dir = ::opendir (convertedPath.c_str ());
+			if (dir)
+			{
+				*sbuf = {};
+				// TODO: init other values?
+				sbuf->st_mode = _IFDIR;
+				::closedir (dir);
+				return 0;
+			}
+		}
+		if (findVirtualPath (convertedPath.view ()) != nullptr)
+		{
+			*sbuf = {};
+			// TODO: init other values?
+			sbuf->st_mode = _IFDIR;
 			return 0;
 		}
+		errno = error;
+	}
+	return r;
+}
+
+std::string IOAbstraction::convertPath (std::string_view inPath)
+{
+	return std::string (ConvertedPath (inPath).view ());
+}
+
+int IOAbstraction::closedir (DIR *dirp)
+{
+	if (auto *dir = findVirtualDirectory (dirp))
+	{
+		dir->release ();
+		return 0;
 	}
 	return ::closedir (dirp);
 }
 
 DIR *IOAbstraction::opendir (const char *dirname)
 {
-	auto convertedPath = convertPath (dirname);
-	auto *res          = ::opendir (convertedPath.c_str ());
+	ConvertedPath convertedPath (dirname);
+	if (!convertedPath.valid ())
+	{
+		errno = ENAMETOOLONG;
+		return nullptr;
+	}
+	auto *res = ::opendir (convertedPath.c_str ());
 	if (res == nullptr)
 	{
-		if (sVirtualDirs.count (convertedPath) > 0)
+		if (auto *virtualPath = findVirtualPath (convertedPath.view ()))
 		{
-			return (DIR *)getVirtualDir (sVirtualDirs[convertedPath]);
+			return getVirtualDir (virtualPath->subDirectories);
 		}
 	}
 	return res;
@@ -143,7 +410,17 @@ DIR *IOAbstraction::opendir (const char *dirname)
 
 FILE *IOAbstraction::fopen (const char *_name, const char *_type)
 {
-	return std::fopen (convertPath (_name).c_str (), _type);
+	ConvertedPath convertedPath (_name);
+	if (!convertedPath.valid ())
+	{
+		errno = ENAMETOOLONG;
+		return nullptr;
+	}
+	if (std::strpbrk (_type, "wa+") != nullptr)
+	{
+		invalidateStatCache (convertedPath.view ());
+	}
+	return std::fopen (convertedPath.c_str (), _type);
 }
 
 int IOAbstraction::fseek (FILE *f, long pos, int origin)
@@ -163,45 +440,38 @@ size_t IOAbstraction::fwrite (const void *buffer, size_t _size, size_t _n, FILE
 
 struct dirent *IOAbstraction::readdir (DIR *dirp)
 {
+	if (auto *dir = findVirtualDirectory (dirp))
 	{
-		std::lock_guard lock (sOpenVirtualDirectoriesMutex);
-		auto itr = std::find_if (sOpenVirtualDirectories.begin (),
-		    sOpenVirtualDirectories.end (),
-		    [dirp] (auto &cur) { return cur->getAsDir () == dirp; });
-		if (itr != sOpenVirtualDirectories.end ())
-		{
-			return (*itr)->readdir ();
-		}
+		return dir->readdir ();
 	}
-
 	return ::readdir (dirp);
 }
 
 int IOAbstraction::stat (const char *path, struct stat *sbuf)
 {
-	auto convertedPath = convertPath (path);
-	auto r             = ::stat (convertedPath.c_str (), sbuf);
-	if (r < 0)
+	ConvertedPath convertedPath (path);
+	if (!convertedPath.valid ())
 	{
-		if (errno == EPERM)
-		{
-			auto *dir = ::opendir (convertedPath.c_str ());
-			if (dir)
-			{
-				*sbuf = {};
-				// TODO: init other values?
-				sbuf->st_mode = _IFDIR;
-				::closedir (dir);
-				return 0;
-			}
-		}
-		if (sVirtualDirs.contains (convertedPath))
-		{
-			*sbuf = {};
-			// TODO: init other values?
-			sbuf->st_mode = _IFDIR;
-			return 0;
-		}
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	int cached;
+	if (lookupStatCache (convertedPath.view (), sbuf, cached))
+	{
+		return cached;
+	}
+
+	auto r = statConverted (convertedPath, sbuf);
+	if (r == 0)
+	{
+		storeStatCache (convertedPath.view (), sbuf, 0, 0);
+	}
+	else if (errno == ENOENT)
+	{
+		auto error = errno;
+		storeStatCache (convertedPath.view (), sbuf, r, error);
+		errno = error;
 	}
 	return r;
 }
@@ -211,35 +481,174 @@ int IOAbstraction::lstat (const char *path, struct stat *buf)
 	return IOAbstraction::stat (path, buf);
 }
 
+int IOAbstraction::statAt (DIR *dirp, std::string_view dirPath, const char *name, struct stat *buf)
+{
+#if FTPD_HAS_FSTATAT
+	// virtual directories have no handle to stat against
+	if (!findVirtualDirectory (dirp))
+	{
+		return ::fstatat (::dirfd (dirp), name, buf, 0);
+	}
+#else
+	(void)dirp;
+#endif
+
+	std::array<char, 1024> path;
+	auto const nameLength = std::strlen (name);
+	auto const slash      = dirPath.ends_with ('/') ? 0 : 1;
+	if (dirPath.size () + slash + nameLength >= path.size ())
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	std::memcpy (path.data (), dirPath.data (), dirPath.size ());
+	path[dirPath.size ()] = '/';
+	std::memcpy (path.data () + dirPath.size () + slash, name, nameLength + 1);
+
+	// listings stat every entry once, so bypass the cache instead of flushing it
+	ConvertedPath convertedPath (path.data ());
+	if (!convertedPath.valid ())
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return statConverted (convertedPath, buf);
+}
+
 void IOAbstraction::addVirtualPath (const std::string &virtualPath,
     const std::vector<std::string> &subDirectories)
 {
-	sVirtualDirs.insert (std::make_pair (virtualPath, subDirectories));
+	for (const auto &entry : sVirtualDirs)
+	{
+		if (entry.path == virtualPath)
+		{
+			return;
+		}
+	}
+	sVirtualDirs.push_back ({virtualPath, subDirectories, PathHash{}(virtualPath)});
+}
+
+void IOAbstraction::finalizeVirtualPaths ()
+{
+	// keep the index at most half full so probe chains stay short
+	size_t size = 8;
+	while (size < sVirtualDirs.size () * 2)
+	{
+		size *= 2;
+	}
+
+	sVirtualDirsIndex.assign (size, 0);
+	for (size_t i = 0; i < sVirtualDirs.size (); ++i)
+	{
+		auto slot = sVirtualDirs[i].hash & (size - 1);
+		while (sVirtualDirsIndex[slot] != 0)
+		{
+			slot = (slot + 1) & (size - 1);
+		}
+		sVirtualDirsIndex[slot] = static_cast<uint16_t> (i + 1);
+	}
 }
 
 void IOAbstraction::clear ()
 {
-	std::lock_guard lock (sOpenVirtualDirectoriesMutex);
-	sOpenVirtualDirectories.clear ();
+	for (auto &dir : sVirtualDirectoryPool)
+	{
+		dir.release ();
+	}
 	sVirtualDirs.clear ();
+	sVirtualDirsIndex.clear ();
+
+	std::lock_guard lock (sStatCacheMutex);
+	sStatCache.clear ();
+	sStatCacheLRU.clear ();
+}
+
+void IOAbstraction::setStatCacheEnabled (bool enabled)
+{
+	sStatCacheEnabled = enabled;
+	if (!enabled)
+	{
+		std::lock_guard lock (sStatCacheMutex);
+		sStatCache.clear ();
+		sStatCacheLRU.clear ();
+	}
+}
+
+bool IOAbstraction::statCacheEnabled ()
+{
+	return sStatCacheEnabled;
+}
+
+uint64_t IOAbstraction::statCacheHits ()
+{
+	return sStatCacheHits;
+}
+
+uint64_t IOAbstraction::statCacheMisses ()
+{
+	return sStatCacheMisses;
+}
+
+void IOAbstraction::invalidate (const char *path)
+{
+	ConvertedPath convertedPath (path);
+	if (convertedPath.valid ())
+	{
+		invalidateStatCache (convertedPath.view ());
+	}
 }
 
 int IOAbstraction::mkdir (const char *path, mode_t mode)
 {
-	return ::mkdir (convertPath (path).c_str (), mode);
+	ConvertedPath convertedPath (path);
+	if (!convertedPath.valid ())
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	auto r = ::mkdir (convertedPath.c_str (), mode);
+	invalidateStatCache (convertedPath.view ());
+	return r;
 }
 
 int IOAbstraction::rmdir (const char *path)
 {
-	return ::rmdir (convertPath (path).c_str ());
+	ConvertedPath convertedPath (path);
+	if (!convertedPath.valid ())
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	auto r = ::rmdir (convertedPath.c_str ());
+	invalidateStatCache (convertedPath.view ());
+	return r;
 }
 
 int IOAbstraction::unlink (const char *path)
 {
-	return ::unlink (convertPath (path).c_str ());
+	ConvertedPath convertedPath (path);
+	if (!convertedPath.valid ())
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	auto r = ::unlink (convertedPath.c_str ());
+	invalidateStatCache (convertedPath.view ());
+	return r;
 }
 
 int IOAbstraction::rename (const char *path, const char *path2)
 {
-	return ::rename (convertPath (path).c_str (), convertPath (path2).c_str ());
+	ConvertedPath convertedPath (path);
+	ConvertedPath convertedPath2 (path2);
+	if (!convertedPath.valid () || !convertedPath2.valid ())
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	auto r = ::rename (convertedPath.c_str (), convertedPath2.c_str ());
+	invalidateStatCache (convertedPath.view ());
+	invalidateStatCache (convertedPath2.view ());
+	return r;
 }
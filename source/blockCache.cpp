@@ -0,0 +1,282 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "blockCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace
+{
+/// \brief Cached block key
+struct Key
+{
+	/// \brief Resolved file path
+	std::string path;
+
+	/// \brief Block index
+	std::uint64_t index;
+
+	bool operator== (Key const &that_) const = default;
+};
+
+/// \brief Key hash
+struct KeyHash
+{
+	std::size_t operator() (Key const &key_) const
+	{
+		return std::hash<std::string>{}(key_.path) ^ std::hash<std::uint64_t>{}(key_.index);
+	}
+};
+
+/// \brief Cached block
+struct Node
+{
+	/// \brief Key
+	Key key;
+
+	/// \brief File mtime when the block was read
+	std::time_t mtime;
+
+	/// \brief File size when the block was read
+	std::uint64_t size;
+
+	/// \brief Block
+	SharedFileBlock block;
+};
+
+/// \brief Cache mutex
+std::mutex s_lock;
+
+/// \brief Cached blocks, most recently used first
+std::list<Node> s_lru;
+
+/// \brief Index into s_lru by key
+std::unordered_map<Key, std::list<Node>::iterator, KeyHash> s_index;
+
+/// \brief Memory cap in bytes
+std::size_t s_capacity = 0;
+
+/// \brief Bytes currently cached
+std::size_t s_size = 0;
+
+/// \brief Incremented by every invalidation
+std::uint64_t s_generation = 0;
+
+/// \brief Number of lookups that hit
+std::uint64_t s_hits = 0;
+
+/// \brief Number of lookups that missed
+std::uint64_t s_misses = 0;
+
+/// \brief Drop a cached block
+/// \param it_ Block to drop
+/// \note Cache lock must be held
+std::list<Node>::iterator erase (std::list<Node>::iterator const it_)
+{
+	s_size -= BlockCache::BLOCK_SIZE;
+	s_index.erase (it_->key);
+	return s_lru.erase (it_);
+}
+
+/// \brief Drop least recently used blocks over capacity
+/// \note Cache lock must be held
+void trim ()
+{
+	while (s_size > s_capacity)
+		erase (std::prev (std::end (s_lru)));
+}
+
+/// \brief Find a cached block
+/// \param path_ Resolved file path
+/// \param mtime_ Current file mtime
+/// \param size_ Current file size
+/// \param index_ Block index
+/// \note Cache lock must be held; a block from an older version of the file is dropped
+std::list<Node>::iterator find (std::string const &path_,
+    std::time_t const mtime_,
+    std::uint64_t const size_,
+    std::uint64_t const index_)
+{
+	auto const it = s_index.find (Key{path_, index_});
+	if (it == std::end (s_index))
+		return std::end (s_lru);
+
+	auto const node = it->second;
+	if (node->mtime != mtime_ || node->size != size_)
+	{
+		erase (node);
+		return std::end (s_lru);
+	}
+
+	return node;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+void BlockCache::setCapacity (std::size_t const bytes_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	s_capacity      = bytes_;
+	trim ();
+}
+
+bool BlockCache::enabled ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_capacity >= BLOCK_SIZE;
+}
+
+SharedFileBlock BlockCache::lookup (std::string const &path_,
+    std::time_t const mtime_,
+    std::uint64_t const size_,
+    std::uint64_t const index_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+
+	auto const it = find (path_, mtime_, size_, index_);
+	if (it == std::end (s_lru))
+	{
+		++s_misses;
+		return nullptr;
+	}
+
+	++s_hits;
+
+	// move to front
+	s_lru.splice (std::begin (s_lru), s_lru, it);
+	return it->block;
+}
+
+bool BlockCache::contains (std::string const &path_,
+    std::time_t const mtime_,
+    std::uint64_t const size_,
+    std::uint64_t const index_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return find (path_, mtime_, size_, index_) != std::end (s_lru);
+}
+
+std::uint64_t BlockCache::generation ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_generation;
+}
+
+void BlockCache::store (std::string const &path_,
+    std::time_t const mtime_,
+    std::uint64_t const size_,
+    std::uint64_t const index_,
+    SharedFileBlock block_,
+    std::uint64_t const generation_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	if (s_capacity < BLOCK_SIZE || generation_ != s_generation)
+		return;
+
+	auto key = Key{path_, index_};
+	if (auto const it = s_index.find (key); it != std::end (s_index))
+	{
+		auto const node = it->second;
+		node->mtime     = mtime_;
+		node->size      = size_;
+		node->block     = std::move (block_);
+		s_lru.splice (std::begin (s_lru), s_lru, node);
+		return;
+	}
+
+	s_lru.emplace_front (Node{key, mtime_, size_, std::move (block_)});
+	s_index.emplace (std::move (key), std::begin (s_lru));
+	s_size += BLOCK_SIZE;
+	trim ();
+}
+
+SharedFileBlock
+    BlockCache::read (fs::File &file_, std::uint64_t const size_, std::uint64_t const index_)
+{
+	auto const offset = index_ * BLOCK_SIZE;
+	if (offset >= size_)
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	auto block  = std::make_shared<FileBlock> ();
+	block->data = BufferPool::acquire (BLOCK_SIZE);
+	block->size = static_cast<std::size_t> (std::min<std::uint64_t> (BLOCK_SIZE, size_ - offset));
+
+	if (file_.seek (gsl::narrow_cast<std::make_signed_t<std::size_t>> (offset), SEEK_SET) != 0)
+		return nullptr;
+
+	// a short read means the file changed since it was opened
+	errno = 0;
+	if (!file_.readAll (block->data.get (), block->size))
+	{
+		if (errno == 0)
+			errno = EIO;
+		return nullptr;
+	}
+
+	return block;
+}
+
+void BlockCache::invalidate (std::string_view const path_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	++s_generation;
+
+	auto it = std::begin (s_lru);
+	while (it != std::end (s_lru))
+	{
+		// the path itself or anything below it
+		auto const &path = it->key.path;
+		if (path.starts_with (path_) &&
+		    (path.size () == path_.size () || path[path_.size ()] == '/' || path_ == "/"))
+			it = erase (it);
+		else
+			++it;
+	}
+}
+
+std::size_t BlockCache::size ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_size;
+}
+
+std::uint64_t BlockCache::hits ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_hits;
+}
+
+std::uint64_t BlockCache::misses ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_misses;
+}
@@ -0,0 +1,163 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "bufferPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <mutex>
+
+namespace
+{
+/// \brief Most memory to keep in released buffers
+constexpr std::size_t MAX_CACHED_BYTES = 512 * 1024;
+
+/// \brief Buffers of one size
+struct SizeClass
+{
+	/// \brief Buffer size
+	std::size_t size;
+
+	/// \brief Released buffers
+	std::vector<char *> free;
+
+	/// \brief Number of buffers handed out
+	std::size_t inUse = 0;
+
+	/// \brief Highest number of buffers handed out at once
+	std::size_t highWater = 0;
+};
+
+/// \brief Pool mutex
+std::mutex s_lock;
+
+/// \brief Size classes; there are only a handful, so a linear search is fine
+std::vector<SizeClass> s_classes;
+
+/// \brief Memory held in released buffers
+std::size_t s_cachedBytes = 0;
+
+/// \brief Find or create size class
+/// \param size_ Buffer size
+/// \note Pool lock must be held
+SizeClass &findClass (std::size_t const size_)
+{
+	for (auto &sizeClass : s_classes)
+	{
+		if (sizeClass.size == size_)
+			return sizeClass;
+	}
+
+	return s_classes.emplace_back (SizeClass{.size = size_});
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+BufferPool::Deleter::Deleter (std::size_t const size_) : m_size (size_)
+{
+}
+
+void BufferPool::Deleter::operator() (char *const buffer_) const
+{
+	BufferPool::release (buffer_, m_size);
+}
+
+///////////////////////////////////////////////////////////////////////////
+BufferPool::UniqueBuffer BufferPool::acquire (std::size_t const size_)
+{
+	assert (size_ > 0);
+
+	char *buffer = nullptr;
+	{
+		auto const lock = std::scoped_lock (s_lock);
+
+		auto &sizeClass     = findClass (size_);
+		sizeClass.highWater = std::max (sizeClass.highWater, ++sizeClass.inUse);
+
+		if (!sizeClass.free.empty ())
+		{
+			buffer = sizeClass.free.back ();
+			sizeClass.free.pop_back ();
+			s_cachedBytes -= size_;
+		}
+	}
+
+	// allocate outside the lock
+	if (!buffer)
+		buffer = new char[size_];
+
+	return UniqueBuffer (buffer, Deleter (size_));
+}
+
+void BufferPool::release (char *const buffer_, std::size_t const size_)
+{
+	if (!buffer_)
+		return;
+
+	{
+		auto const lock = std::scoped_lock (s_lock);
+
+		auto &sizeClass = findClass (size_);
+		assert (sizeClass.inUse > 0);
+		--sizeClass.inUse;
+
+		if (s_cachedBytes + size_ <= MAX_CACHED_BYTES)
+		{
+			sizeClass.free.emplace_back (buffer_);
+			s_cachedBytes += size_;
+			return;
+		}
+	}
+
+	delete[] buffer_;
+}
+
+void BufferPool::trim ()
+{
+	std::vector<char *> buffers;
+
+	{
+		auto const lock = std::scoped_lock (s_lock);
+		for (auto &sizeClass : s_classes)
+		{
+			buffers.insert (buffers.end (), sizeClass.free.begin (), sizeClass.free.end ());
+			sizeClass.free.clear ();
+		}
+		s_cachedBytes = 0;
+	}
+
+	for (auto const buffer : buffers)
+		delete[] buffer;
+}
+
+std::vector<BufferPool::Stats> BufferPool::stats ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+
+	std::vector<Stats> stats;
+	stats.reserve (s_classes.size ());
+	for (auto const &sizeClass : s_classes)
+		stats.emplace_back (Stats{sizeClass.size,
+		    sizeClass.inUse,
+		    sizeClass.highWater,
+		    sizeClass.free.size ()});
+
+	return stats;
+}
@@ -0,0 +1,465 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "checksum.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+/// \brief CRC32 lookup tables for slice-by-8
+/// Table k advances the CRC of a byte followed by k zero bytes, so eight input bytes are folded
+/// with eight independent lookups instead of a chain of eight dependent ones.
+constexpr auto CRC_TABLE = [] () {
+	std::array<std::array<std::uint32_t, 256>, 8> table{};
+
+	for (std::uint32_t i = 0; i < 256; ++i)
+	{
+		auto crc = i;
+		for (unsigned j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+
+		table[0][i] = crc;
+	}
+
+	for (std::uint32_t i = 0; i < 256; ++i)
+	{
+		for (unsigned k = 1; k < 8; ++k)
+			table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+	}
+
+	return table;
+}();
+
+/// \brief MD5 per-round shift amounts
+constexpr std::uint8_t MD5_SHIFT[] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+/// \brief MD5 constants
+// clang-format off
+constexpr std::uint32_t MD5_K[] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+// clang-format on
+
+/// \brief SHA-256 constants
+// clang-format off
+constexpr std::uint32_t SHA256_K[] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+// clang-format on
+
+/// \brief Algorithm names as used by HASH
+constexpr char const *NAMES[] = {"CRC32", "MD5", "SHA-1", "SHA-256"};
+
+/// \brief Rotate left
+/// \param x_ Value to rotate
+/// \param n_ Bits to rotate by
+constexpr std::uint32_t rotl (std::uint32_t const x_, unsigned const n_)
+{
+	return (x_ << n_) | (x_ >> (32 - n_));
+}
+
+/// \brief Rotate right
+/// \param x_ Value to rotate
+/// \param n_ Bits to rotate by
+constexpr std::uint32_t rotr (std::uint32_t const x_, unsigned const n_)
+{
+	return (x_ >> n_) | (x_ << (32 - n_));
+}
+
+/// \brief Load little-endian word
+/// \param p_ Bytes to load
+std::uint32_t loadLE (std::uint8_t const *const p_)
+{
+	return p_[0] | (p_[1] << 8) | (p_[2] << 16) | (std::uint32_t (p_[3]) << 24);
+}
+
+/// \brief Load big-endian word
+/// \param p_ Bytes to load
+std::uint32_t loadBE (std::uint8_t const *const p_)
+{
+	return (std::uint32_t (p_[0]) << 24) | (p_[1] << 16) | (p_[2] << 8) | p_[3];
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+Checksum::Checksum (Algorithm const algorithm_) : m_algorithm (algorithm_)
+{
+	switch (m_algorithm)
+	{
+	case Algorithm::CRC32:
+		m_state[0] = 0xFFFFFFFF;
+		break;
+
+	case Algorithm::MD5:
+		m_state[0] = 0x67452301;
+		m_state[1] = 0xefcdab89;
+		m_state[2] = 0x98badcfe;
+		m_state[3] = 0x10325476;
+		break;
+
+	case Algorithm::SHA1:
+		m_state[0] = 0x67452301;
+		m_state[1] = 0xefcdab89;
+		m_state[2] = 0x98badcfe;
+		m_state[3] = 0x10325476;
+		m_state[4] = 0xc3d2e1f0;
+		break;
+
+	case Algorithm::SHA256:
+		m_state = {0x6a09e667,
+		    0xbb67ae85,
+		    0x3c6ef372,
+		    0xa54ff53a,
+		    0x510e527f,
+		    0x9b05688c,
+		    0x1f83d9ab,
+		    0x5be0cd19};
+		break;
+	}
+}
+
+std::optional<Checksum::Algorithm> Checksum::find (std::string_view const name_)
+{
+	for (unsigned i = 0; i < std::size (NAMES); ++i)
+	{
+		if (name_.size () == std::strlen (NAMES[i]) &&
+		    ::strncasecmp (name_.data (), NAMES[i], name_.size ()) == 0)
+			return static_cast<Algorithm> (i);
+	}
+
+	return std::nullopt;
+}
+
+char const *Checksum::name (Algorithm const algorithm_)
+{
+	return NAMES[static_cast<unsigned> (algorithm_)];
+}
+
+Checksum::Algorithm Checksum::algorithm () const
+{
+	return m_algorithm;
+}
+
+void Checksum::update (void const *const data_, std::size_t size_)
+{
+	auto p = static_cast<std::uint8_t const *> (data_);
+	m_length += size_;
+
+	if (m_algorithm == Algorithm::CRC32)
+	{
+		auto crc = m_state[0];
+		for (; size_ >= 8; p += 8, size_ -= 8)
+		{
+			auto const word = crc ^ loadLE (p);
+			crc = CRC_TABLE[7][word & 0xFF] ^ CRC_TABLE[6][(word >> 8) & 0xFF] ^
+			      CRC_TABLE[5][(word >> 16) & 0xFF] ^ CRC_TABLE[4][word >> 24] ^
+			      CRC_TABLE[3][p[4]] ^ CRC_TABLE[2][p[5]] ^ CRC_TABLE[1][p[6]] ^
+			      CRC_TABLE[0][p[7]];
+		}
+
+		for (; size_ > 0; ++p, --size_)
+			crc = (crc >> 8) ^ CRC_TABLE[0][(crc ^ *p) & 0xFF];
+
+		m_state[0] = crc;
+		return;
+	}
+
+	// top up a partial block first
+	if (m_blockSize != 0)
+	{
+		auto const size = std::min (size_, m_block.size () - m_blockSize);
+		std::memcpy (&m_block[m_blockSize], p, size);
+		m_blockSize += size;
+		p += size;
+		size_ -= size;
+
+		if (m_blockSize < m_block.size ())
+			return;
+
+		block (m_block.data ());
+		m_blockSize = 0;
+	}
+
+	// whole blocks are processed straight from the input
+	for (; size_ >= m_block.size (); p += m_block.size (), size_ -= m_block.size ())
+		block (p);
+
+	std::memcpy (m_block.data (), p, size_);
+	m_blockSize = size_;
+}
+
+std::string Checksum::finish ()
+{
+	static char const hex[] = "0123456789abcdef";
+
+	std::string digest;
+	auto const append = [&digest] (std::uint32_t const word_) {
+		for (int shift = 28; shift >= 0; shift -= 4)
+			digest.push_back (hex[(word_ >> shift) & 0xF]);
+	};
+
+	if (m_algorithm == Algorithm::CRC32)
+	{
+		append (m_state[0] ^ 0xFFFFFFFF);
+		return digest;
+	}
+
+	// pad to 56 bytes mod 64, then append the length in bits
+	auto const bits = m_length * 8;
+
+	std::uint8_t padding[72] = {0x80};
+	auto const size = (m_blockSize < 56 ? 56 : 120) - m_blockSize;
+	for (unsigned i = 0; i < 8; ++i)
+	{
+		// MD5 stores the length little-endian, SHA big-endian
+		auto const shift = m_algorithm == Algorithm::MD5 ? 8 * i : 56 - 8 * i;
+		padding[size + i] = static_cast<std::uint8_t> (bits >> shift);
+	}
+	update (padding, size + 8);
+
+	switch (m_algorithm)
+	{
+	case Algorithm::CRC32:
+		break;
+
+	case Algorithm::MD5:
+		// the digest is the state in little-endian byte order
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			auto const word = m_state[i];
+			append ((word >> 24) | ((word >> 8) & 0xFF00) | ((word << 8) & 0xFF0000) |
+			        (word << 24));
+		}
+		break;
+
+	case Algorithm::SHA1:
+		for (unsigned i = 0; i < 5; ++i)
+			append (m_state[i]);
+		break;
+
+	case Algorithm::SHA256:
+		for (unsigned i = 0; i < 8; ++i)
+			append (m_state[i]);
+		break;
+	}
+
+	return digest;
+}
+
+void Checksum::block (std::uint8_t const *const block_)
+{
+	switch (m_algorithm)
+	{
+	case Algorithm::CRC32:
+		break;
+
+	case Algorithm::MD5:
+		md5Block (block_);
+		break;
+
+	case Algorithm::SHA1:
+		sha1Block (block_);
+		break;
+
+	case Algorithm::SHA256:
+		sha256Block (block_);
+		break;
+	}
+}
+
+void Checksum::md5Block (std::uint8_t const *const block_)
+{
+	std::uint32_t w[16];
+	for (unsigned i = 0; i < 16; ++i)
+		w[i] = loadLE (&block_[4 * i]);
+
+	auto a = m_state[0];
+	auto b = m_state[1];
+	auto c = m_state[2];
+	auto d = m_state[3];
+
+	for (unsigned i = 0; i < 64; ++i)
+	{
+		std::uint32_t f;
+		unsigned g;
+		switch (i / 16)
+		{
+		case 0:
+			f = d ^ (b & (c ^ d));
+			g = i;
+			break;
+
+		case 1:
+			f = c ^ (d & (b ^ c));
+			g = (5 * i + 1) % 16;
+			break;
+
+		case 2:
+			f = b ^ c ^ d;
+			g = (3 * i + 5) % 16;
+			break;
+
+		default:
+			f = c ^ (b | ~d);
+			g = (7 * i) % 16;
+			break;
+		}
+
+		auto const rotated = rotl (a + f + MD5_K[i] + w[g], MD5_SHIFT[(i / 16) * 4 + i % 4]);
+
+		a = d;
+		d = c;
+		c = b;
+		b += rotated;
+	}
+
+	m_state[0] += a;
+	m_state[1] += b;
+	m_state[2] += c;
+	m_state[3] += d;
+}
+
+void Checksum::sha1Block (std::uint8_t const *const block_)
+{
+	// the message schedule is kept as a rolling window of 16 words
+	std::uint32_t w[16];
+	for (unsigned i = 0; i < 16; ++i)
+		w[i] = loadBE (&block_[4 * i]);
+
+	auto a = m_state[0];
+	auto b = m_state[1];
+	auto c = m_state[2];
+	auto d = m_state[3];
+	auto e = m_state[4];
+
+	for (unsigned i = 0; i < 80; ++i)
+	{
+		if (i >= 16)
+			w[i % 16] =
+			    rotl (w[(i + 13) % 16] ^ w[(i + 8) % 16] ^ w[(i + 2) % 16] ^ w[i % 16], 1);
+
+		std::uint32_t f;
+		std::uint32_t k;
+		if (i < 20)
+		{
+			f = d ^ (b & (c ^ d));
+			k = 0x5a827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		}
+		else if (i < 60)
+		{
+			f = (b & c) | (d & (b | c));
+			k = 0x8f1bbcdc;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		auto const t = rotl (a, 5) + f + e + k + w[i % 16];
+
+		e = d;
+		d = c;
+		c = rotl (b, 30);
+		b = a;
+		a = t;
+	}
+
+	m_state[0] += a;
+	m_state[1] += b;
+	m_state[2] += c;
+	m_state[3] += d;
+	m_state[4] += e;
+}
+
+void Checksum::sha256Block (std::uint8_t const *const block_)
+{
+	std::uint32_t w[64];
+	for (unsigned i = 0; i < 16; ++i)
+		w[i] = loadBE (&block_[4 * i]);
+
+	for (unsigned i = 16; i < 64; ++i)
+	{
+		auto const s0 = rotr (w[i - 15], 7) ^ rotr (w[i - 15], 18) ^ (w[i - 15] >> 3);
+		auto const s1 = rotr (w[i - 2], 17) ^ rotr (w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i]          = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	auto a = m_state[0];
+	auto b = m_state[1];
+	auto c = m_state[2];
+	auto d = m_state[3];
+	auto e = m_state[4];
+	auto f = m_state[5];
+	auto g = m_state[6];
+	auto h = m_state[7];
+
+	for (unsigned i = 0; i < 64; ++i)
+	{
+		auto const s1  = rotr (e, 6) ^ rotr (e, 11) ^ rotr (e, 25);
+		auto const ch  = g ^ (e & (f ^ g));
+		auto const t1  = h + s1 + ch + SHA256_K[i] + w[i];
+		auto const s0  = rotr (a, 2) ^ rotr (a, 13) ^ rotr (a, 22);
+		auto const maj = (a & b) | (c & (a | b));
+		auto const t2  = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	m_state[0] += a;
+	m_state[1] += b;
+	m_state[2] += c;
+	m_state[3] += d;
+	m_state[4] += e;
+	m_state[5] += f;
+	m_state[6] += g;
+	m_state[7] += h;
+}
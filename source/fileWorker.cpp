@@ -0,0 +1,835 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "fileWorker.h"
+
+#include "IOAbstraction.h"
+#include "log.h"
+#include "platform.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace
+{
+#ifdef __NDS__
+/// \brief Bytes hashed per FileHash run
+constexpr std::size_t HASH_BLOCKSIZE = 8192;
+#else
+/// \brief Bytes hashed per FileHash run
+constexpr std::size_t HASH_BLOCKSIZE = 64 * 1024;
+#endif
+
+/// \brief Pool mutex
+std::mutex s_lock;
+
+/// \brief Signalled when a job is queued or the pool stops
+std::condition_variable s_workCond;
+
+/// \brief Signalled when a job finishes running
+std::condition_variable s_doneCond;
+
+/// \brief First queued job
+FileJob *s_head = nullptr;
+
+/// \brief Last queued job
+FileJob *s_tail = nullptr;
+
+/// \brief Worker threads
+std::vector<platform::Thread> s_threads;
+
+/// \brief Whether workers should quit
+bool s_quit = false;
+}
+
+///////////////////////////////////////////////////////////////////////////
+FileJob::~FileJob () = default;
+
+FileJob::FileJob () = default;
+
+///////////////////////////////////////////////////////////////////////////
+void FileWorkers::start (unsigned const count_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	assert (s_threads.empty ());
+
+	s_quit = false;
+	for (unsigned i = 0; i < count_; ++i)
+		s_threads.emplace_back (&FileWorkers::workerFunc);
+
+	if (count_ != 0)
+		info ("Started %u file worker%s\n", count_, count_ == 1 ? "" : "s");
+}
+
+void FileWorkers::stop ()
+{
+	std::vector<platform::Thread> threads;
+
+	{
+		auto const lock = std::scoped_lock (s_lock);
+		s_quit          = true;
+		threads         = std::move (s_threads);
+
+		// drop anything that has not started yet
+		while (s_head)
+		{
+			auto const job = s_head;
+			s_head         = job->m_next;
+			job->m_next    = nullptr;
+			job->m_queued  = false;
+		}
+		s_tail = nullptr;
+	}
+
+	s_workCond.notify_all ();
+	s_doneCond.notify_all ();
+
+	for (auto &thread : threads)
+		thread.join ();
+}
+
+bool FileWorkers::running ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return !s_threads.empty () && !s_quit;
+}
+
+bool FileWorkers::submit (FileJob &job_)
+{
+	{
+		auto const lock = std::scoped_lock (s_lock);
+		// a job may resubmit itself from run (), which must not undo a cancel racing with it
+		if (s_threads.empty () || s_quit || job_.m_cancelled)
+			return false;
+
+		if (!job_.m_queued)
+			enqueue (job_);
+	}
+
+	s_workCond.notify_one ();
+	return true;
+}
+
+void FileWorkers::cancel (FileJob &job_)
+{
+	auto lock = std::unique_lock (s_lock);
+
+	job_.m_cancelled = true;
+
+	if (job_.m_queued)
+	{
+		// unlink from the queue
+		FileJob *prev = nullptr;
+		for (auto job = s_head; job; prev = job, job = job->m_next)
+		{
+			if (job != &job_)
+				continue;
+
+			if (prev)
+				prev->m_next = job->m_next;
+			else
+				s_head = job->m_next;
+
+			if (s_tail == job)
+				s_tail = prev;
+
+			break;
+		}
+
+		job_.m_next   = nullptr;
+		job_.m_queued = false;
+	}
+
+	s_doneCond.wait (lock, [&job_] () { return job_.m_running == 0; });
+}
+
+void FileWorkers::enqueue (FileJob &job_)
+{
+	assert (!job_.m_queued);
+
+	job_.m_next   = nullptr;
+	job_.m_queued = true;
+
+	if (s_tail)
+		s_tail->m_next = &job_;
+	else
+		s_head = &job_;
+
+	s_tail = &job_;
+}
+
+void FileWorkers::workerFunc ()
+{
+	auto lock = std::unique_lock (s_lock);
+	while (true)
+	{
+		s_workCond.wait (lock, [] () { return s_quit || s_head; });
+		if (s_quit)
+			return;
+
+		auto const job = s_head;
+		s_head         = job->m_next;
+		if (!s_head)
+			s_tail = nullptr;
+
+		job->m_next   = nullptr;
+		job->m_queued = false;
+		++job->m_running;
+
+		lock.unlock ();
+		auto const again = job->run ();
+		lock.lock ();
+
+		--job->m_running;
+
+		// requeue at the back so jobs from other sessions get a turn
+		if (again && !job->m_cancelled && !s_quit && !job->m_queued)
+			enqueue (*job);
+
+		s_doneCond.notify_all ();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+ReadAhead::~ReadAhead ()
+{
+	FileWorkers::cancel (*this);
+}
+
+ReadAhead::ReadAhead (fs::File &file_, std::size_t const blockSize_, unsigned const blocks_)
+    : m_file (file_)
+{
+	assert (blocks_ > 0);
+
+	m_blocks.reserve (blocks_);
+	for (unsigned i = 0; i < blocks_; ++i)
+		m_blocks.emplace_back (std::make_unique<IOBuffer> (blockSize_));
+}
+
+bool ReadAhead::start ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	assert (!m_active);
+
+	m_active = FileWorkers::submit (*this);
+	return m_active;
+}
+
+IOBuffer *ReadAhead::front ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_count == 0)
+		return nullptr;
+
+	return m_blocks[m_head].get ();
+}
+
+void ReadAhead::pop ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	assert (m_count > 0);
+
+	m_blocks[m_head]->clear ();
+	m_head = (m_head + 1) % m_blocks.size ();
+	--m_count;
+
+	// a block was freed; wake the reader back up if it went idle on a full ring
+	if (!m_active && !m_eof && m_error == 0)
+		m_active = FileWorkers::submit (*this);
+}
+
+bool ReadAhead::ready ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_count != 0 || m_eof || m_error != 0 || !m_active;
+}
+
+bool ReadAhead::done ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_count == 0 && m_eof;
+}
+
+int ReadAhead::error ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_count != 0)
+		return 0;
+
+	if (m_error == 0 && !m_eof && !m_active)
+		return ECANCELED;
+
+	return m_error;
+}
+
+bool ReadAhead::run ()
+{
+	IOBuffer *block;
+	{
+		auto const lock = std::scoped_lock (m_lock);
+		assert (m_count < m_blocks.size ());
+		block = m_blocks[m_tail].get ();
+	}
+
+	// the network thread never touches the tail block, so fill it without holding the lock
+	int rc = 0;
+	block->clear ();
+	while (block->freeSize () > 0)
+	{
+		auto const bytes = m_file.readDirect (*block);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+
+		if (bytes < 0)
+			rc = errno;
+
+		if (bytes <= 0)
+			break;
+	}
+
+	auto const lock = std::scoped_lock (m_lock);
+	if (!block->empty ())
+	{
+		m_tail = (m_tail + 1) % m_blocks.size ();
+		++m_count;
+	}
+
+	if (rc != 0)
+		m_error = rc;
+	else if (block->freeSize () > 0)
+		m_eof = true;
+
+	if (m_error != 0 || m_eof || m_count == m_blocks.size ())
+	{
+		m_active = false;
+		return false;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+WriteBehind::~WriteBehind ()
+{
+	FileWorkers::cancel (*this);
+}
+
+WriteBehind::WriteBehind (fs::File &file_, std::size_t const blockSize_, unsigned const blocks_)
+    : m_file (file_)
+{
+	assert (blocks_ > 0);
+
+	m_blocks.reserve (blocks_);
+	for (unsigned i = 0; i < blocks_; ++i)
+		m_blocks.emplace_back (std::make_unique<IOBuffer> (blockSize_));
+}
+
+IOBuffer *WriteBehind::back ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_finish || m_count == m_blocks.size ())
+		return nullptr;
+
+	return m_blocks[m_tail].get ();
+}
+
+bool WriteBehind::push ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	assert (!m_finish);
+	assert (m_count < m_blocks.size ());
+
+	if (m_blocks[m_tail]->freeSize () != 0)
+		return true;
+
+	m_tail = (m_tail + 1) % m_blocks.size ();
+	++m_count;
+
+	return wake ();
+}
+
+bool WriteBehind::finish ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	assert (!m_finish);
+
+	if (m_count < m_blocks.size () && !m_blocks[m_tail]->empty ())
+	{
+		m_tail = (m_tail + 1) % m_blocks.size ();
+		++m_count;
+	}
+
+	m_finish = true;
+	return wake ();
+}
+
+bool WriteBehind::ready ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return !m_finish && m_count < m_blocks.size ();
+}
+
+bool WriteBehind::settled ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_flushed || m_error != 0;
+}
+
+int WriteBehind::error ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_error;
+}
+
+bool WriteBehind::wake ()
+{
+	if (m_active || m_error != 0)
+		return true;
+
+	m_active = FileWorkers::submit (*this);
+	if (!m_active)
+		m_error = ECANCELED;
+
+	return m_active;
+}
+
+bool WriteBehind::run ()
+{
+	IOBuffer *block = nullptr;
+	{
+		auto const lock = std::scoped_lock (m_lock);
+		if (m_count != 0)
+			block = m_blocks[m_head].get ();
+		else if (!m_finish)
+		{
+			// caught up with the network thread
+			m_active = false;
+			return false;
+		}
+	}
+
+	// the network thread never touches queued blocks, so write without holding the lock
+	int rc = 0;
+	errno  = 0;
+	if (block)
+	{
+		while (!block->empty ())
+		{
+			if (m_file.write (*block) <= 0)
+			{
+				rc = errno != 0 ? errno : EIO;
+				break;
+			}
+		}
+	}
+	else if (!m_file.flush ())
+		rc = errno != 0 ? errno : EIO;
+
+	auto const lock = std::scoped_lock (m_lock);
+	if (rc != 0)
+	{
+		m_error  = rc;
+		m_active = false;
+		return false;
+	}
+
+	if (!block)
+	{
+		m_flushed = true;
+		m_active  = false;
+		return false;
+	}
+
+	block->clear ();
+	m_head = (m_head + 1) % m_blocks.size ();
+	--m_count;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+CachePrefetch::~CachePrefetch ()
+{
+	FileWorkers::cancel (*this);
+}
+
+CachePrefetch::CachePrefetch (fs::File file_,
+    std::string path_,
+    std::time_t const mtime_,
+    std::uint64_t const size_,
+    unsigned const depth_)
+    : m_file (std::move (file_)),
+      m_path (std::move (path_)),
+      m_mtime (mtime_),
+      m_size (size_),
+      m_depth (depth_)
+{
+}
+
+void CachePrefetch::advance (std::uint64_t const index_)
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_error != 0)
+		return;
+
+	auto const blocks = (m_size + BlockCache::BLOCK_SIZE - 1) / BlockCache::BLOCK_SIZE;
+
+	// start over from the reader's block; run () skips the blocks that are still cached, so this
+	// only rereads ones that were evicted
+	if (m_block && m_blockIndex != index_)
+		m_block.reset ();
+
+	m_want = index_;
+	m_next = index_;
+	m_end  = std::min (index_ + 1 + m_depth, blocks);
+
+	if (!m_active && m_next < m_end)
+	{
+		m_active = FileWorkers::submit (*this);
+		if (!m_active)
+			m_error = ECANCELED;
+	}
+}
+
+bool CachePrefetch::ready ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	// past the end there is nothing to wait for
+	auto const blocks = (m_size + BlockCache::BLOCK_SIZE - 1) / BlockCache::BLOCK_SIZE;
+	if (m_error != 0 || m_want >= blocks || (m_block && m_blockIndex == m_want))
+		return true;
+
+	return BlockCache::contains (m_path, m_mtime, m_size, m_want);
+}
+
+SharedFileBlock CachePrefetch::take (std::uint64_t const index_)
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (!m_block || m_blockIndex != index_)
+		return nullptr;
+
+	return std::exchange (m_block, nullptr);
+}
+
+int CachePrefetch::error ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_error;
+}
+
+bool CachePrefetch::run ()
+{
+	std::uint64_t index;
+	{
+		auto const lock = std::scoped_lock (m_lock);
+		if (m_next >= m_end)
+		{
+			m_active = false;
+			return false;
+		}
+
+		index = m_next;
+	}
+
+	// only the job touches the file, so read without holding the lock
+	auto rc = 0;
+	SharedFileBlock block;
+	if (!BlockCache::contains (m_path, m_mtime, m_size, index))
+	{
+		auto const generation = BlockCache::generation ();
+		block                 = BlockCache::read (m_file, m_size, index);
+		if (block)
+			BlockCache::store (m_path, m_mtime, m_size, index, block, generation);
+		else
+			rc = errno;
+	}
+
+	auto const lock = std::scoped_lock (m_lock);
+
+	// an invalidation or a full cache can drop the block, so hold the one the reader is waiting on
+	if (block && index == m_want)
+	{
+		m_block      = std::move (block);
+		m_blockIndex = index;
+	}
+
+	if (rc != 0)
+	{
+		// the reader reports the error
+		m_error  = rc;
+		m_active = false;
+		return false;
+	}
+
+	m_next = std::max (m_next, index + 1);
+	if (m_next >= m_end)
+	{
+		m_active = false;
+		return false;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+FileHash::~FileHash ()
+{
+	FileWorkers::cancel (*this);
+}
+
+FileHash::FileHash (fs::File file_, Checksum::Algorithm const algorithm_, std::uint64_t const size_)
+    : m_file (std::move (file_)),
+      m_checksum (algorithm_),
+      m_buffer (HASH_BLOCKSIZE),
+      m_remaining (size_)
+{
+}
+
+bool FileHash::start ()
+{
+	return FileWorkers::submit (*this);
+}
+
+bool FileHash::done ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_done || m_error != 0;
+}
+
+int FileHash::error ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_error;
+}
+
+std::string FileHash::digest ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_digest;
+}
+
+bool FileHash::run ()
+{
+	// only the job touches the file and checksum, so hash without holding the lock
+	int rc = 0;
+	if (m_remaining != 0)
+	{
+		m_buffer.clear ();
+		auto const bytes =
+		    m_file.fd () >= 0 ? m_file.readDirect (m_buffer) : m_file.read (m_buffer);
+		if (bytes < 0 && errno == EINTR)
+			return true;
+
+		if (bytes < 0)
+			rc = errno;
+		else if (bytes == 0)
+			rc = EIO; // the file shrank since it was opened
+		else
+		{
+			// the last block may read past the end of the range
+			auto const size = std::min<std::uint64_t> (bytes, m_remaining);
+			m_checksum.update (m_buffer.usedArea (), size);
+			m_remaining -= size;
+		}
+	}
+
+	std::string digest;
+	if (rc == 0 && m_remaining == 0)
+		digest = m_checksum.finish ();
+
+	auto const lock = std::scoped_lock (m_lock);
+	if (rc != 0)
+	{
+		m_error = rc;
+		return false;
+	}
+
+	if (!digest.empty ())
+	{
+		m_digest = std::move (digest);
+		m_done   = true;
+		return false;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+StatPrefetch::~StatPrefetch ()
+{
+	FileWorkers::cancel (*this);
+}
+
+StatPrefetch::StatPrefetch (fs::Dir dir_,
+    std::string path_,
+    unsigned const depth_,
+    std::chrono::microseconds const quickStat_)
+    : m_dir (std::move (dir_)),
+      m_path (std::move (path_)),
+      m_slots (depth_),
+      m_quickStat (quickStat_)
+{
+	assert (depth_ > 0);
+}
+
+bool StatPrefetch::start ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+
+	m_stopped = !FileWorkers::submit (*this);
+	return !m_stopped;
+}
+
+fs::DirLister::Entry const *StatPrefetch::front ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_count == 0 || !m_slots[m_head].ready)
+		return nullptr;
+
+	return &m_slots[m_head].entry;
+}
+
+void StatPrefetch::pop ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	assert (m_count > 0 && m_slots[m_head].ready);
+
+	m_slots[m_head].ready = false;
+	m_head                = (m_head + 1) % m_slots.size ();
+	--m_count;
+
+	// a slot was freed; wake a reader in case they all went idle on a full ring
+	if (!m_eof && m_error == 0 && !m_stopped && !quickLocked ())
+		m_stopped = !FileWorkers::submit (*this);
+}
+
+bool StatPrefetch::ready ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_count != 0)
+		return m_slots[m_head].ready;
+
+	return m_eof || m_error != 0 || m_stopped;
+}
+
+bool StatPrefetch::done ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return m_count == 0 && m_eof;
+}
+
+int StatPrefetch::error ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	if (m_count != 0)
+		return 0;
+
+	if (m_error == 0 && !m_eof && m_stopped)
+		return ECANCELED;
+
+	return m_error;
+}
+
+bool StatPrefetch::quick ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	return quickLocked ();
+}
+
+bool StatPrefetch::quickLocked () const
+{
+	return m_statTime < m_quickStat;
+}
+
+bool StatPrefetch::run ()
+{
+	Slot *slot = nullptr;
+	{
+		auto const dirLock = std::scoped_lock (m_dirLock);
+
+		{
+			auto const lock = std::scoped_lock (m_lock);
+			if (m_eof || m_error != 0 || m_count == m_slots.size ())
+				return false;
+		}
+
+		// only this worker reads the directory or writes the tail slot until it is claimed
+		dirent *dent;
+		do
+		{
+			dent = m_dir.read ();
+		} while (dent && (std::strcmp (dent->d_name, ".") == 0 ||
+		                     std::strcmp (dent->d_name, "..") == 0));
+
+		auto const rc = errno;
+
+		auto const lock = std::scoped_lock (m_lock);
+		if (!dent)
+		{
+			if (rc != 0)
+				m_error = rc;
+			else
+				m_eof = true;
+			return false;
+		}
+
+		slot = &m_slots[m_tail];
+		std::memcpy (slot->entry.name, dent->d_name, sizeof (slot->entry.name));
+		slot->entry.error = 0;
+
+		m_tail = (m_tail + 1) % m_slots.size ();
+		++m_count;
+
+		// hand the next entry to another worker while this one stats
+		if (m_count < m_slots.size () && !quickLocked ())
+			m_stopped = !FileWorkers::submit (*this);
+	}
+
+	// the network thread doesn't touch the slot until it is ready, so stat it without the lock
+	auto &entry      = slot->entry;
+	auto const start = platform::steady_clock::now ();
+	if (IOAbstraction::statAt (m_dir, m_path, entry.name, &entry.st) != 0)
+		entry.error = errno;
+	auto const elapsed = platform::steady_clock::now () - start;
+
+	auto const lock = std::scoped_lock (m_lock);
+	slot->ready = true;
+
+	auto const statTime = std::chrono::duration_cast<std::chrono::microseconds> (elapsed);
+	if (m_statTime == std::chrono::microseconds::max ())
+		m_statTime = statTime;
+	else
+		m_statTime = (m_statTime * 7 + statTime) / 8;
+
+	if (m_eof || m_error != 0 || m_count == m_slots.size () || quickLocked ())
+		return false;
+
+	// the network thread runs this too; hand the next entry back to the workers once stats slow
+	m_stopped = !FileWorkers::submit (*this);
+	return false;
+}
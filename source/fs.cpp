@@ -32,13 +32,17 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <memory>
 #include <string>
 #include <string_view>
 #include <type_traits>
 #include <utility>
 
+#include <unistd.h>
+
 #if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__) || defined(__WIIU__)
 #define getline __getline
 #endif
@@ -101,6 +105,8 @@ std::string fs::printSize (std::uint64_t const size_)
 ///////////////////////////////////////////////////////////////////////////
 fs::File::~File ()
 {
+	// close before the buffer goes back to the pool
+	close ();
 	std::free (m_lineBuffer);
 }
 
@@ -120,13 +126,24 @@ fs::File::operator FILE * () const
 	return m_fp.get ();
 }
 
+int fs::File::fd () const
+{
+	if (!m_fp)
+		return -1;
+
+	return ::fileno (m_fp.get ());
+}
+
 void fs::File::setBufferSize (std::size_t const size_)
 {
-	if (m_buffer.size () != size_)
-		m_buffer.resize (size_);
+	if (!m_buffer || m_bufferSize != size_)
+	{
+		m_buffer     = BufferPool::acquire (size_);
+		m_bufferSize = size_;
+	}
 
 	if (m_fp)
-		(void)std::setvbuf (m_fp.get (), m_buffer.data (), _IOFBF, m_buffer.size ());
+		(void)std::setvbuf (m_fp.get (), m_buffer.get (), _IOFBF, m_bufferSize);
 }
 
 bool fs::File::open (gsl::not_null<char const *> const path_,
@@ -138,8 +155,8 @@ bool fs::File::open (gsl::not_null<char const *> const path_,
 
 	m_fp = std::unique_ptr<std::FILE, int (*) (std::FILE *)> (fp, &std::fclose);
 
-	if (!m_buffer.empty ())
-		(void)std::setvbuf (m_fp.get (), m_buffer.data (), _IOFBF, m_buffer.size ());
+	if (m_buffer)
+		(void)std::setvbuf (m_fp.get (), m_buffer.get (), _IOFBF, m_bufferSize);
 
 	return true;
 }
@@ -147,6 +164,10 @@ bool fs::File::open (gsl::not_null<char const *> const path_,
 void fs::File::close ()
 {
 	m_fp.reset ();
+
+	// hand the stdio buffer back for the next file
+	m_buffer.reset ();
+	m_bufferSize = 0;
 }
 
 std::make_signed_t<std::size_t> fs::File::seek (std::make_signed_t<std::size_t> const pos_,
@@ -155,6 +176,17 @@ std::make_signed_t<std::size_t> fs::File::seek (std::make_signed_t<std::size_t>
 	return IOAbstraction::fseek (m_fp.get (), pos_, origin_);
 }
 
+bool fs::File::seekDirect (std::uint64_t const pos_)
+{
+	if (fd () < 0)
+	{
+		errno = EBADF;
+		return false;
+	}
+
+	return ::lseek (fd (), gsl::narrow_cast<off_t> (pos_), SEEK_SET) >= 0;
+}
+
 std::make_signed_t<std::size_t> fs::File::read (gsl::not_null<void *> const buffer_,
     std::size_t const size_)
 {
@@ -183,6 +215,39 @@ std::make_signed_t<std::size_t> fs::File::read (IOBuffer &buffer_)
 	return rc;
 }
 
+std::make_signed_t<std::size_t> fs::File::read (RingBuffer &buffer_)
+{
+	assert (buffer_.freeSize () > 0);
+
+	auto const rc = read (buffer_.freeArea (), buffer_.freeSize ());
+	if (rc > 0)
+		buffer_.markUsed (rc);
+
+	return rc;
+}
+
+std::make_signed_t<std::size_t> fs::File::readDirect (IOBuffer &buffer_)
+{
+	assert (buffer_.freeSize () > 0);
+
+	auto const rc = ::read (fd (), buffer_.freeArea (), buffer_.freeSize ());
+	if (rc > 0)
+		buffer_.markUsed (rc);
+
+	return rc;
+}
+
+std::make_signed_t<std::size_t> fs::File::readDirect (RingBuffer &buffer_)
+{
+	assert (buffer_.freeSize () > 0);
+
+	auto const rc = ::read (fd (), buffer_.freeArea (), buffer_.freeSize ());
+	if (rc > 0)
+		buffer_.markUsed (rc);
+
+	return rc;
+}
+
 std::string_view fs::File::readLine ()
 {
 	while (true)
@@ -248,6 +313,17 @@ std::make_signed_t<std::size_t> fs::File::write (IOBuffer &buffer_)
 	return rc;
 }
 
+std::make_signed_t<std::size_t> fs::File::write (RingBuffer &buffer_)
+{
+	assert (buffer_.usedSize () > 0);
+
+	auto const rc = write (buffer_.usedArea (), buffer_.usedSize ());
+	if (rc > 0)
+		buffer_.markFree (rc);
+
+	return rc;
+}
+
 bool fs::File::writeAll (gsl::not_null<void const *> const buffer_, std::size_t const size_)
 {
 	assert (buffer_);
@@ -268,6 +344,49 @@ bool fs::File::writeAll (gsl::not_null<void const *> const buffer_, std::size_t
 	return true;
 }
 
+bool fs::File::flush ()
+{
+	return std::fflush (m_fp.get ()) == 0;
+}
+
+std::int64_t fs::File::tell ()
+{
+	return std::ftell (m_fp.get ());
+}
+
+bool fs::File::preallocate (std::uint64_t const size_)
+{
+	if (fd () < 0)
+	{
+		errno = EBADF;
+		return false;
+	}
+
+#if FTPD_HAS_FALLOCATE
+	auto const rc = ::posix_fallocate (fd (), 0, gsl::narrow_cast<off_t> (size_));
+	if (rc == 0)
+		return true;
+
+	// only fall back to extending the file if the filesystem can't reserve space itself
+	if (rc != EINVAL && rc != EOPNOTSUPP)
+	{
+		errno = rc;
+		return false;
+	}
+#endif
+
+	// extending the file makes FAT allocate the whole cluster chain at once
+	return truncate (size_);
+}
+
+bool fs::File::truncate (std::uint64_t const size_)
+{
+	if (!flush ())
+		return false;
+
+	return ::ftruncate (fd (), gsl::narrow_cast<off_t> (size_)) == 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 fs::Dir::~Dir () = default;
 
@@ -307,3 +426,89 @@ dirent *fs::Dir::read ()
 	errno = 0;
 	return IOAbstraction::readdir (m_dp.get ());
 }
+
+///////////////////////////////////////////////////////////////////////////
+fs::DirLister::~DirLister () = default;
+
+fs::DirLister::DirLister () = default;
+
+fs::DirLister::operator bool () const
+{
+	return static_cast<bool> (m_dir);
+}
+
+bool fs::DirLister::open (std::string_view const path_, bool const stat_)
+{
+	m_path.assign (path_);
+	if (!m_dir.open (m_path.c_str ()))
+		return false;
+
+	// the batch outlives the listing so the next one reuses it
+	if (!m_batch)
+		m_batch = std::make_unique<std::array<Entry, BATCH_SIZE>> ();
+
+	m_count = 0;
+	m_index = 0;
+	m_stat  = stat_;
+	m_eof   = false;
+	return true;
+}
+
+void fs::DirLister::close ()
+{
+	m_dir.close ();
+	m_count = 0;
+	m_index = 0;
+}
+
+fs::DirLister::Entry const *fs::DirLister::read ()
+{
+	if (m_index == m_count)
+		fill ();
+
+	if (m_index == m_count)
+		return nullptr;
+
+	return &(*m_batch)[m_index++];
+}
+
+void fs::DirLister::fill ()
+{
+	m_count = 0;
+	m_index = 0;
+
+	// read the whole batch first so the stats below run back to back
+	while (!m_eof && m_count < m_batch->size ())
+	{
+		auto const dent = m_dir.read ();
+		if (!dent)
+		{
+			m_eof = true;
+			break;
+		}
+
+		if (std::strcmp (dent->d_name, ".") == 0 || std::strcmp (dent->d_name, "..") == 0)
+			continue;
+
+		auto &entry = (*m_batch)[m_count++];
+		std::memcpy (entry.name, dent->d_name, sizeof (entry.name));
+		entry.error = 0;
+
+#ifdef _DIRENT_HAVE_D_STAT
+		if (m_stat)
+			entry.st = dent->d_stat;
+#endif
+	}
+
+#ifndef _DIRENT_HAVE_D_STAT
+	if (!m_stat)
+		return;
+
+	for (std::size_t i = 0; i < m_count; ++i)
+	{
+		auto &entry = (*m_batch)[i];
+		if (IOAbstraction::statAt (m_dir, m_path, entry.name, &entry.st) != 0)
+			entry.error = errno;
+	}
+#endif
+}
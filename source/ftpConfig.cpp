@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 using stat_t = struct stat;
 
+#include <algorithm>
 #include <cctype>
 #include <cerrno>
 #include <charconv>
@@ -48,6 +49,62 @@ constexpr std::uint16_t DEFAULT_PORT = 21;
 constexpr std::uint16_t DEFAULT_PORT = 5000;
 #endif
 
+#ifdef __NDS__
+/// \brief Default number of file I/O workers
+constexpr unsigned DEFAULT_IO_WORKERS = 0;
+#else
+/// \brief Default number of file I/O workers
+constexpr unsigned DEFAULT_IO_WORKERS = 2;
+#endif
+
+/// \brief Default number of blocks to read ahead of a download
+constexpr unsigned DEFAULT_READ_AHEAD = 4;
+
+/// \brief Default number of listing entries to stat ahead of the sender
+constexpr unsigned DEFAULT_LIST_PREFETCH = 16;
+
+/// \brief Default write-behind memory cap in KiB
+constexpr unsigned DEFAULT_WRITE_BEHIND = 128;
+
+/// \brief Default MODE Z compression level; favours speed, since the CPU is the bottleneck at
+/// higher levels
+constexpr unsigned DEFAULT_COMPRESS_LEVEL = 1;
+
+#if defined(__NDS__)
+/// \brief Default block cache size in KiB
+constexpr unsigned DEFAULT_BLOCK_CACHE = 0;
+#elif defined(__3DS__)
+/// \brief Default block cache size in KiB
+constexpr unsigned DEFAULT_BLOCK_CACHE = 1024;
+#elif defined(__WIIU__)
+/// \brief Default block cache size in KiB; off, as the plugin heap is shared with the running
+/// title and read-ahead already keeps downloads off the network thread
+constexpr unsigned DEFAULT_BLOCK_CACHE = 0;
+#else
+/// \brief Default block cache size in KiB
+constexpr unsigned DEFAULT_BLOCK_CACHE = 4096;
+#endif
+
+#if defined(__NDS__)
+/// \brief Default smallest data socket buffer in KiB
+constexpr unsigned DEFAULT_SOCK_BUFFER_MIN = 4;
+
+/// \brief Default largest data socket buffer in KiB
+constexpr unsigned DEFAULT_SOCK_BUFFER_MAX = 4;
+#elif defined(__3DS__)
+/// \brief Default smallest data socket buffer in KiB
+constexpr unsigned DEFAULT_SOCK_BUFFER_MIN = 32;
+
+/// \brief Default largest data socket buffer in KiB
+constexpr unsigned DEFAULT_SOCK_BUFFER_MAX = 32;
+#else
+/// \brief Default smallest data socket buffer in KiB
+constexpr unsigned DEFAULT_SOCK_BUFFER_MIN = 16;
+
+/// \brief Default largest data socket buffer in KiB
+constexpr unsigned DEFAULT_SOCK_BUFFER_MAX = 128;
+#endif
+
 bool mkdirParent (std::string_view const path_)
 {
 	auto pos = path_.find_first_of ('/');
@@ -109,7 +166,16 @@ bool parseInt (T &out_, std::string_view const val_)
 ///////////////////////////////////////////////////////////////////////////
 FtpConfig::~FtpConfig () = default;
 
-FtpConfig::FtpConfig () : m_port (DEFAULT_PORT)
+FtpConfig::FtpConfig ()
+    : m_port (DEFAULT_PORT),
+      m_ioWorkers (DEFAULT_IO_WORKERS),
+      m_readAhead (DEFAULT_READ_AHEAD),
+      m_listPrefetch (DEFAULT_LIST_PREFETCH),
+      m_writeBehind (DEFAULT_WRITE_BEHIND),
+      m_blockCache (DEFAULT_BLOCK_CACHE),
+      m_sockBufferMin (DEFAULT_SOCK_BUFFER_MIN),
+      m_sockBufferMax (DEFAULT_SOCK_BUFFER_MAX),
+      m_compressLevel (DEFAULT_COMPRESS_LEVEL)
 {
 }
 
@@ -152,6 +218,108 @@ UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 			config->m_pass = val;
 		else if (key == "port")
 			parseInt (port, val);
+		else if (key == "ioworkers")
+		{
+			if (!parseInt (config->m_ioWorkers, val))
+				error ("Invalid value for ioworkers: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "readahead")
+		{
+			if (!parseInt (config->m_readAhead, val))
+				error ("Invalid value for readahead: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "listprefetch")
+		{
+			if (!parseInt (config->m_listPrefetch, val))
+				error ("Invalid value for listprefetch: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "writebehind")
+		{
+			if (!parseInt (config->m_writeBehind, val))
+				error ("Invalid value for writebehind: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "sessionworkers")
+		{
+			if (!parseInt (config->m_sessionWorkers, val))
+				error ("Invalid value for sessionworkers: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "workeraffinity")
+		{
+			if (!parseInt (config->m_workerAffinity, val))
+				error ("Invalid value for workeraffinity: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "sessionbalance")
+		{
+			if (val == "least")
+				config->m_sessionBalance = SessionBalance::LEAST_LOADED;
+			else if (val == "roundrobin")
+				config->m_sessionBalance = SessionBalance::ROUND_ROBIN;
+			else
+				error ("Invalid value for sessionbalance: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "listingcache")
+		{
+			if (!parseInt (config->m_listingCache, val))
+				error ("Invalid value for listingcache: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "preallocate")
+		{
+			if (val == "0")
+				config->m_preallocate = false;
+			else if (val == "1")
+				config->m_preallocate = true;
+			else
+				error ("Invalid value for preallocate: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "blockcache")
+		{
+			if (!parseInt (config->m_blockCache, val))
+				error ("Invalid value for blockcache: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "compresslevel")
+		{
+			unsigned level;
+			if (parseInt (level, val) && level <= 9)
+				config->m_compressLevel = level;
+			else
+				error ("Invalid value for compresslevel: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "sockbufmin")
+		{
+			if (!parseInt (config->m_sockBufferMin, val) || config->m_sockBufferMin == 0)
+				error ("Invalid value for sockbufmin: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "sockbufmax")
+		{
+			if (!parseInt (config->m_sockBufferMax, val) || config->m_sockBufferMax == 0)
+				error ("Invalid value for sockbufmax: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
 #ifdef __3DS__
 		else if (key == "mtime")
 		{
@@ -185,6 +353,7 @@ UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 	}
 
 	config->setPort (port);
+	config->setSockBufferBounds (config->m_sockBufferMin, config->m_sockBufferMax);
 
 	return config;
 }
@@ -210,6 +379,21 @@ bool FtpConfig::save (gsl::not_null<gsl::czstring> const path_)
 	if (!m_pass.empty ())
 		(void)std::fprintf (fp, "pass=%s\n", m_pass.c_str ());
 	(void)std::fprintf (fp, "port=%u\n", m_port);
+	(void)std::fprintf (fp, "ioworkers=%u\n", m_ioWorkers);
+	(void)std::fprintf (fp, "readahead=%u\n", m_readAhead);
+	(void)std::fprintf (fp, "listprefetch=%u\n", m_listPrefetch);
+	(void)std::fprintf (fp, "writebehind=%u\n", m_writeBehind);
+	(void)std::fprintf (fp, "sessionworkers=%u\n", m_sessionWorkers);
+	(void)std::fprintf (fp, "workeraffinity=%u\n", m_workerAffinity);
+	(void)std::fprintf (fp,
+	    "sessionbalance=%s\n",
+	    m_sessionBalance == SessionBalance::ROUND_ROBIN ? "roundrobin" : "least");
+	(void)std::fprintf (fp, "listingcache=%u\n", m_listingCache);
+	(void)std::fprintf (fp, "preallocate=%u\n", m_preallocate);
+	(void)std::fprintf (fp, "blockcache=%u\n", m_blockCache);
+	(void)std::fprintf (fp, "compresslevel=%u\n", m_compressLevel);
+	(void)std::fprintf (fp, "sockbufmin=%u\n", m_sockBufferMin);
+	(void)std::fprintf (fp, "sockbufmax=%u\n", m_sockBufferMax);
 
 #ifdef __3DS__
 	(void)std::fprintf (fp, "mtime=%u\n", m_getMTime);
@@ -246,6 +430,71 @@ std::uint16_t FtpConfig::port () const
 	return m_port;
 }
 
+unsigned FtpConfig::ioWorkers () const
+{
+	return m_ioWorkers;
+}
+
+unsigned FtpConfig::readAhead () const
+{
+	return m_readAhead;
+}
+
+unsigned FtpConfig::listPrefetch () const
+{
+	return m_listPrefetch;
+}
+
+unsigned FtpConfig::writeBehind () const
+{
+	return m_writeBehind;
+}
+
+unsigned FtpConfig::sessionWorkers () const
+{
+	return m_sessionWorkers;
+}
+
+unsigned FtpConfig::workerAffinity () const
+{
+	return m_workerAffinity;
+}
+
+FtpConfig::SessionBalance FtpConfig::sessionBalance () const
+{
+	return m_sessionBalance;
+}
+
+unsigned FtpConfig::listingCache () const
+{
+	return m_listingCache;
+}
+
+bool FtpConfig::preallocate () const
+{
+	return m_preallocate;
+}
+
+unsigned FtpConfig::blockCache () const
+{
+	return m_blockCache;
+}
+
+unsigned FtpConfig::compressLevel () const
+{
+	return m_compressLevel;
+}
+
+unsigned FtpConfig::sockBufferMin () const
+{
+	return m_sockBufferMin;
+}
+
+unsigned FtpConfig::sockBufferMax () const
+{
+	return m_sockBufferMax;
+}
+
 #ifdef __3DS__
 bool FtpConfig::getMTime () const
 {
@@ -317,6 +566,67 @@ bool FtpConfig::setPort (std::uint16_t const port_)
 	return true;
 }
 
+void FtpConfig::setIOWorkers (unsigned const workers_)
+{
+	m_ioWorkers = workers_;
+}
+
+void FtpConfig::setReadAhead (unsigned const blocks_)
+{
+	m_readAhead = blocks_;
+}
+
+void FtpConfig::setListPrefetch (unsigned const entries_)
+{
+	m_listPrefetch = entries_;
+}
+
+void FtpConfig::setWriteBehind (unsigned const kib_)
+{
+	m_writeBehind = kib_;
+}
+
+void FtpConfig::setSessionWorkers (unsigned const workers_)
+{
+	m_sessionWorkers = workers_;
+}
+
+void FtpConfig::setWorkerAffinity (unsigned const cpuMask_)
+{
+	m_workerAffinity = cpuMask_;
+}
+
+void FtpConfig::setSessionBalance (SessionBalance const balance_)
+{
+	m_sessionBalance = balance_;
+}
+
+void FtpConfig::setListingCache (unsigned const entries_)
+{
+	m_listingCache = entries_;
+}
+
+void FtpConfig::setPreallocate (bool const preallocate_)
+{
+	m_preallocate = preallocate_;
+}
+
+void FtpConfig::setBlockCache (unsigned const kib_)
+{
+	m_blockCache = kib_;
+}
+
+void FtpConfig::setCompressLevel (unsigned const level_)
+{
+	m_compressLevel = std::min (level_, 9u);
+}
+
+void FtpConfig::setSockBufferBounds (unsigned const min_, unsigned const max_)
+{
+	m_sockBufferMin = std::max (min_, 1u);
+	m_sockBufferMax = std::max (max_, m_sockBufferMin);
+}
+
 #ifdef __3DS__
 void FtpConfig::setGetMTime (bool const getMTime_)
 {
@@ -20,9 +20,12 @@
 
 #include "ftpServer.h"
 
+#include "bufferPool.h"
+#include "fileWorker.h"
 #include "fs.h"
 #include "ftpConfig.h"
 #include "ftpSession.h"
+#include "listingCache.h"
 #include "log.h"
 #include "platform.h"
 #include "sockAddr.h"
@@ -105,6 +108,30 @@ platform::Mutex s_lock;
 /// \brief Free space string
 std::string s_freeSpace;
 
+#ifndef __NDS__
+/// \brief Pick the core for a session worker
+/// \param cpuMask_ Cores workers may run on, one bit per core
+/// \param index_ Worker index
+/// \returns Single-core mask, or 0 for the platform default
+unsigned workerCore (unsigned const cpuMask_, unsigned const index_)
+{
+	unsigned cores = 0;
+	for (auto mask = cpuMask_; mask; mask &= mask - 1)
+		++cores;
+
+	if (cores == 0)
+		return 0;
+
+	// spread workers over the allowed cores in order
+	auto skip = index_ % cores;
+	auto mask = cpuMask_;
+	while (skip--)
+		mask &= mask - 1;
+
+	return mask & -mask;
+}
+#endif
+
 #ifndef CLASSIC
 #ifndef NDEBUG
 std::string printable (std::string_view const data_)
@@ -215,6 +242,16 @@ FtpServer::~FtpServer ()
 	m_thread.join ();
 #endif
 
+	// sessions may still have jobs with the file workers
+	m_sessions.clear ();
+#ifndef __NDS__
+	m_workers.clear ();
+#endif
+	FileWorkers::stop ();
+
+	// nothing is using pooled buffers anymore
+	BufferPool::trim ();
+
 #ifndef CLASSIC
 	if (m_uploadLogCurl)
 	{
@@ -235,6 +272,28 @@ FtpServer::FtpServer (UniqueFtpConfig config_)
       m_hostnameSetting (m_config->hostname ())
 #endif
 {
+	{
+#ifndef __NDS__
+		auto const lock = m_config->lockGuard ();
+#endif
+		FileWorkers::start (m_config->ioWorkers ());
+		ListingCache::setCapacity (m_config->listingCache ());
+		BlockCache::setCapacity (std::size_t (m_config->blockCache ()) * 1024);
+
+#ifndef __NDS__
+		auto const workers = m_config->sessionWorkers ();
+		auto const cpuMask = m_config->workerAffinity ();
+		m_sessionBalance   = m_config->sessionBalance ();
+
+		m_workers.reserve (workers);
+		for (unsigned i = 0; i < workers; ++i)
+			m_workers.emplace_back (std::make_unique<SessionWorker> (workerCore (cpuMask, i)));
+
+		if (workers != 0)
+			info ("Started %u session worker%s\n", workers, workers == 1 ? "" : "s");
+#endif
+	}
+
 #ifndef __NDS__
 	mdns::setHostname (m_config->hostname ());
 
@@ -313,6 +372,10 @@ void FtpServer::draw ()
 			if (&session != &m_sessions.back ())
 				std::fputc ('\n', stdout);
 		}
+#ifndef __NDS__
+		for (auto &worker : m_workers)
+			worker->draw ();
+#endif
 		std::fflush (stdout);
 #endif
 	}
@@ -383,6 +446,8 @@ void FtpServer::draw ()
 		auto const lock = std::scoped_lock (m_lock);
 		for (auto &session : m_sessions)
 			session->draw ();
+		for (auto &worker : m_workers)
+			worker->draw ();
 	}
 
 	ImGui::End ();
@@ -497,6 +562,11 @@ void FtpServer::handleNetworkLost ()
 		// destroy sessions
 		std::vector<UniqueFtpSession> sessions;
 		LOCKED (sessions = std::move (m_sessions));
+
+#ifndef __NDS__
+		for (auto &worker : m_workers)
+			worker->clear ();
+#endif
 	}
 
 	{
@@ -1008,37 +1078,13 @@ void FtpServer::loop ()
 	}
 #endif
 
-	// poll listen socket
+	// the listen and mDNS sockets share the session poll set so a connection or query wakes the
+	// thread right away; registering again is a no-op
 	if (m_socket)
-	{
-		Socket::PollInfo info{*m_socket, POLLIN, 0};
-		auto const rc = Socket::poll (&info, 1, 0ms);
-		if (rc < 0)
-		{
-			handleNetworkLost ();
-			return;
-		}
-
-		if (rc > 0 && (info.revents & POLLIN))
-		{
-			auto socket = m_socket->accept ();
-			if (socket)
-			{
-				auto session = FtpSession::create (*m_config, std::move (socket));
-				LOCKED (m_sessions.emplace_back (std::move (session)));
-			}
-			else
-			{
-				handleNetworkLost ();
-				return;
-			}
-		}
-	}
-
+		m_pollSet.update (*m_socket, POLLIN, nullptr);
 #ifndef __NDS__
-	// poll mDNS socket
-	if (m_socket && m_mdnsSocket)
-		mdns::handleSocket (m_mdnsSocket.get (), m_socket->sockName ());
+	if (m_mdnsSocket)
+		m_pollSet.update (*m_mdnsSocket, POLLIN, nullptr);
 #endif
 
 	{
@@ -1063,16 +1109,45 @@ void FtpServer::loop ()
 		}
 	}
 
-	// poll sessions
-	if (!m_sessions.empty ())
+	if (m_pollSet.empty ())
 	{
-		if (!FtpSession::poll (m_sessions))
+#ifndef __NDS__
+		// avoid busy polling in background thread
+		platform::Thread::sleep (16ms);
+#endif
+		return;
+	}
+
+	// poll sessions along with the listen socket
+	if (!FtpSession::poll (m_pollSet, m_sessions))
+	{
+		handleNetworkLost ();
+		return;
+	}
+
+	if (!m_socket)
+		return;
+
+	for (auto const &event : m_pollSet.ready ())
+	{
+		if (event.socket != m_socket.get () || !(event.revents & POLLIN))
+			continue;
+
+		auto socket = m_socket->accept ();
+		if (!socket)
+		{
 			handleNetworkLost ();
+			return;
+		}
+
+		addSession (FtpSession::create (*m_config, std::move (socket)));
+		break;
 	}
+
 #ifndef __NDS__
-	// avoid busy polling in background thread
-	else
-		platform::Thread::sleep (16ms);
+	// poll mDNS socket
+	if (m_mdnsSocket)
+		mdns::handleSocket (m_mdnsSocket.get (), m_socket->sockName ());
 #endif
 }
 
@@ -1081,3 +1156,28 @@ void FtpServer::threadFunc ()
 	while (!m_quit)
 		loop ();
 }
+
+void FtpServer::addSession (UniqueFtpSession session_)
+{
+#ifndef __NDS__
+	if (!m_workers.empty ())
+	{
+		std::size_t index = 0;
+		if (m_sessionBalance == FtpConfig::SessionBalance::ROUND_ROBIN)
+			index = m_nextWorker++ % m_workers.size ();
+		else
+		{
+			for (std::size_t i = 1; i < m_workers.size (); ++i)
+			{
+				if (m_workers[i]->load () < m_workers[index]->load ())
+					index = i;
+			}
+		}
+
+		m_workers[index]->add (std::move (session_));
+		return;
+	}
+#endif
+
+	LOCKED (m_sessions.emplace_back (std::move (session_)));
+}
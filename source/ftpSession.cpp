@@ -21,6 +21,8 @@
 #include "ftpSession.h"
 
 #include "IOAbstraction.h"
+#include "blockCache.h"
+#include "bufferPool.h"
 #include "ftpServer.h"
 #include "log.h"
 #include "mdns.h"
@@ -39,15 +41,19 @@
 #endif
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cerrno>
 #include <chrono>
 #include <cinttypes>
 #include <cstdarg>
+#include <cstdint>
 #include <cstring>
 #include <ctime>
+#include <limits>
 #include <mutex>
 #include <string>
+#include <utility>
 using namespace std::chrono_literals;
 
 #if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
@@ -70,6 +76,21 @@ namespace
 /// \brief Idle timeout
 constexpr auto IDLE_TIMEOUT = 60;
 
+/// \brief Time data transfers may run before control connections are polled again
+constexpr auto TRANSFER_BUDGET = 50ms;
+
+/// \brief Poll timeout while a file worker is about to hand a session data
+constexpr auto FILE_POLL_INTERVAL = 1ms;
+
+/// \brief Buffer space a listing leaves for the next entry; more than any one entry needs
+constexpr std::size_t LIST_LINE_RESERVE = 1024;
+
+/// \brief How often to retune a running transfer
+constexpr auto TUNE_INTERVAL = 500ms;
+
+/// \brief Round-trip time to assume when the TCP stack does not report one
+constexpr auto DEFAULT_RTT = std::chrono::microseconds (20ms);
+
 /// \brief Check if string view is a C string
 /// \param str_ String to check
 bool isCString (std::string_view const str_)
@@ -117,6 +138,104 @@ std::pair<char *, char *> parseCommand (char *const buffer_, std::size_t const s
 	return {nullptr, nullptr};
 }
 
+/// \brief Number of slots in the command hash
+constexpr std::size_t COMMAND_HASH_SLOTS = 256;
+
+/// \brief Pack an uppercased command name into an integer
+/// \param name_ Command name
+/// \returns 0 if the name is empty, too long, or has characters that can't be in a command
+constexpr std::uint64_t commandKey (std::string_view const name_)
+{
+	if (name_.empty () || name_.size () > sizeof (std::uint64_t))
+		return 0;
+
+	std::uint64_t key = 0;
+	for (std::size_t i = 0; i < name_.size (); ++i)
+	{
+		auto c = name_[i];
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		else if ((c < 'A' || c > 'Z') && (c < '0' || c > '9'))
+			return 0;
+
+		key |= static_cast<std::uint64_t> (c) << (8 * i);
+	}
+
+	return key;
+}
+
+/// \brief Get the slot of a command key
+/// \param key_ Command key
+/// \param multiplier_ Hash multiplier
+constexpr std::size_t commandSlot (std::uint64_t const key_, std::uint64_t const multiplier_)
+{
+	static_assert (COMMAND_HASH_SLOTS == 256);
+	return (key_ * multiplier_) >> 56;
+}
+
+/// \brief Perfect hash over a command table
+template <std::size_t N>
+struct CommandHash
+{
+	static_assert (N < COMMAND_HASH_SLOTS);
+
+	/// \brief Hash multiplier, or 0 if none was found
+	std::uint64_t multiplier = 0;
+
+	/// \brief Command keys, by table index
+	std::array<std::uint64_t, N> keys{};
+
+	/// \brief Table index + 1 by slot, or 0 if the slot is empty
+	std::array<std::uint8_t, COMMAND_HASH_SLOTS> slots{};
+};
+
+/// \brief Search for a multiplier that maps every command to its own slot
+/// \param handlers_ Command table
+template <typename T, std::size_t N>
+constexpr CommandHash<N> makeCommandHash (T const (&handlers_)[N])
+{
+	CommandHash<N> hash;
+	for (std::size_t i = 0; i < N; ++i)
+		hash.keys[i] = commandKey (handlers_[i].name);
+
+	// candidates come from splitmix64, so the search is the same on every build
+	std::uint64_t state = 0;
+	for (unsigned attempt = 0; attempt < 4096; ++attempt)
+	{
+		state += 0x9E3779B97F4A7C15ull;
+		auto z = state;
+		z      = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z      = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		z      = (z ^ (z >> 31)) | 1;
+
+		hash.slots = {};
+
+		bool ok = true;
+		for (std::size_t i = 0; ok && i < N; ++i)
+		{
+			auto &slot = hash.slots[commandSlot (hash.keys[i], z)];
+			ok         = hash.keys[i] != 0 && slot == 0;
+			slot       = static_cast<std::uint8_t> (i + 1);
+		}
+
+		if (ok)
+		{
+			hash.multiplier = z;
+			return hash;
+		}
+	}
+
+	return hash;
+}
+
+/// \brief Check whether a command line ends a running checksum
+/// \param line_ Command line without its delimiter
+bool endsChecksum (std::string_view const line_)
+{
+	auto const verb = line_.substr (0, line_.find (' '));
+	return compare (verb, "ABOR") == 0 || compare (verb, "QUIT") == 0;
+}
+
 /// \brief Decode path
 /// \param buffer_ Buffer to decode
 /// \param size_ Size of buffer
@@ -131,6 +250,27 @@ void decodePath (char *const buffer_, std::size_t const size_)
 	}
 }
 
+/// \brief Parse decimal offset
+/// \param p_ String to parse; advanced past the digits
+/// \param value_ Output value
+bool parseOffset (char const *&p_, std::uint64_t &value_)
+{
+	if (!std::isdigit (*p_))
+		return false;
+
+	value_ = 0;
+	for (; std::isdigit (*p_); ++p_)
+	{
+		auto const digit = static_cast<std::uint64_t> (*p_ - '0');
+		if (value_ > (UINT64_MAX - digit) / 10)
+			return false;
+
+		value_ = value_ * 10 + digit;
+	}
+
+	return true;
+}
+
 /// \brief Encode path
 /// \param buffer_ Buffer to encode
 /// \param quotes_ Whether to encode quotes
@@ -283,15 +423,11 @@ std::string buildPath (std::string_view const cwd_, std::string_view const args_
 	else
 		path = std::string (cwd_) + '/' + std::string (args_);
 
-	// coalesce consecutive slashes
-	auto it = std::begin (path);
-	while (it != std::end (path))
-	{
-		if (it != std::begin (path) && *it == '/' && *std::prev (it) == '/')
-			it = path.erase (it);
-		else
-			++it;
-	}
+	// coalesce consecutive slashes in one pass
+	path.erase (std::unique (std::begin (path),
+	                std::end (path),
+	                [] (char const a_, char const b_) { return a_ == '/' && b_ == '/'; }),
+	    std::end (path));
 
 	return path;
 }
@@ -303,6 +439,194 @@ std::string buildResolvedPath (std::string_view const cwd_, std::string_view con
 {
 	return resolvePath (buildPath (cwd_, args_));
 }
+
+/// \brief Bounded writer for directory entry lines
+/// Writes past the end are counted but dropped, so callers check overflow () once per line.
+class LineWriter
+{
+public:
+	/// \brief Parameterized constructor
+	/// \param buffer_ Output buffer
+	/// \param size_ Buffer size
+	LineWriter (char *const buffer_, std::size_t const size_) : m_buffer (buffer_), m_size (size_)
+	{
+	}
+
+	/// \brief Append character
+	/// \param c_ Character to append
+	void put (char const c_)
+	{
+		if (m_pos < m_size)
+			m_buffer[m_pos] = c_;
+		++m_pos;
+	}
+
+	/// \brief Append string
+	/// \param str_ String to append
+	void put (std::string_view const str_)
+	{
+		if (m_pos < m_size)
+			std::memcpy (&m_buffer[m_pos], str_.data (), std::min (str_.size (), m_size - m_pos));
+		m_pos += str_.size ();
+	}
+
+	/// \brief Append unsigned decimal
+	/// \param value_ Value to append
+	/// \param width_ Minimum width
+	/// \param pad_ Padding character
+	void putDec (std::uint64_t value_, unsigned const width_ = 0, char const pad_ = '0')
+	{
+		char digits[20];
+		unsigned count = 0;
+		do
+		{
+			digits[count++] = gsl::narrow_cast<char> ('0' + value_ % 10);
+			value_ /= 10;
+		} while (value_);
+
+		for (auto i = count; i < width_; ++i)
+			put (pad_);
+
+		while (count)
+			put (digits[--count]);
+	}
+
+	/// \brief Append signed decimal
+	/// \param value_ Value to append
+	void putDec (std::int64_t const value_)
+	{
+		if (value_ < 0)
+		{
+			put ('-');
+			putDec (std::uint64_t (0) - std::uint64_t (value_));
+		}
+		else
+			putDec (std::uint64_t (value_));
+	}
+
+	/// \brief Append octal
+	/// \param value_ Value to append
+	void putOct (unsigned long value_)
+	{
+		char digits[24];
+		unsigned count = 0;
+		do
+		{
+			digits[count++] = gsl::narrow_cast<char> ('0' + (value_ & 7));
+			value_ >>= 3;
+		} while (value_);
+
+		while (count)
+			put (digits[--count]);
+	}
+
+	/// \brief Last character written, or '\0' if none
+	char back () const
+	{
+		if (m_pos == 0 || m_pos > m_size)
+			return '\0';
+		return m_buffer[m_pos - 1];
+	}
+
+	/// \brief Whether the line did not fit
+	bool overflow () const
+	{
+		return m_pos > m_size;
+	}
+
+	/// \brief Number of characters written
+	std::size_t size () const
+	{
+		return m_pos;
+	}
+
+private:
+	/// \brief Output buffer
+	char *const m_buffer;
+
+	/// \brief Buffer size
+	std::size_t const m_size;
+
+	/// \brief Write position
+	std::size_t m_pos = 0;
+};
+
+/// \brief Broken-down UTC time
+struct CivilTime
+{
+	/// \brief Year
+	std::int64_t year;
+	/// \brief Month [1, 12]
+	unsigned month;
+	/// \brief Day of month [1, 31]
+	unsigned day;
+	/// \brief Hour [0, 23]
+	unsigned hour;
+	/// \brief Minute [0, 59]
+	unsigned minute;
+	/// \brief Second [0, 59]
+	unsigned second;
+};
+
+/// \brief Convert timestamp to UTC without gmtime
+/// \param time_ Timestamp to convert
+/// Dates are memoized per day, since entries in one directory tend to share a few days.
+CivilTime civilTime (std::time_t const time_)
+{
+	/// \brief Memoized date
+	struct DayDate
+	{
+		std::int64_t day;
+		std::int64_t year;
+		unsigned month;
+		unsigned day_;
+	};
+
+	constexpr std::size_t DAY_CACHE_SIZE = 64;
+	static thread_local std::array<DayDate, DAY_CACHE_SIZE> dayCache = [] () {
+		std::array<DayDate, DAY_CACHE_SIZE> cache{};
+		for (auto &entry : cache)
+			entry.day = std::numeric_limits<std::int64_t>::min ();
+		return cache;
+	}();
+
+	auto days = std::int64_t (time_) / 86400;
+	auto secs = std::int64_t (time_) % 86400;
+	if (secs < 0)
+	{
+		secs += 86400;
+		--days;
+	}
+
+	CivilTime result;
+	result.hour   = gsl::narrow_cast<unsigned> (secs / 3600);
+	result.minute = gsl::narrow_cast<unsigned> (secs / 60 % 60);
+	result.second = gsl::narrow_cast<unsigned> (secs % 60);
+
+	auto &cached = dayCache[std::uint64_t (days) % DAY_CACHE_SIZE];
+	if (cached.day != days)
+	{
+		// days since 1970-01-01 to proleptic Gregorian date
+		auto const z   = days + 719468;
+		auto const era = (z >= 0 ? z : z - 146096) / 146097;
+		auto const doe = z - era * 146097;
+		auto const yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		auto const doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+		auto const mp  = (5 * doy + 2) / 153;
+		auto const m   = mp < 10 ? mp + 3 : mp - 9;
+
+		cached.day   = days;
+		cached.month = gsl::narrow_cast<unsigned> (m);
+		cached.day_  = gsl::narrow_cast<unsigned> (doy - (153 * mp + 2) / 5 + 1);
+		cached.year  = yoe + era * 400 + (m <= 2);
+	}
+
+	result.year  = cached.year;
+	result.month = cached.month;
+	result.day   = cached.day_;
+
+	return result;
+}
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -412,6 +736,9 @@ FtpSession::FtpSession (FtpConfig &config_, UniqueSocket commandSocket_)
 
 	m_commandSocket->setNonBlocking ();
 
+	// replies are coalesced before they are written, so Nagle would only delay them
+	m_commandSocket->setNoDelay ();
+
 	sendResponse ("220 Hello!\r\n");
 }
 
@@ -558,64 +885,38 @@ UniqueFtpSession FtpSession::create (FtpConfig &config_, UniqueSocket commandSoc
 	return UniqueFtpSession (new FtpSession (config_, std::move (commandSocket_)));
 }
 
-bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
+bool FtpSession::poll (PollSet &pollSet_, std::vector<UniqueFtpSession> const &sessions_)
 {
-	// poll for pending close sockets first
-	std::vector<Socket::PollInfo> pollInfo;
+	// finish uploads whose file workers have flushed or failed, and reply to finished checksums
 	for (auto &session : sessions_)
 	{
-		for (auto &pending : session->m_pendingCloseSocket)
-		{
-			assert (pending.unique ());
-			pollInfo.emplace_back (*pending, POLLIN, 0);
-		}
-	}
-
-	if (!pollInfo.empty ())
-	{
-		auto const rc = Socket::poll (pollInfo.data (), pollInfo.size (), 0ms);
-		if (rc < 0)
-		{
-			error ("poll: %s\n", std::strerror (errno));
-			return false;
-		}
-		else
-		{
-			for (auto const &i : pollInfo)
-			{
-				if (!i.revents)
-					continue;
+		if (session->m_state == State::DATA_TRANSFER && session->m_writeBehind &&
+		    session->m_writeBehind->settled ())
+			session->storeTransfer ();
 
-				for (auto &session : sessions_)
-				{
-					for (auto it = std::begin (session->m_pendingCloseSocket);
-					     it != std::end (session->m_pendingCloseSocket);)
-					{
-						auto &socket = *it;
-						if (&i.socket.get () != socket.get ())
-						{
-							++it;
-							continue;
-						}
-
-						it = session->m_pendingCloseSocket.erase (it);
-					}
-				}
-			}
-		}
+		if (session->m_fileHash)
+			session->pollHash ();
 	}
 
-	// poll for everything else
-	pollInfo.clear ();
+	// update interest; sockets whose interest did not change cost nothing here
+	bool waitingOnFile = false;
 	for (auto &session : sessions_)
 	{
-		if (session->m_commandSocket)
+		auto const user = session.get ();
+
+		// a checksum is replied to from the top of the next poll
+		if (session->m_fileHash)
+			waitingOnFile = true;
+
+		// wait for the peer to close
+		for (auto &pending : session->m_pendingCloseSocket)
 		{
-			pollInfo.emplace_back (*session->m_commandSocket, POLLIN | POLLPRI, 0);
-			if (session->m_responseBuffer.usedSize () != 0)
-				pollInfo.back ().events |= POLLOUT;
+			assert (pending.unique ());
+			pollSet_.update (*pending, POLLIN, user);
 		}
 
+		int pasvEvents = 0;
+		int dataEvents = 0;
 		switch (session->m_state)
 		{
 		case State::COMMAND:
@@ -627,12 +928,12 @@ bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
 			{
 				assert (!session->m_port);
 				// we are waiting for a PASV connection
-				pollInfo.emplace_back (*session->m_pasvSocket, POLLIN, 0);
+				pasvEvents = POLLIN;
 			}
 			else
 			{
 				// we are waiting to complete a PORT connection
-				pollInfo.emplace_back (*session->m_dataSocket, POLLOUT, 0);
+				dataEvents = POLLOUT;
 			}
 			break;
 
@@ -641,125 +942,188 @@ bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
 			if (session->m_recv)
 			{
 				assert (!session->m_send);
-				pollInfo.emplace_back (*session->m_dataSocket, POLLIN, 0);
+
+				// leave data in the socket until there is somewhere to put it
+				if (session->m_writeBehind && !session->m_writeBehind->ready ())
+				{
+					waitingOnFile = true;
+					break;
+				}
+
+				dataEvents = POLLIN;
 			}
 			else
 			{
 				assert (session->m_send);
-				pollInfo.emplace_back (*session->m_dataSocket, POLLOUT, 0);
+
+				// no point waiting for socket space until there is something to send
+				if (session->m_readAhead && !session->m_readAhead->ready ())
+				{
+					waitingOnFile = true;
+					break;
+				}
+
+				if (session->m_cachePrefetch && !session->m_cachePrefetch->ready ())
+				{
+					waitingOnFile = true;
+					break;
+				}
+
+				// stats quicker than a poll wakeup are run by the transfer itself, and formatted
+				// entries can be sent meanwhile
+				if (session->m_statPrefetch && session->m_xferBuffer.empty () &&
+				    !session->m_statPrefetch->ready () && !session->m_statPrefetch->quick ())
+				{
+					waitingOnFile = true;
+					break;
+				}
+
+				dataEvents = POLLOUT;
 			}
 			break;
 		}
+
+		// MLST and STAT with a path transfer over the command socket, which has one slot
+		auto const sharedData = session->m_dataSocket == session->m_commandSocket;
+
+		if (session->m_commandSocket)
+		{
+			auto events = POLLIN | POLLPRI;
+			if (session->m_responseBuffer.usedSize () != 0)
+				events |= POLLOUT;
+			if (sharedData)
+				events |= dataEvents;
+
+			pollSet_.update (*session->m_commandSocket, events, user);
+		}
+
+		if (session->m_pasvSocket)
+			pollSet_.update (*session->m_pasvSocket, pasvEvents, user);
+		if (session->m_dataSocket && !sharedData)
+			pollSet_.update (*session->m_dataSocket, dataEvents, user);
+
+		session->m_handled = false;
 	}
 
-	if (pollInfo.empty ())
+	if (pollSet_.empty ())
 		return true;
 
-	// poll for activity
-	auto const rc = Socket::poll (pollInfo.data (), pollInfo.size (), 100ms);
+	// poll for activity; come back quickly if a file worker is about to hand us data
+	auto const rc = pollSet_.poll (waitingOnFile ? FILE_POLL_INTERVAL : 100ms);
 	if (rc < 0)
-	{
-		error ("poll: %s\n", std::strerror (errno));
 		return false;
-	}
 
-	auto const now = std::time (nullptr);
+	// data transfers are deferred until every control connection has been serviced
+	static thread_local std::vector<FtpSession *> transfers;
+	transfers.clear ();
 
-	for (auto &session : sessions_)
+	auto const &ready = pollSet_.ready ();
+	for (std::size_t i = 0; i < ready.size (); ++i)
 	{
-		bool handled = false;
-		for (auto const &i : pollInfo)
+		// copy; handling an event can remove sockets from the ready list
+		auto event = ready[i];
+		if (!event.socket)
+			continue;
+
+		// not a session socket; left for the caller
+		auto const session = static_cast<FtpSession *> (event.user);
+		if (!session)
+			continue;
+
+		session->m_handled = true;
+
+		// check pending close sockets
+		if (!(event.revents & POLLOUT))
 		{
-			if (!i.revents)
+			auto &pending = session->m_pendingCloseSocket;
+			auto const it = std::find_if (std::begin (pending),
+			    std::end (pending),
+			    [&event] (auto const &socket_) { return socket_.get () == event.socket; });
+			if (it != std::end (pending))
+			{
+				pending.erase (it);
 				continue;
+			}
+		}
 
-			handled = true;
+		// check command socket
+		if (event.socket == session->m_commandSocket.get ())
+		{
+			if (event.revents & ~(POLLIN | POLLPRI | POLLOUT))
+				debug ("Command revents 0x%X\n", event.revents);
 
-			// check command socket
-			if (&i.socket.get () == session->m_commandSocket.get ())
-			{
-				if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-					debug ("Command revents 0x%X\n", i.revents);
+			if (!session->m_dataSocket && (event.revents & POLLOUT))
+				session->writeResponse ();
 
-				if (!session->m_dataSocket && (i.revents & POLLOUT))
-					session->writeResponse ();
+			if (event.revents & (POLLIN | POLLPRI))
+				session->readCommand (event.revents);
 
-				if (i.revents & (POLLIN | POLLPRI))
-					session->readCommand (i.revents);
+			if (event.revents & (POLLERR | POLLHUP))
+				session->closeCommand ();
 
-				if (i.revents & (POLLERR | POLLHUP))
-					session->closeCommand ();
-			}
+			// input was a command; only writability concerns a transfer sharing the socket
+			event.revents &= ~(POLLIN | POLLPRI);
+		}
 
-			// check the data socket
-			if (&i.socket.get () == session->m_pasvSocket.get () ||
-			    &i.socket.get () == session->m_dataSocket.get ())
-			{
-				switch (session->m_state)
-				{
-				case State::COMMAND:
-					std::abort ();
-					break;
+		// check the data socket
+		if (event.socket != session->m_pasvSocket.get () &&
+		    event.socket != session->m_dataSocket.get ())
+			continue;
+
+		switch (session->m_state)
+		{
+		case State::COMMAND:
+			// the transfer ended after this socket became ready
+			break;
 
-				case State::DATA_CONNECT:
-					if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-						debug ("Data revents 0x%X\n", i.revents);
+		case State::DATA_CONNECT:
+			if (event.revents & ~(POLLIN | POLLPRI | POLLOUT))
+				debug ("Data revents 0x%X\n", event.revents);
 
-					if (i.revents & (POLLERR | POLLHUP))
-					{
-						session->sendResponse ("426 Data connection failed\r\n");
-						session->setState (State::COMMAND, true, true);
-					}
-					else if (i.revents & POLLIN)
-					{
-						// we need to accept the PASV connection
-						session->dataAccept ();
-					}
-					else if (i.revents & POLLOUT)
-					{
-						// PORT connection completed
-						auto const &sockName = session->m_dataSocket->peerName ();
-						info ("Connected to [%s]:%u\n", sockName.name (), sockName.port ());
+			if (event.revents & (POLLERR | POLLHUP))
+			{
+				session->sendResponse ("426 Data connection failed\r\n");
+				session->setState (State::COMMAND, true, true);
+			}
+			else if (event.revents & POLLIN)
+			{
+				// we need to accept the PASV connection
+				session->dataAccept ();
+			}
+			else if (event.revents & POLLOUT)
+			{
+				// PORT connection completed
+				auto const &sockName = session->m_dataSocket->peerName ();
+				info ("Connected to [%s]:%u\n", sockName.name (), sockName.port ());
 
-						session->sendResponse ("150 Ready\r\n");
-						session->setState (State::DATA_TRANSFER, true, false);
-					}
-					break;
+				session->sendResponse ("150 Ready\r\n");
+				session->setState (State::DATA_TRANSFER, true, false);
+			}
+			break;
 
-				case State::DATA_TRANSFER:
-					if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-						debug ("Data revents 0x%X\n", i.revents);
+		case State::DATA_TRANSFER:
+			if (event.revents & ~(POLLIN | POLLPRI | POLLOUT))
+				debug ("Data revents 0x%X\n", event.revents);
 
-					// we need to transfer data
-					if (i.revents & (POLLERR | POLLHUP))
-					{
-						session->sendResponse ("426 Data connection failed\r\n");
-						session->setState (State::COMMAND, true, true);
-					}
-					else if (i.revents & (POLLIN | POLLOUT))
-					{
-						auto start_time = std::chrono::high_resolution_clock::now ();
-						while (true)
-						{
-							if (!((*session).*(session->m_transfer)) ())
-							{
-								break;
-							}
-
-							if (std::chrono::duration_cast<std::chrono::microseconds> (
-							        std::chrono::high_resolution_clock::now () - start_time) >
-							    5000ms)
-							{
-								break;
-							}
-						}
-					}
-					break;
-				}
+			// we need to transfer data
+			if (event.revents & (POLLERR | POLLHUP))
+			{
+				session->sendResponse ("426 Data connection failed\r\n");
+				session->setState (State::COMMAND, true, true);
+			}
+			else if (event.revents & (POLLIN | POLLOUT))
+			{
+				session->tuneTransfer ();
+				transfers.emplace_back (session);
 			}
+			break;
 		}
+	}
 
-		if (!handled && now - session->m_timestamp >= IDLE_TIMEOUT)
+	auto const now = std::time (nullptr);
+	for (auto &session : sessions_)
+	{
+		if (!session->m_handled && now - session->m_timestamp >= IDLE_TIMEOUT)
 		{
 			session->closeCommand ();
 			session->closePasv ();
@@ -767,6 +1131,53 @@ bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
 		}
 	}
 
+	// deficit round-robin: each round every ready transfer earns a quantum of bytes and runs until
+	// it has spent it, would block, or finishes; unspent credit is dropped when a transfer blocks
+	auto const start = platform::steady_clock::now ();
+	while (!transfers.empty () && platform::steady_clock::now () - start < TRANSFER_BUDGET)
+	{
+		auto it = std::begin (transfers);
+		while (it != std::end (transfers))
+		{
+			auto const session = *it;
+			if (session->m_state != State::DATA_TRANSFER || !session->m_dataSocket)
+			{
+				// a control command ended the transfer
+				session->m_deficit = 0;
+				it                 = transfers.erase (it);
+				continue;
+			}
+
+			session->m_deficit += TRANSFER_QUANTUM;
+
+			bool again = true;
+			while (again && session->m_deficit > 0)
+			{
+				auto const position = session->m_filePosition;
+				again               = ((*session).*(session->m_transfer)) ();
+
+				// a call that only refilled a buffer still costs something
+				session->m_deficit -= std::max<std::int64_t> (
+				    gsl::narrow_cast<std::int64_t> (session->m_filePosition - position), 1);
+			}
+
+			if (!again || session->m_state != State::DATA_TRANSFER)
+			{
+				session->m_deficit = 0;
+				it                 = transfers.erase (it);
+			}
+			else
+				++it;
+		}
+	}
+
+	// everything queued this iteration leaves in one write per session
+	for (auto &session : sessions_)
+	{
+		if (session->m_commandSocket && !session->m_responseBuffer.empty ())
+			session->flushResponses ();
+	}
+
 	return true;
 }
 
@@ -777,6 +1188,29 @@ bool FtpSession::authorized () const
 
 void FtpSession::setState (State const state_, bool const closePasv_, bool const closeData_)
 {
+	auto const now = platform::steady_clock::now ();
+
+	if (m_state == State::DATA_TRANSFER && state_ == State::COMMAND && !m_workItem.empty () &&
+	    (m_transfer == &FtpSession::retrieveTransfer || m_transfer == &FtpSession::storeTransfer))
+	{
+		auto const bytes   = m_filePosition - m_restartPosition;
+		auto const seconds = std::chrono::duration<float> (now - m_xferStart).count ();
+		info ("%s %s: %s in %.2fs (%s/s), chunk %zu, socket buffer %zu\n",
+		    m_transfer == &FtpSession::storeTransfer ? "Received" : "Sent",
+		    m_workItem.c_str (),
+		    fs::printSize (bytes).c_str (),
+		    seconds,
+		    fs::printSize (seconds > 0.0f ? bytes / seconds : 0.0f).c_str (),
+		    m_xferChunk,
+		    m_sockBufferSize);
+	}
+	else if (m_state != State::DATA_TRANSFER && state_ == State::DATA_TRANSFER)
+	{
+		m_xferStart    = now;
+		m_tuneTime     = now;
+		m_tunePosition = m_filePosition;
+	}
+
 	m_state     = state_;
 	m_timestamp = std::time (nullptr);
 
@@ -787,10 +1221,32 @@ void FtpSession::setState (State const state_, bool const closePasv_, bool const
 
 	if (state_ == State::COMMAND)
 	{
+		// the file workers must be done with an upload before it is trimmed
+		m_writeBehind.reset ();
+
+		if (m_preallocated)
 		{
-#ifndef __NDS__
-			auto const lock = std::scoped_lock (m_lock);
-#endif
+			// give back whatever was preallocated but never written, e.g. after an abort
+			auto const end = m_file.flush () ? m_file.tell () : -1;
+			if (end < 0 ||
+			    !m_file.truncate (std::max (static_cast<std::uint64_t> (end), m_preallocFloor)))
+				error ("Failed to trim %s: %s\n", m_workItem.c_str (), std::strerror (errno));
+
+			m_preallocated = false;
+		}
+
+		// an upload changed the file's size and mtime
+		if (m_file && m_transfer == &FtpSession::storeTransfer && !m_workItem.empty ())
+		{
+			ListingCache::invalidate (m_workItem);
+			BlockCache::invalidate (m_workItem);
+			IOAbstraction::invalidate (m_workItem.c_str ());
+		}
+
+		{
+#ifndef __NDS__
+			auto const lock = std::scoped_lock (m_lock);
+#endif
 
 			m_restartPosition = 0;
 			m_fileSize        = 0;
@@ -804,8 +1260,20 @@ void FtpSession::setState (State const state_, bool const closePasv_, bool const
 		}
 
 		m_devZero = false;
+		m_statPrefetch.reset ();
+		m_readAhead.reset ();
+		m_cachePrefetch.reset ();
+		m_cacheBlock.reset ();
+#if FTPD_HAS_ZLIB
+		if (m_zStream && m_zStream->skipped () != 0)
+			debug ("MODE Z stored %u incompressible samples\n", m_zStream->skipped ());
+		m_zStream.reset ();
+		m_zBuffer.reset ();
+#endif
 		m_file.close ();
 		m_dir.close ();
+		m_listing.reset ();
+		m_listingBuild.reset ();
 	}
 }
 
@@ -825,6 +1293,10 @@ void FtpSession::closeSocket (SharedSocket &socket_)
 
 void FtpSession::closeCommand ()
 {
+	// best effort for queued responses, e.g. QUIT's
+	if (m_commandSocket && !m_responseBuffer.empty ())
+		(void)m_commandSocket->write (m_responseBuffer);
+
 	closeSocket (m_commandSocket);
 }
 
@@ -895,11 +1367,7 @@ bool FtpSession::dataAccept ()
 	}
 
 #ifndef __3DS__
-#ifdef __WIIU__
-	m_dataSocket->setWinScale (1);
-#endif
-	m_dataSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_dataSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	setupDataSocket (*m_dataSocket);
 #endif
 
 	if (!m_dataSocket->setNonBlocking ())
@@ -926,11 +1394,7 @@ bool FtpSession::dataConnect ()
 	if (!m_dataSocket)
 		return false;
 
-#ifdef __WIIU__
-	m_dataSocket->setWinScale (1);
-#endif
-	m_dataSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_dataSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	setupDataSocket (*m_dataSocket);
 
 	if (!m_dataSocket->setNonBlocking ())
 		return false;
@@ -949,6 +1413,429 @@ bool FtpSession::dataConnect ()
 	return true;
 }
 
+void FtpSession::setupDataSocket (Socket &socket_)
+{
+	{
+#ifndef __NDS__
+		auto const lock = m_config.lockGuard ();
+#endif
+		m_sockBufferMin = std::size_t (m_config.sockBufferMin ()) * 1024;
+		m_sockBufferMax = std::size_t (m_config.sockBufferMax ()) * 1024;
+	}
+
+	m_sockBufferSize = std::clamp (m_sockBufferSize, m_sockBufferMin, m_sockBufferMax);
+	m_xferChunk = std::clamp<std::size_t> (m_sockBufferSize, MIN_XFER_CHUNK, XFER_BUFFERSIZE);
+
+#ifdef __WIIU__
+	// the window scale is fixed when the connection is set up, so leave room for the largest buffer
+	int scale = 1;
+	while (scale < 14 && (std::size_t (0xFFFF) << scale) < m_sockBufferMax)
+		++scale;
+	socket_.setWinScale (scale);
+#endif
+	socket_.setRecvBufferSize (m_sockBufferSize);
+	socket_.setSendBufferSize (m_sockBufferSize);
+}
+
+void FtpSession::tuneTransfer ()
+{
+	auto const now = platform::steady_clock::now ();
+	if (now - m_tuneTime < TUNE_INTERVAL)
+		return;
+
+	auto const elapsed = std::chrono::duration<float> (now - m_tuneTime).count ();
+	auto const rate    = gsl::narrow_cast<float> (m_filePosition - m_tunePosition) / elapsed;
+	m_tuneTime         = now;
+	m_tunePosition     = m_filePosition;
+
+	if (m_sockBufferMin == m_sockBufferMax || !m_dataSocket)
+		return;
+
+	auto rtt = m_dataSocket->rtt ();
+	if (rtt.count () == 0)
+		rtt = DEFAULT_RTT;
+
+	// aim for two bandwidth-delay products in flight; move one step per sample so a single noisy
+	// sample can't swing the size, and only shrink once the buffer is well oversized
+	auto const bdp = rate * std::chrono::duration<float> (rtt).count ();
+	auto size      = m_sockBufferSize;
+	if (2.0f * bdp > size)
+		size *= 2;
+	else if (4.0f * bdp < size)
+		size /= 2;
+
+	size = std::clamp (size, m_sockBufferMin, m_sockBufferMax);
+	if (size == m_sockBufferSize)
+		return;
+
+	// the kernel may refuse the new size; keep the old one then
+	auto const applied = m_transfer == &FtpSession::storeTransfer
+	                         ? m_dataSocket->setRecvBufferSize (size)
+	                         : m_dataSocket->setSendBufferSize (size);
+	if (!applied)
+		return;
+
+	m_sockBufferSize = size;
+	m_xferChunk = std::clamp<std::size_t> (m_sockBufferSize, MIN_XFER_CHUNK, XFER_BUFFERSIZE);
+}
+
+std::make_signed_t<std::size_t> FtpSession::sendData ()
+{
+#if FTPD_HAS_ZLIB
+	if (m_modeZ)
+	{
+		if (!startZStream (ZStream::Direction::DEFLATE))
+			return -1;
+
+		// send earlier output first so the stream has room to produce more
+		if (!m_zBuffer->empty ())
+		{
+			auto const rc = m_dataSocket->write (*m_zBuffer);
+			if (rc <= 0)
+				return rc;
+		}
+
+		auto const pending = m_xferBuffer.usedTotal ();
+		if (!m_zStream->process (m_xferBuffer, *m_zBuffer, false))
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		auto const consumed = pending - m_xferBuffer.usedTotal ();
+		if (consumed == 0)
+		{
+			// compressed output is backed up behind the socket
+			errno = EWOULDBLOCK;
+			return -1;
+		}
+
+		return consumed;
+	}
+#endif
+
+	return m_dataSocket->write (m_xferBuffer);
+}
+
+bool FtpSession::flushData ()
+{
+#if FTPD_HAS_ZLIB
+	if (m_modeZ)
+	{
+		// an empty transfer still has to send an empty stream
+		if (!startZStream (ZStream::Direction::DEFLATE))
+			return false;
+
+		while (true)
+		{
+			if (!m_zStream->process (m_xferBuffer, *m_zBuffer, true))
+			{
+				errno = EIO;
+				return false;
+			}
+
+			if (m_zBuffer->empty ())
+			{
+				if (m_zStream->done ())
+					return true;
+
+				errno = EIO;
+				return false;
+			}
+
+			auto const rc = m_dataSocket->write (*m_zBuffer);
+			if (rc <= 0)
+			{
+				if (rc == 0)
+					errno = EPIPE;
+				return false;
+			}
+		}
+	}
+#endif
+
+	return true;
+}
+
+std::make_signed_t<std::size_t> FtpSession::recvData ()
+{
+#if FTPD_HAS_ZLIB
+	if (m_modeZ)
+	{
+		if (!startZStream (ZStream::Direction::INFLATE))
+			return -1;
+
+		auto eof = false;
+		if (m_zBuffer->freeTotal () != 0)
+		{
+			auto const rc = m_dataSocket->read (*m_zBuffer);
+			if (rc < 0 && errno != EWOULDBLOCK)
+				return rc;
+
+			eof = rc == 0;
+		}
+
+		auto const pending = m_xferBuffer.usedTotal ();
+		if (!m_zStream->process (*m_zBuffer, m_xferBuffer, eof))
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		// discard anything after the end of the stream until the sender closes
+		if (m_zStream->done ())
+			m_zBuffer->clear ();
+
+		if (auto const produced = m_xferBuffer.usedTotal () - pending; produced != 0)
+			return produced;
+
+		if (eof)
+		{
+			if (m_zStream->done ())
+				return 0;
+
+			// the sender closed in the middle of the stream
+			errno = EPIPE;
+			return -1;
+		}
+
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+#endif
+
+	return m_dataSocket->read (m_xferBuffer);
+}
+
+bool FtpSession::endTransfer (int const code_)
+{
+	if (!flushData ())
+	{
+		if (errno == EWOULDBLOCK)
+			return false;
+
+		sendResponse ("426 Connection broken during transfer\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	sendResponse ("%d OK\r\n", code_);
+	setState (State::COMMAND, true, true);
+	return false;
+}
+
+#if FTPD_HAS_ZLIB
+bool FtpSession::startZStream (ZStream::Direction const direction_)
+{
+	if (m_zStream)
+		return true;
+
+	auto level = m_zLevel;
+	if (level < 0)
+	{
+#ifndef __NDS__
+		auto const lock = m_config.lockGuard ();
+#endif
+		level = gsl::narrow_cast<int> (m_config.compressLevel ());
+	}
+
+	m_zStream = std::make_unique<ZStream> (direction_, level);
+	if (!m_zStream->valid ())
+	{
+		m_zStream.reset ();
+		errno = ENOMEM;
+		return false;
+	}
+
+	m_zBuffer = std::make_unique<RingBuffer> (XFER_BUFFERSIZE);
+	return true;
+}
+#endif
+
+void FtpSession::startHash (char const *const path_,
+    Checksum::Algorithm const algorithm_,
+    std::uint64_t const start_,
+    std::uint64_t end_,
+    bool const hash_)
+{
+	// build the path to hash
+	auto const path = buildResolvedPath (m_cwd, path_);
+	if (path.empty ())
+	{
+		sendResponse ("553 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	// stat the path
+	stat_t st;
+	if (tzStat (path.c_str (), &st) != 0)
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	if (!S_ISREG (st.st_mode))
+	{
+		sendResponse ("550 Not a file\r\n");
+		return;
+	}
+
+	end_ = std::min (end_, static_cast<std::uint64_t> (st.st_size));
+	if (start_ > end_)
+	{
+		sendResponse ("556 Invalid range\r\n");
+		return;
+	}
+
+	fs::File file;
+	if (!file.open (path.c_str ()))
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	if (start_ != 0)
+	{
+		// FileHash reads the descriptor directly when there is one
+		auto const offset = gsl::narrow_cast<std::make_signed_t<std::size_t>> (start_);
+		auto const ok =
+		    file.fd () >= 0 ? file.seekDirect (start_) : file.seek (offset, SEEK_SET) == 0;
+		if (!ok)
+		{
+			sendResponse ("550 %s\r\n", std::strerror (errno));
+			return;
+		}
+	}
+
+	if (hash_)
+	{
+		// the range is inclusive like RANG's; an empty file or range has no last byte, so it is
+		// reported as start-start
+		auto const last = end_ > start_ ? end_ - 1 : start_;
+
+		char prefix[64];
+		std::snprintf (prefix,
+		    sizeof (prefix),
+		    "213 %s %" PRIu64 "-%" PRIu64 " ",
+		    Checksum::name (algorithm_),
+		    start_,
+		    last);
+
+		m_hashPrefix = prefix;
+		m_hashSuffix = " " + encodePath (path_);
+	}
+	else
+	{
+		m_hashPrefix = "250 ";
+		m_hashSuffix.clear ();
+	}
+
+	m_fileHash   = std::make_unique<FileHash> (std::move (file), algorithm_, end_ - start_);
+	m_hashInline = !m_fileHash->start ();
+
+	info ("Hashing %s with %s%s\n",
+	    path.c_str (),
+	    Checksum::name (algorithm_),
+	    m_hashInline ? " on the network thread" : "");
+}
+
+void FtpSession::xhash (char const *const args_, Checksum::Algorithm const algorithm_)
+{
+	setState (State::COMMAND, false, false);
+
+	// a quoted path may be followed by a start and end offset
+	std::string path = args_;
+	std::uint64_t start = 0;
+	std::uint64_t end   = UINT64_MAX;
+	if (args_[0] == '"')
+	{
+		auto p = std::strchr (args_ + 1, '"');
+		if (!p)
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		path.assign (args_ + 1, p++);
+
+		auto valid = true;
+		if (*p == ' ')
+		{
+			++p;
+			valid = parseOffset (p, start);
+			if (valid && *p == ' ')
+			{
+				++p;
+				valid = parseOffset (p, end);
+			}
+		}
+
+		if (!valid || *p)
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+	}
+
+	startHash (path.c_str (), algorithm_, start, end, false);
+}
+
+void FtpSession::pollHash ()
+{
+	if (m_hashInline)
+	{
+		// no file workers; hash on this thread for a bounded time
+		auto const start = platform::steady_clock::now ();
+		while (platform::steady_clock::now () - start < TRANSFER_BUDGET)
+		{
+			if (!m_fileHash->run ())
+				break;
+		}
+	}
+
+	// don't let a long checksum idle the session out
+	m_timestamp = std::time (nullptr);
+
+	if (!m_fileHash->done ())
+		return;
+
+	if (auto const rc = m_fileHash->error (); rc != 0)
+		sendResponse ("451 %s\r\n", std::strerror (rc));
+	else
+		sendResponse ("%s%s%s\r\n",
+		    m_hashPrefix.c_str (),
+		    m_fileHash->digest ().c_str (),
+		    m_hashSuffix.c_str ());
+
+	m_fileHash.reset ();
+
+	// run any commands that were pipelined behind the checksum
+	readCommand (0);
+}
+
+char const *FtpSession::retrieveModeName (RetrieveMode const mode_)
+{
+	switch (mode_)
+	{
+	case RetrieveMode::STDIO:
+		return "buffered reads";
+
+	case RetrieveMode::DIRECT:
+		return "direct reads";
+
+	case RetrieveMode::READAHEAD:
+		return "read-ahead";
+
+	case RetrieveMode::SENDFILE:
+		return "sendfile";
+
+	case RetrieveMode::CACHED:
+		return "block cache";
+	}
+
+	return "???";
+}
+
 int FtpSession::tzStat (char const *const path_, stat_t *st_)
 {
 	auto const rc = IOAbstraction::stat (path_, st_);
@@ -993,19 +1880,21 @@ int FtpSession::tzLStat (char const *const path_, stat_t *st_)
 
 int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, char const *type_)
 {
-	auto const buffer = m_xferBuffer.freeArea ();
-	auto const size   = m_xferBuffer.freeSize ();
+	static char const *const months[] = {
+	    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+	auto out = LineWriter (m_xferBuffer.freeArea (), m_xferBuffer.freeSize ());
 
-	std::size_t pos = 0;
+	auto mtime = st_.st_mtime;
+	if (mtime > 0x2208985200L)
+	{
+		mtime = time (0);
+	}
 
 	if (m_xferDirMode == XferDirMode::MLSD || m_xferDirMode == XferDirMode::MLST)
 	{
 		if (m_xferDirMode == XferDirMode::MLST)
-		{
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = ' ';
-		}
+			out.put (' ');
 
 		// type fact
 		if (m_mlstType)
@@ -1031,135 +1920,81 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 #endif
 			}
 
-			auto const rc = std::snprintf (&buffer[pos], size - pos, "Type=%s;", type_);
-			if (rc < 0)
-				return errno;
-			if (static_cast<std::size_t> (rc) > size - pos)
-				return EAGAIN;
-
-			pos += rc;
+			out.put ("Type=");
+			out.put (type_);
+			out.put (';');
 		}
 
 		// size fact
 		if (m_mlstSize)
 		{
-			auto const rc = std::snprintf (&buffer[pos],
-			    size - pos,
-			    "Size=%llu;",
-			    static_cast<unsigned long long> (st_.st_size));
-			if (rc < 0)
-				return errno;
-			if (static_cast<std::size_t> (rc) > size - pos)
-				return EAGAIN;
-
-			pos += rc;
-		}
-		auto mtime = st_.st_mtime;
-		if (mtime > 0x2208985200L)
-		{
-			mtime = time (0);
+			out.put ("Size=");
+			out.putDec (static_cast<std::uint64_t> (st_.st_size));
+			out.put (';');
 		}
+
 		// mtime fact
 		if (m_mlstModify)
 		{
-			auto const tm = std::gmtime (&mtime);
-			if (!tm)
-				return errno;
-
-			auto const rc = std::strftime (&buffer[pos], size - pos, "Modify=%Y%m%d%H%M%S;", tm);
-			if (rc == 0)
-				return EAGAIN;
-
-			pos += rc;
+			auto const tm = civilTime (mtime);
+
+			out.put ("Modify=");
+			out.putDec (tm.year);
+			out.putDec (tm.month, 2);
+			out.putDec (tm.day, 2);
+			out.putDec (tm.hour, 2);
+			out.putDec (tm.minute, 2);
+			out.putDec (tm.second, 2);
+			out.put (';');
 		}
 
 		// permission fact
 		if (m_mlstPerm)
 		{
-			auto const header = "Perm=";
-			if (size - pos < std::strlen (header))
-				return EAGAIN;
+			auto const isReg = S_ISREG (st_.st_mode);
+			auto const isDir = S_ISDIR (st_.st_mode);
 
-			std::strcpy (&buffer[pos], header);
-			pos += std::strlen (header);
+			out.put ("Perm=");
 
 			// append permission
-			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'a';
-			}
+			if (isReg && (st_.st_mode & S_IWUSR))
+				out.put ('a');
 
 			// create permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'c';
-			}
+			if (isDir && (st_.st_mode & S_IWUSR))
+				out.put ('c');
 
 			// delete permission
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = 'd';
+			out.put ('d');
 
 			// chdir permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IXUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'e';
-			}
+			if (isDir && (st_.st_mode & S_IXUSR))
+				out.put ('e');
 
 			// rename permission
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = 'f';
+			out.put ('f');
 
 			// list permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IRUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'l';
-			}
+			if (isDir && (st_.st_mode & S_IRUSR))
+				out.put ('l');
 
 			// mkdir permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'm';
-			}
+			if (isDir && (st_.st_mode & S_IWUSR))
+				out.put ('m');
 
 			// purge permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'p';
-			}
+			if (isDir && (st_.st_mode & S_IWUSR))
+				out.put ('p');
 
 			// read permission
-			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IRUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'r';
-			}
+			if (isReg && (st_.st_mode & S_IRUSR))
+				out.put ('r');
 
 			// write permission
-			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'w';
-			}
+			if (isReg && (st_.st_mode & S_IWUSR))
+				out.put ('w');
 
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = ';';
+			out.put (';');
 		}
 
 		// unix mode fact
@@ -1167,57 +2002,23 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 		{
 			auto const mask = S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX | S_ISGID | S_ISUID;
 
-			auto const rc = std::snprintf (&buffer[pos],
-			    size - pos,
-			    "UNIX.mode=0%lo;",
-			    static_cast<unsigned long> (st_.st_mode & mask));
-			if (rc < 0)
-				return errno;
-			if (static_cast<std::size_t> (rc) > size - pos)
-				return EAGAIN;
-
-			pos += rc;
+			out.put ("UNIX.mode=0");
+			out.putOct (static_cast<unsigned long> (st_.st_mode & mask));
+			out.put (';');
 		}
 
 		// make sure space precedes name
-		if (buffer[pos - 1] != ' ')
-		{
-			if (pos >= size)
-				return EAGAIN;
-
-			buffer[pos++] = ' ';
-		}
+		if (out.back () != ' ')
+			out.put (' ');
 	}
 	else if (m_xferDirMode != XferDirMode::NLST)
 	{
 		if (m_xferDirMode == XferDirMode::STAT)
-		{
-			if (pos >= size)
-				return EAGAIN;
-
-			buffer[pos++] = ' ';
-		}
+			out.put (' ');
 
-#ifdef __3DS__
-		auto const owner = "3DS";
-		auto const group = "3DS";
-#elif defined(__SWITCH__)
-		auto const owner = "Switch";
-		auto const group = "Switch";
-#elif defined(__WIIU__)
-		auto const owner = "WiiU";
-		auto const group = "WiiU";
-#else
-		char owner[32];
-		char group[32];
-		std::sprintf (owner, "%d", st_.st_uid);
-		std::sprintf (group, "%d", st_.st_gid);
-#endif
 		// perms nlinks owner group size
-		auto rc = std::snprintf (&buffer[pos],
-		    size - pos,
-		    "%c%c%c%c%c%c%c%c%c%c %lu %s %s %llu ",
-		    // clang-format off
+		// clang-format off
+		out.put (
 		    S_ISREG (st_.st_mode)  ? '-' :
 		    S_ISDIR (st_.st_mode)  ? 'd' :
 #if !defined(__3DS__) && !defined(__SWITCH__) && !defined(__WIIU__)
@@ -1227,61 +2028,61 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 		    S_ISFIFO (st_.st_mode) ? 'p' :
 		    S_ISSOCK (st_.st_mode) ? 's' :
 #endif
-		    '?',
-		    // clang-format on
-		    st_.st_mode & S_IRUSR ? 'r' : '-',
-		    st_.st_mode & S_IWUSR ? 'w' : '-',
-		    st_.st_mode & S_IXUSR ? 'x' : '-',
-		    st_.st_mode & S_IRGRP ? 'r' : '-',
-		    st_.st_mode & S_IWGRP ? 'w' : '-',
-		    st_.st_mode & S_IXGRP ? 'x' : '-',
-		    st_.st_mode & S_IROTH ? 'r' : '-',
-		    st_.st_mode & S_IWOTH ? 'w' : '-',
-		    st_.st_mode & S_IXOTH ? 'x' : '-',
-		    static_cast<unsigned long> (st_.st_nlink),
-		    owner,
-		    group,
-		    static_cast<unsigned long long> (st_.st_size));
-		if (rc < 0)
-			return errno;
-
-		if (static_cast<std::size_t> (rc) > size - pos)
-			return EAGAIN;
+		    '?');
+		// clang-format on
+		out.put (st_.st_mode & S_IRUSR ? 'r' : '-');
+		out.put (st_.st_mode & S_IWUSR ? 'w' : '-');
+		out.put (st_.st_mode & S_IXUSR ? 'x' : '-');
+		out.put (st_.st_mode & S_IRGRP ? 'r' : '-');
+		out.put (st_.st_mode & S_IWGRP ? 'w' : '-');
+		out.put (st_.st_mode & S_IXGRP ? 'x' : '-');
+		out.put (st_.st_mode & S_IROTH ? 'r' : '-');
+		out.put (st_.st_mode & S_IWOTH ? 'w' : '-');
+		out.put (st_.st_mode & S_IXOTH ? 'x' : '-');
+		out.put (' ');
+		out.putDec (static_cast<std::uint64_t> (st_.st_nlink));
+		out.put (' ');
 
-		pos += rc;
-
-		auto mtime = st_.st_mtime;
-		if (mtime > 0x2208985200L)
-		{
-			mtime = time (0);
-		}
+#ifdef __3DS__
+		out.put ("3DS 3DS ");
+#elif defined(__SWITCH__)
+		out.put ("Switch Switch ");
+#elif defined(__WIIU__)
+		out.put ("WiiU WiiU ");
+#else
+		out.putDec (static_cast<std::int64_t> (st_.st_uid));
+		out.put (' ');
+		out.putDec (static_cast<std::int64_t> (st_.st_gid));
+		out.put (' ');
+#endif
+		out.putDec (static_cast<std::uint64_t> (st_.st_size));
+		out.put (' ');
 
 		// timestamp
-		auto const tm = std::gmtime (&mtime);
-		if (!tm)
-			return errno;
-
-		auto fmt = "%b %e %Y ";
+		auto const tm = civilTime (mtime);
+		out.put (months[tm.month - 1]);
+		out.put (' ');
+		out.putDec (tm.day, 2, ' ');
+		out.put (' ');
 		if (m_timestamp > mtime && m_timestamp - mtime < (60 * 60 * 24 * 365 / 2))
-			fmt = "%b %e %H:%M ";
-		rc = std::strftime (&buffer[pos], size - pos, fmt, tm);
-		if (rc < 0)
-			return errno;
-		if (static_cast<std::size_t> (rc) > size - pos)
-			return EAGAIN;
-
-		pos += rc;
+		{
+			out.putDec (tm.hour, 2);
+			out.put (':');
+			out.putDec (tm.minute, 2);
+		}
+		else
+			out.putDec (tm.year);
+		out.put (' ');
 	}
 
-	if (size - pos < path_.size () + 2)
-		return EAGAIN;
-
 	// path
-	std::memcpy (&buffer[pos], path_.data (), path_.size ());
-	pos += path_.size ();
-	buffer[pos++] = '\r';
-	buffer[pos++] = '\n';
+	out.put (path_);
+	out.put ("\r\n");
 
+	if (out.overflow ())
+		return EAGAIN;
+
+	auto const pos = out.size ();
 	m_xferBuffer.markUsed (pos);
 	LOCKED (m_filePosition += pos);
 
@@ -1297,10 +2098,65 @@ int FtpSession::fillDirent (std::string const &path_, char const *type_)
 	return fillDirent (st, encodePath (path_), type_);
 }
 
+bool FtpSession::openListing (std::string const &path_, stat_t const *const st_)
+{
+	m_listingIndex = 0;
+	if (st_)
+	{
+		m_listing = ListingCache::lookup (path_, st_->st_mtime);
+		if (m_listing)
+			return true;
+	}
+
+	// read before opening so an invalidation while reading keeps the result out of the cache
+	m_listingGeneration = ListingCache::generation ();
+
+#ifndef _DIRENT_HAVE_D_STAT
+	// the stats dominate a listing; have the file workers run them ahead of the sender
+	if (m_xferDirMode != XferDirMode::NLST && FileWorkers::running ())
+	{
+		unsigned depth;
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			depth = m_config.listPrefetch ();
+		}
+
+		if (depth > 0)
+		{
+			fs::Dir dir;
+			if (!dir.open (path_.c_str ()))
+				return false;
+
+			m_statPrefetch = std::make_unique<StatPrefetch> (
+			    std::move (dir), path_, depth, FILE_POLL_INTERVAL);
+			if (!m_statPrefetch->start ())
+				m_statPrefetch.reset ();
+		}
+	}
+#endif
+
+	if (!m_statPrefetch && !m_dir.open (path_, m_xferDirMode != XferDirMode::NLST))
+		return false;
+
+	// NLST doesn't stat entries, so it can't fill a snapshot
+	if (st_ && m_xferDirMode != XferDirMode::NLST)
+	{
+		m_listingBuild        = std::make_shared<DirSnapshot> ();
+		m_listingBuild->mtime = st_->st_mtime;
+	}
+
+	return true;
+}
+
 void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 {
 	m_xferBuffer.clear ();
 
+	// ALLO only applies to the transfer that follows it
+	auto const allocSize = std::exchange (m_allocSize, 0);
+
 	// build the path of the file to transfer
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -1333,11 +2189,42 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 
 		LOCKED (m_fileSize = st.st_size);
 
-		m_file.setBufferSize (FILE_BUFFERSIZE);
+		unsigned readAhead;
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			readAhead = m_config.readAhead ();
+		}
+
+		// pick the cheapest path from the file to the socket; only the stdio path needs the
+		// intermediate file buffer
+		m_retrieveMode = RetrieveMode::STDIO;
+		if (m_file.fd () >= 0)
+		{
+			// MODE Z has to pass everything through m_xferBuffer to compress it
+			if (m_modeZ)
+				m_retrieveMode = RetrieveMode::DIRECT;
+			else if (FTPD_HAS_SENDFILE)
+				m_retrieveMode = RetrieveMode::SENDFILE;
+			else if (BlockCache::enabled () && readAhead > 0 && FileWorkers::running ())
+				m_retrieveMode = RetrieveMode::CACHED;
+			else if (readAhead > 0 && FileWorkers::running ())
+				m_retrieveMode = RetrieveMode::READAHEAD;
+			else
+				m_retrieveMode = RetrieveMode::DIRECT;
+		}
+
+		if (m_retrieveMode == RetrieveMode::STDIO)
+			m_file.setBufferSize (FILE_BUFFERSIZE);
 
 		if (m_restartPosition != 0)
 		{
-			if (m_file.seek (m_restartPosition, SEEK_SET) != 0)
+			// every path but stdio reads the descriptor directly, so position that instead
+			auto const ok = m_retrieveMode == RetrieveMode::STDIO
+			                    ? m_file.seek (m_restartPosition, SEEK_SET) == 0
+			                    : m_file.seekDirect (m_restartPosition);
+			if (!ok)
 			{
 				sendResponse ("450 %s\r\n", std::strerror (errno));
 				return;
@@ -1345,6 +2232,36 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 		}
 
 		LOCKED (m_filePosition = m_restartPosition);
+
+		if (m_retrieveMode == RetrieveMode::CACHED)
+		{
+			m_cacheMtime = st.st_mtime;
+
+			// the file workers load every block, on a separate handle so positions don't clash;
+			// start on the first one while the data connection is being set up
+			fs::File prefetch;
+			if (prefetch.open (path.c_str (), "rb"))
+			{
+				m_cachePrefetch = std::make_unique<CachePrefetch> (
+				    std::move (prefetch), path, st.st_mtime, st.st_size, readAhead);
+				m_cachePrefetch->advance (m_restartPosition / BlockCache::BLOCK_SIZE);
+			}
+			else
+				m_retrieveMode = RetrieveMode::READAHEAD;
+		}
+
+		if (m_retrieveMode == RetrieveMode::READAHEAD)
+		{
+			// start reading while the data connection is being set up
+			m_readAhead = std::make_unique<ReadAhead> (m_file, XFER_BUFFERSIZE, readAhead);
+			if (!m_readAhead->start ())
+			{
+				m_readAhead.reset ();
+				m_retrieveMode = RetrieveMode::DIRECT;
+			}
+		}
+
+		info ("Sending %s using %s\n", path.c_str (), retrieveModeName (m_retrieveMode));
 	}
 	else
 	{
@@ -1363,6 +2280,29 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			return;
 		}
 
+		ListingCache::invalidate (path);
+		BlockCache::invalidate (path);
+
+		// lay the whole file out up front instead of growing it a cluster at a time; appends
+		// would land after the reserved space, so only STOR/STOU preallocate
+		if (allocSize != 0 && !append)
+		{
+			auto const target = m_restartPosition + allocSize;
+
+			stat_t st;
+			if (m_file.fd () >= 0 && ::fstat (m_file.fd (), &st) == 0 &&
+			    static_cast<std::uint64_t> (st.st_size) < target)
+			{
+				if (m_file.preallocate (target))
+				{
+					m_preallocFloor = st.st_size;
+					m_preallocated  = true;
+				}
+				else
+					debug ("Failed to preallocate %s: %s\n", path.c_str (), std::strerror (errno));
+			}
+		}
+
 		FtpServer::updateFreeSpace ();
 
 		m_file.setBufferSize (FILE_BUFFERSIZE);
@@ -1379,6 +2319,26 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 		}
 
 		LOCKED (m_filePosition = m_restartPosition);
+
+		unsigned writeBehind;
+		{
+#ifndef __NDS__
+			auto const lock = m_config.lockGuard ();
+#endif
+			writeBehind = m_config.writeBehind ();
+		}
+
+		// queue received data for the file workers instead of writing it inline; the cap
+		// bounds how much an upload can hold in memory
+		auto const cap = std::size_t (writeBehind) * 1024;
+		if (cap != 0 && !m_modeZ && FileWorkers::running ())
+		{
+			auto const blockSize = std::min<std::size_t> (cap, XFER_BUFFERSIZE);
+			m_writeBehind = std::make_unique<WriteBehind> (
+			    m_file, blockSize, gsl::narrow_cast<unsigned> (cap / blockSize));
+		}
+
+		info ("Receiving %s%s\n", path.c_str (), m_writeBehind ? " using write-behind" : "");
 	}
 
 	if (!m_port && !m_pasv)
@@ -1478,7 +2438,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		}
 		else if (S_ISDIR (st.st_mode))
 		{
-			if (!m_dir.open (path.c_str ()))
+			if (!openListing (path, &st))
 			{
 				sendResponse ("550 %s\r\n", std::strerror (errno));
 				setState (State::COMMAND, true, true);
@@ -1548,7 +2508,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 
 		LOCKED (m_workItem = m_cwd);
 	}
-	else if (!m_dir.open (m_cwd.c_str ()))
+	else if (stat_t st; !openListing (m_cwd, tzStat (m_cwd.c_str (), &st) == 0 ? &st : nullptr))
 	{
 		// no argument, but opening cwd failed
 		sendResponse ("550 %s\r\n", std::strerror (errno));
@@ -1698,18 +2658,22 @@ void FtpSession::readCommand (int const events_)
 		}
 	}
 
-	// loop through commands
+	// handle every complete command in the buffer in place; the remainder is compacted once
 	while (true)
 	{
 		// must have at least enough data for the delimiter
 		auto const size = m_commandBuffer.usedSize ();
 		if (size < 1)
-			return;
+			break;
 
 		auto const buffer        = m_commandBuffer.usedArea ();
 		auto const [delim, next] = parseCommand (buffer, size);
 		if (!next)
-			return;
+			break;
+
+		// commands pipelined behind a checksum wait for its reply, except those that end it
+		if (m_fileHash && !endsChecksum (std::string_view (buffer, delim - buffer)))
+			break;
 
 		*delim = '\0';
 		decodePath (buffer, delim - buffer);
@@ -1726,13 +2690,10 @@ void FtpSession::readCommand (int const events_)
 		if (*args)
 			*args++ = 0;
 
-		auto const it = std::lower_bound (std::begin (handlers),
-		    std::end (handlers),
-		    command,
-		    [] (auto const &lhs_, auto const &rhs_) { return compare (lhs_.first, rhs_) < 0; });
+		auto const entry = findHandler (command);
 
 		m_timestamp = std::time (nullptr);
-		if (it == std::end (handlers) || compare (it->first, command) != 0)
+		if (!entry)
 		{
 			std::string response = "502 Invalid command \"";
 			response += encodePath (command);
@@ -1747,36 +2708,31 @@ void FtpSession::readCommand (int const events_)
 
 			sendResponse (response);
 		}
-		else if (m_state != State::COMMAND)
+		else if (m_state != State::COMMAND && !(entry->flags & CMD_TRANSFER))
 		{
 			// only some commands are available during data transfer
-			if (compare (command, "ABOR") != 0 && compare (command, "NOOP") != 0 &&
-			    compare (command, "PWD") != 0 && compare (command, "QUIT") != 0 &&
-			    compare (command, "STAT") != 0 && compare (command, "XPWD") != 0)
-			{
-				sendResponse ("503 Invalid command during transfer\r\n");
-				setState (State::COMMAND, true, true);
-				closeCommand ();
-			}
-			else
-			{
-				auto const handler = it->second;
-				(this->*handler) (args);
-			}
+			sendResponse ("503 Invalid command during transfer\r\n");
+			setState (State::COMMAND, true, true);
+			closeCommand ();
+		}
+		else if ((entry->flags & CMD_AUTH) && !authorized ())
+		{
+			setState (State::COMMAND, false, false);
+			sendResponse ("530 Not logged in\r\n");
 		}
 		else
 		{
-			// clear rename for all commands except RNTO
-			if (compare (command, "RNTO") != 0)
+			// a pending rename survives commands issued during a transfer
+			if (m_state == State::COMMAND && (entry->flags & CMD_CLEAR_RNFR))
 				m_rename.clear ();
 
-			auto const handler = it->second;
-			(this->*handler) (args);
+			(this->*entry->handler) (args);
 		}
 
 		m_commandBuffer.markFree (next - buffer);
-		m_commandBuffer.coalesce ();
 	}
+
+	m_commandBuffer.coalesce ();
 }
 
 void FtpSession::writeResponse ()
@@ -1795,18 +2751,14 @@ void FtpSession::writeResponse ()
 
 void FtpSession::sendResponse (char const *fmt_, ...)
 {
-	if (!m_commandSocket)
+	if (!reserveResponse ())
 		return;
 
 	auto const buffer = m_responseBuffer.freeArea ();
 	auto const size   = m_responseBuffer.freeSize ();
 
+	// format straight into the response buffer and log the result
 	va_list ap;
-
-	va_start (ap, fmt_);
-	addLog (RESPONSE, fmt_, ap);
-	va_end (ap);
-
 	va_start (ap, fmt_);
 	auto const rc = std::vsnprintf (buffer, size, fmt_, ap);
 	va_end (ap);
@@ -1818,16 +2770,32 @@ void FtpSession::sendResponse (char const *fmt_, ...)
 		return;
 	}
 
-	if (static_cast<std::size_t> (rc) > size)
+	if (static_cast<std::size_t> (rc) >= size)
 	{
 		error ("Not enough space for response\n");
 		closeCommand ();
 		return;
 	}
 
+	addLog (RESPONSE, std::string_view (buffer, rc));
+
+	// written at the end of the poll iteration, together with any other replies queued by then
 	m_responseBuffer.markUsed (rc);
+}
 
-	// try to write data immediately
+bool FtpSession::reserveResponse ()
+{
+	if (!m_commandSocket)
+		return false;
+
+	if (m_responseBuffer.freeSize () < m_responseBuffer.capacity () / 2)
+		flushResponses ();
+
+	return static_cast<bool> (m_commandSocket);
+}
+
+void FtpSession::flushResponses ()
+{
 	assert (m_commandSocket);
 	auto const bytes = m_commandSocket->write (m_responseBuffer);
 	if (bytes <= 0)
@@ -1844,7 +2812,7 @@ void FtpSession::sendResponse (char const *fmt_, ...)
 
 void FtpSession::sendResponse (std::string_view const response_)
 {
-	if (!m_commandSocket)
+	if (!reserveResponse ())
 		return;
 
 	addLog (RESPONSE, response_);
@@ -1865,10 +2833,13 @@ void FtpSession::sendResponse (std::string_view const response_)
 
 bool FtpSession::listTransfer ()
 {
-	// check if we sent all available data
-	while (m_xferBuffer.empty ())
+	// format entries until the buffer is nearly full, so a listing sends, and is charged for, full
+	// buffers like a download; an entry that might not fit waits until the buffer has drained
+	auto const reserve = LIST_LINE_RESERVE + m_lwd.size ();
+	while (m_xferBuffer.empty () || m_xferBuffer.freeSize () >= reserve)
 	{
-		m_xferBuffer.clear ();
+		if (m_xferBuffer.empty ())
+			m_xferBuffer.clear ();
 
 		// check xfer dir type
 		int rc = 226;
@@ -1876,33 +2847,101 @@ bool FtpSession::listTransfer ()
 			rc = 250;
 
 		// check if this was for a file/MLST
-		if (!m_dir)
+		if (!m_dir && !m_statPrefetch && !m_listing)
 		{
+			if (!m_xferBuffer.empty ())
+				break;
+
 			// we already sent the file's listing
-			sendResponse ("%d OK\r\n", rc);
-			setState (State::COMMAND, true, true);
-			return false;
+			return endTransfer (rc);
 		}
 
-		// get the next directory entry
-		auto const dent = m_dir.read ();
-		if (!dent)
+		// get the next directory entry, from the cached listing if there is one
+		char const *name;
+		stat_t const *st = nullptr;
+		if (m_listing)
 		{
-			// we have exhausted the directory listing
-			sendResponse ("%d OK\r\n", rc);
-			setState (State::COMMAND, true, true);
-			return false;
+			if (m_listingIndex == m_listing->entries.size ())
+			{
+				if (!m_xferBuffer.empty ())
+					break;
+
+				// we have exhausted the directory listing
+				return endTransfer (rc);
+			}
+
+			auto const &entry = m_listing->entries[m_listingIndex++];
+			name              = entry.name.c_str ();
+			st                = &entry.st;
 		}
+		else
+		{
+			fs::DirLister::Entry const *entry;
+			if (m_statPrefetch)
+			{
+				entry = m_statPrefetch->front ();
+
+				// waiting for a worker costs a poll wakeup; on fast storage the stat costs less
+				if (!entry && m_statPrefetch->quick ())
+				{
+					m_statPrefetch->run ();
+					entry = m_statPrefetch->front ();
+				}
+
+				if (!entry && !m_statPrefetch->done ())
+				{
+					if (auto const rc = m_statPrefetch->error (); rc != 0)
+					{
+						sendResponse ("550 %s\r\n", std::strerror (rc));
+						setState (State::COMMAND, true, true);
+						return false;
+					}
+
+					// the next entry is still being statted; send what is ready meanwhile
+					if (!m_xferBuffer.empty ())
+						break;
+
+					return false;
+				}
+			}
+			else
+				entry = m_dir.read ();
+
+			if (!entry)
+			{
+				if (!m_xferBuffer.empty ())
+					break;
 
-		// I think we are supposed to return entries for . and ..
-		if (std::strcmp (dent->d_name, ".") == 0 || std::strcmp (dent->d_name, "..") == 0)
-			continue; // just skip it
+				// we have exhausted the directory listing
+				if (m_listingBuild)
+					ListingCache::store (m_lwd, std::move (m_listingBuild), m_listingGeneration);
+
+				return endTransfer (rc);
+			}
+
+			// the lister skips . and .., and has already statted the entry unless this is NLST
+			name = entry->name;
+			if (m_xferDirMode != XferDirMode::NLST)
+			{
+				if (entry->error != 0)
+				{
+					sendResponse ("550 %s\r\n", std::strerror (entry->error));
+					setState (State::COMMAND, true, true);
+					return false;
+				}
+
+				st = &entry->st;
+
+				if (m_listingBuild)
+					m_listingBuild->entries.emplace_back (DirSnapshot::Entry{name, *st});
+			}
+		}
 
 		// check if this was NLST
 		if (m_xferDirMode == XferDirMode::NLST)
 		{
 			// NLST gives the whole path name
-			auto const path = encodePath (buildPath (m_lwd, dent->d_name)) + "\r\n";
+			auto const path = encodePath (buildPath (m_lwd, name)) + "\r\n";
 			if (m_xferBuffer.freeSize () < path.size ())
 			{
 				sendResponse ("501 %s\r\n", std::strerror (ENOMEM));
@@ -1916,33 +2955,22 @@ bool FtpSession::listTransfer ()
 		}
 		else
 		{
-			// build the path
-			auto const fullPath = buildPath (m_lwd, dent->d_name);
-			auto const path     = encodePath (dent->d_name);
-#ifdef _DIRENT_HAVE_D_STAT
-			auto const rc = fillDirent (dent->d_stat, path);
-#else
-			struct stat st = {};
-			// lstat the entry
-			if (IOAbstraction::lstat (fullPath.c_str (), &st) != 0)
-			{
-				sendResponse ("550 %s\r\n", std::strerror (errno));
-				setState (State::COMMAND, true, true);
-				return false;
-			}
-			auto const rc = fillDirent (st, path);
-#endif
+			auto const rc = fillDirent (*st, encodePath (name));
 			if (rc != 0)
 			{
 				sendResponse ("425 %s\r\n", std::strerror (errno));
 				setState (State::COMMAND, true, true);
 				return false;
 			}
+
+			// the slot can be refilled once the entry is formatted
+			if (m_statPrefetch)
+				m_statPrefetch->pop ();
 		}
 	}
 
 	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
+	auto const rc = sendData ();
 	if (rc <= 0)
 	{
 		// error sending data
@@ -1972,9 +3000,7 @@ bool FtpSession::globTransfer ()
 		if (!entry)
 		{
 			// we have exhausted the glob listing
-			sendResponse ("226 OK\r\n");
-			setState (State::COMMAND, true, true);
-			return false;
+			return endTransfer (226);
 		}
 
 		// NLST gives the whole path name
@@ -1992,7 +3018,7 @@ bool FtpSession::globTransfer ()
 	}
 
 	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
+	auto const rc = sendData ();
 	if (rc <= 0)
 	{
 		// error sending data
@@ -2018,14 +3044,167 @@ bool FtpSession::globTransfer ()
 
 bool FtpSession::retrieveTransfer ()
 {
-	if (m_xferBuffer.empty ())
+#if FTPD_HAS_SENDFILE
+	if (m_retrieveMode == RetrieveMode::SENDFILE && !m_devZero)
 	{
-		m_xferBuffer.clear ();
+		// let the kernel copy straight from the file to the socket
+		auto offset   = m_filePosition;
+		auto const rc = m_dataSocket->sendFile (m_file.fd (), offset, FILE_BUFFERSIZE);
+		if (rc < 0 && (errno == EINVAL || errno == ENOSYS))
+		{
+			// this file can't be sent this way; continue with direct reads
+			info ("sendfile unsupported, falling back to %s\n",
+			    retrieveModeName (RetrieveMode::DIRECT));
+
+			m_retrieveMode = RetrieveMode::DIRECT;
+			if (!m_file.seekDirect (m_filePosition))
+			{
+				sendResponse ("451 %s\r\n", std::strerror (errno));
+				setState (State::COMMAND, true, true);
+				return false;
+			}
+
+			return true;
+		}
+
+		if (rc < 0)
+		{
+			// error sending data
+			if (errno == EWOULDBLOCK)
+				return false;
+
+			sendResponse ("426 Connection broken during transfer\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		if (rc == 0)
+		{
+			// reached end of file
+			sendResponse ("226 OK\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		m_timestamp = std::time (nullptr);
+
+		// we can try to send more data
+		LOCKED (m_filePosition = offset);
+		return true;
+	}
+#endif
+
+	if (m_retrieveMode == RetrieveMode::CACHED && !m_devZero)
+	{
+		if (m_filePosition >= m_fileSize)
+		{
+			// reached end of file
+			return endTransfer (226);
+		}
+
+		auto const index = m_filePosition / BlockCache::BLOCK_SIZE;
+		if (!m_cacheBlock || m_cacheIndex != index)
+		{
+			m_cacheBlock = BlockCache::lookup (m_workItem, m_cacheMtime, m_fileSize, index);
+			if (!m_cacheBlock)
+				m_cacheBlock = m_cachePrefetch->take (index);
+
+			if (!m_cacheBlock)
+			{
+				if (auto const rc = m_cachePrefetch->error (); rc != 0)
+				{
+					// failed to read data
+					sendResponse ("451 %s\r\n", std::strerror (rc));
+					setState (State::COMMAND, true, true);
+					return false;
+				}
+
+				// the file workers haven't loaded it yet; never read it on this thread
+				m_cachePrefetch->advance (index);
+				return false;
+			}
+
+			m_cacheIndex = index;
+			m_cachePrefetch->advance (index);
+		}
+
+		// send straight from the shared block
+		auto const offset = m_filePosition - index * BlockCache::BLOCK_SIZE;
+		auto const rc =
+		    m_dataSocket->write (m_cacheBlock->data.get () + offset, m_cacheBlock->size - offset);
+		if (rc <= 0)
+		{
+			// error sending data
+			if (rc < 0 && errno == EWOULDBLOCK)
+				return false;
+
+			sendResponse ("426 Connection broken during transfer\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		m_timestamp = std::time (nullptr);
+
+		// we can try to send more data
+		LOCKED (m_filePosition += rc);
+		return true;
+	}
+
+	if (m_retrieveMode == RetrieveMode::READAHEAD && !m_devZero)
+	{
+		auto const block = m_readAhead->front ();
+		if (!block)
+		{
+			if (m_readAhead->done ())
+			{
+				// reached end of file
+				sendResponse ("226 OK\r\n");
+				setState (State::COMMAND, true, true);
+				return false;
+			}
+
+			if (auto const rc = m_readAhead->error (); rc != 0)
+			{
+				// failed to read data
+				sendResponse ("451 %s\r\n", std::strerror (rc));
+				setState (State::COMMAND, true, true);
+				return false;
+			}
+
+			// the file workers haven't caught up yet
+			return false;
+		}
+
+		// send the oldest block
+		auto const rc = m_dataSocket->write (*block);
+		if (rc <= 0)
+		{
+			// error sending data
+			if (rc < 0 && errno == EWOULDBLOCK)
+				return false;
+
+			sendResponse ("426 Connection broken during transfer\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		if (block->empty ())
+			m_readAhead->pop ();
+
+		m_timestamp = std::time (nullptr);
+
+		// we can try to send more data
+		LOCKED (m_filePosition += rc);
+		return true;
+	}
 
+	// top up the space freed by earlier sends; partial sends leave the rest in place
+	if (m_xferBuffer.freeTotal () >= m_xferChunk)
+	{
 		if (!m_devZero)
 		{
-			// we have sent all the data, so read some more
-			auto const rc = m_file.read (m_xferBuffer);
+			auto const rc = m_retrieveMode == RetrieveMode::DIRECT ? m_file.readDirect (m_xferBuffer)
+			                                                       : m_file.read (m_xferBuffer);
 			if (rc < 0)
 			{
 				// failed to read data
@@ -2034,12 +3213,10 @@ bool FtpSession::retrieveTransfer ()
 				return false;
 			}
 
-			if (rc == 0)
+			if (rc == 0 && m_xferBuffer.empty ())
 			{
 				// reached end of file
-				sendResponse ("226 OK\r\n");
-				setState (State::COMMAND, true, true);
-				return false;
+				return endTransfer (226);
 			}
 		}
 		else
@@ -2053,7 +3230,7 @@ bool FtpSession::retrieveTransfer ()
 	}
 
 	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
+	auto const rc = sendData ();
 	if (rc <= 0)
 	{
 		// error sending data
@@ -2074,12 +3251,32 @@ bool FtpSession::retrieveTransfer ()
 
 bool FtpSession::storeTransfer ()
 {
-	if (m_xferBuffer.empty ())
+	if (m_writeBehind && !m_devZero)
 	{
-		m_xferBuffer.clear ();
+		if (auto const rc = m_writeBehind->error (); rc != 0)
+		{
+			// error writing data
+			sendResponse ("426 %s\r\n", std::strerror (rc));
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		if (m_writeBehind->settled ())
+		{
+			// everything has reached the file
+			sendResponse ("226 OK\r\n");
+			setState (State::COMMAND, true, true);
+			return false;
+		}
+
+		auto const block = m_writeBehind->back ();
+		if (!block)
+		{
+			// the file workers haven't caught up yet
+			return false;
+		}
 
-		// we have written all the received data, so try to get some more
-		auto const rc = m_dataSocket->read (m_xferBuffer);
+		auto const rc = m_dataSocket->read (*block);
 		if (rc < 0)
 		{
 			// failed to read data
@@ -2093,36 +3290,87 @@ bool FtpSession::storeTransfer ()
 
 		if (rc == 0)
 		{
-			// reached end of file
-			sendResponse ("226 OK\r\n");
-			setState (State::COMMAND, true, true);
+			// reached end of file; reply once the file workers have flushed everything
+			m_writeBehind->finish ();
 			return false;
 		}
 
+		m_writeBehind->push ();
 		m_timestamp = std::time (nullptr);
+
+		// we can try to recv more data
+		LOCKED (m_filePosition += rc);
+		return true;
+	}
+
+	auto eof        = false;
+	auto wouldBlock = false;
+	if (m_xferBuffer.freeTotal () != 0)
+	{
+		// receive into the space already written out; partial writes leave the rest in place
+		auto const rc = recvData ();
+		if (rc < 0)
+		{
+			// failed to read data
+			if (errno != EWOULDBLOCK)
+			{
+				sendResponse ("451 %s\r\n", std::strerror (errno));
+				setState (State::COMMAND, true, true);
+				return false;
+			}
+
+			if (m_xferBuffer.empty ())
+				return false;
+
+			wouldBlock = true;
+		}
+		else if (rc == 0)
+			eof = true;
+		else
+			m_timestamp = std::time (nullptr);
 	}
 
-	if (!m_devZero)
-	{
-		// write any pending data
-		auto const rc = m_file.write (m_xferBuffer);
-		if (rc <= 0)
+	// batch file writes into whole chunks while data keeps arriving
+	if (!eof && !wouldBlock && m_xferBuffer.freeTotal () != 0 &&
+	    m_xferBuffer.usedTotal () < m_xferChunk)
+		return true;
+
+	// write pending data; drain it all once the sender is done
+	while (!m_xferBuffer.empty ())
+	{
+		if (!m_devZero)
+		{
+			auto const rc = m_file.write (m_xferBuffer);
+			if (rc <= 0)
+			{
+				// error writing data
+				sendResponse (
+				    "426 %s\r\n", rc < 0 ? std::strerror (errno) : "Failed to write data");
+				setState (State::COMMAND, true, true);
+				return false;
+			}
+
+			LOCKED (m_filePosition += rc);
+		}
+		else
 		{
-			// error writing data
-			sendResponse ("426 %s\r\n", rc < 0 ? std::strerror (errno) : "Failed to write data");
-			setState (State::COMMAND, true, true);
-			return false;
+			LOCKED (m_filePosition += m_xferBuffer.usedTotal ());
+			m_xferBuffer.clear ();
 		}
 
-		// we can try to recv/write more data
-		LOCKED (m_filePosition += rc);
+		if (!eof)
+			break;
 	}
-	else
+
+	if (eof)
 	{
-		LOCKED (m_filePosition += m_xferBuffer.usedSize ());
-		m_xferBuffer.clear ();
+		// reached end of file
+		sendResponse ("226 OK\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
 	}
 
+	// we can try to recv/write more data
 	return true;
 }
 
@@ -2131,6 +3379,15 @@ void FtpSession::ABOR (char const *args_)
 {
 	(void)args_;
 
+	if (m_fileHash)
+	{
+		// cancels the job; no worker touches it once this returns
+		m_fileHash.reset ();
+		sendResponse ("426 Checksum aborted\r\n");
+		sendResponse ("226 Aborted\r\n");
+		return;
+	}
+
 	if (m_state == State::COMMAND)
 	{
 		sendResponse ("225 No transfer to abort\r\n");
@@ -2145,21 +3402,37 @@ void FtpSession::ABOR (char const *args_)
 
 void FtpSession::ALLO (char const *args_)
 {
-	(void)args_;
-
-	sendResponse ("202 Superfluous command\r\n");
 	setState (State::COMMAND, false, false);
-}
 
-void FtpSession::APPE (char const *args_)
-{
-	if (!authorized ())
+	// parse the size; a record size makes no difference to a byte stream
+	std::uint64_t size;
+	auto p = args_;
+	if (!parseOffset (p, size) || (*p && ::strncasecmp (p, " R ", 3) != 0))
 	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
+		sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+		return;
+	}
+
+	bool preallocate;
+	{
+#ifndef __NDS__
+		auto const lock = m_config.lockGuard ();
+#endif
+		preallocate = m_config.preallocate ();
+	}
+
+	if (!preallocate || size == 0)
+	{
+		sendResponse ("202 Superfluous command\r\n");
 		return;
 	}
 
+	m_allocSize = size;
+	sendResponse ("200 OK\r\n");
+}
+
+void FtpSession::APPE (char const *args_)
+{
 	// open the file in append mode
 	xferFile (args_, XferFileMode::APPE);
 }
@@ -2170,12 +3443,6 @@ void FtpSession::CDUP (char const *args_)
 
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	if (!changeDir (".."))
 	{
 		sendResponse ("550 %s\r\n", std::strerror (errno));
@@ -2189,12 +3456,6 @@ void FtpSession::CWD (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	if (!changeDir (args_))
 	{
 		sendResponse ("550 %s\r\n", std::strerror (errno));
@@ -2208,12 +3469,6 @@ void FtpSession::DELE (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to remove
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -2229,6 +3484,9 @@ void FtpSession::DELE (char const *args_)
 		return;
 	}
 
+	ListingCache::invalidate (path);
+	BlockCache::invalidate (path);
+
 	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
@@ -2237,20 +3495,54 @@ void FtpSession::FEAT (char const *args_)
 	(void)args_;
 
 	setState (State::COMMAND, false, false);
+
+	// list checksums strongest first; the selected one is starred
+	std::string hash;
+	for (auto const algorithm : {Checksum::Algorithm::SHA256,
+	         Checksum::Algorithm::SHA1,
+	         Checksum::Algorithm::MD5,
+	         Checksum::Algorithm::CRC32})
+	{
+		if (!hash.empty ())
+			hash.push_back (';');
+
+		hash += Checksum::name (algorithm);
+		if (algorithm == m_hashAlgorithm)
+			hash.push_back ('*');
+	}
+
 	sendResponse ("211-\r\n"
+	              " HASH %s\r\n"
 	              " MDTM\r\n"
 	              " MLST Type%s;Size%s;Modify%s;Perm%s;UNIX.mode%s;\r\n"
+	              "%s"
 	              " PASV\r\n"
+	              " RANG STREAM\r\n"
 	              " SIZE\r\n"
 	              " TVFS\r\n"
 	              " UTF8\r\n"
 	              "\r\n"
 	              "211 End\r\n",
+	    hash.c_str (),
 	    m_mlstType ? "*" : "",
 	    m_mlstSize ? "*" : "",
 	    m_mlstModify ? "*" : "",
 	    m_mlstPerm ? "*" : "",
-	    m_mlstUnixMode ? "*" : "");
+	    m_mlstUnixMode ? "*" : "",
+	    FTPD_HAS_ZLIB ? " MODE Z\r\n" : "");
+}
+
+void FtpSession::HASH (char const *args_)
+{
+	setState (State::COMMAND, false, false);
+
+	// a range set with RANG only applies to one HASH
+	auto const start = m_rangeStart;
+	auto const end   = m_rangeEnd != 0 ? m_rangeEnd : UINT64_MAX;
+	m_rangeStart     = 0;
+	m_rangeEnd       = 0;
+
+	startHash (args_, m_hashAlgorithm, start, end, true);
 }
 
 void FtpSession::HELP (char const *args_)
@@ -2260,21 +3552,15 @@ void FtpSession::HELP (char const *args_)
 	setState (State::COMMAND, false, false);
 	sendResponse ("214-\r\n"
 	              "The following commands are recognized\r\n"
-	              " ABOR ALLO APPE CDUP CWD DELE FEAT HELP LIST MDTM MKD MLSD MLST MODE\r\n"
-	              " NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR RNTO SITE\r\n"
-	              " SIZE STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
+	              " ABOR ALLO APPE CDUP CWD DELE FEAT HASH HELP LIST MDTM MKD MLSD MLST\r\n"
+	              " MODE NLST NOOP OPTS PASS PASV PORT PWD QUIT RANG REST RETR RMD RNFR\r\n"
+	              " RNTO SITE SIZE STAT STOR STOU STRU SYST TYPE USER XCRC XCUP XCWD XMD5\r\n"
+	              " XMKD XPWD XRMD XSHA XSHA1 XSHA256\r\n"
 	              "214 End\r\n");
 }
 
 void FtpSession::LIST (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the path in LIST mode
 	xferDir (args_, XferDirMode::LIST, true);
 }
@@ -2285,12 +3571,6 @@ void FtpSession::MDTM (char const *args_)
 
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	sendResponse ("502 Command not implemented\r\n");
 }
 
@@ -2298,12 +3578,6 @@ void FtpSession::MKD (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to create
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -2319,32 +3593,20 @@ void FtpSession::MKD (char const *args_)
 		return;
 	}
 
+	ListingCache::invalidate (path);
+
 	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
 
 void FtpSession::MLSD (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the path in MLSD mode
 	xferDir (args_, XferDirMode::MLSD, false);
 }
 
 void FtpSession::MLST (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the path in MLST mode
 	xferDir (args_, XferDirMode::MLST, false);
 }
@@ -2353,25 +3615,28 @@ void FtpSession::MODE (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	// we only accept S (stream) mode
+	// we accept S (stream) mode, and Z (deflate) mode if zlib is available
 	if (compare (args_, "S") == 0)
 	{
+		m_modeZ = false;
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+
+#if FTPD_HAS_ZLIB
+	if (compare (args_, "Z") == 0)
+	{
+		m_modeZ = true;
 		sendResponse ("200 OK\r\n");
 		return;
 	}
+#endif
 
 	sendResponse ("504 Unavailable\r\n");
 }
 
 void FtpSession::NLST (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 #if FTPD_HAS_GLOB
 	if (std::strchr (args_, '*'))
 	{
@@ -2472,6 +3737,44 @@ void FtpSession::OPTS (char const *args_)
 		return;
 	}
 
+	// check HASH options
+	if (compare (args_, "HASH") == 0)
+	{
+		sendResponse ("200 %s\r\n", Checksum::name (m_hashAlgorithm));
+		return;
+	}
+
+	if (::strncasecmp (args_, "HASH ", 5) == 0)
+	{
+		auto const algorithm = Checksum::find (args_ + 5);
+		if (!algorithm)
+		{
+			sendResponse ("501 Unknown algorithm\r\n");
+			return;
+		}
+
+		m_hashAlgorithm = *algorithm;
+		sendResponse ("200 %s\r\n", Checksum::name (m_hashAlgorithm));
+		return;
+	}
+
+#if FTPD_HAS_ZLIB
+	// check MODE Z options; only LEVEL is supported
+	if (::strncasecmp (args_, "MODE Z LEVEL ", 13) == 0)
+	{
+		auto const level = args_ + 13;
+		if (!std::isdigit (level[0]) || level[1] != '\0')
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		m_zLevel = level[0] - '0';
+		sendResponse ("200 MODE Z LEVEL set to %d\r\n", m_zLevel);
+		return;
+	}
+#endif
+
 	sendResponse ("504 %s\r\n", std::strerror (EINVAL));
 }
 
@@ -2512,13 +3815,6 @@ void FtpSession::PASV (char const *args_)
 {
 	(void)args_;
 
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// reset state
 	setState (State::COMMAND, true, true);
 	m_pasv = false;
@@ -2534,11 +3830,7 @@ void FtpSession::PASV (char const *args_)
 	}
 
 	// set the socket option
-#ifdef __WIIU__
-	m_pasvSocket->setWinScale (1);
-#endif
-	m_pasvSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_pasvSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	setupDataSocket (*m_pasvSocket);
 
 	// create an address to bind
 	sockaddr_in addr = m_commandSocket->sockName ();
@@ -2587,13 +3879,6 @@ void FtpSession::PASV (char const *args_)
 
 void FtpSession::PORT (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// reset state
 	setState (State::COMMAND, true, true);
 	m_pasv = false;
@@ -2680,12 +3965,6 @@ void FtpSession::PWD (char const *args_)
 {
 	(void)args_;
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	auto const path = encodePath (m_cwd);
 
 	std::string response = "257 \"";
@@ -2699,20 +3978,50 @@ void FtpSession::QUIT (char const *args_)
 {
 	(void)args_;
 
+	m_fileHash.reset ();
+
 	sendResponse ("221 Disconnecting\r\n");
 	closeCommand ();
 }
 
-void FtpSession::REST (char const *args_)
+void FtpSession::RANG (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
+	// parse the inclusive range
+	std::uint64_t start;
+	std::uint64_t end;
+	auto p = args_;
+	if (!parseOffset (p, start) || *p++ != ' ' || !parseOffset (p, end) || *p)
 	{
-		sendResponse ("530 Not logged in\r\n");
+		sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+		return;
+	}
+
+	// RANG 1 0 clears the range
+	if (start == 1 && end == 0)
+	{
+		m_rangeStart = 0;
+		m_rangeEnd   = 0;
+		sendResponse ("350 Restarting at 0. Ending at EOF.\r\n");
+		return;
+	}
+
+	if (end < start || end == UINT64_MAX)
+	{
+		sendResponse ("501 %s\r\n", std::strerror (EINVAL));
 		return;
 	}
 
+	m_rangeStart = start;
+	m_rangeEnd   = end + 1;
+	sendResponse ("350 Restarting at %" PRIu64 ". Ending at %" PRIu64 ".\r\n", start, end);
+}
+
+void FtpSession::REST (char const *args_)
+{
+	setState (State::COMMAND, false, false);
+
 	// parse the offset
 	std::uint64_t pos = 0;
 	for (auto p = args_; *p; ++p)
@@ -2741,13 +4050,6 @@ void FtpSession::REST (char const *args_)
 
 void FtpSession::RETR (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the file to retrieve
 	xferFile (args_, XferFileMode::RETR);
 }
@@ -2756,12 +4058,6 @@ void FtpSession::RMD (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to remove
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -2777,6 +4073,9 @@ void FtpSession::RMD (char const *args_)
 		return;
 	}
 
+	ListingCache::invalidate (path);
+	BlockCache::invalidate (path);
+
 	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
@@ -2785,12 +4084,6 @@ void FtpSession::RNFR (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to rename from
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -2816,12 +4109,6 @@ void FtpSession::RNTO (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// make sure the previous command was RNFR
 	if (m_rename.empty ())
 	{
@@ -2846,6 +4133,11 @@ void FtpSession::RNTO (char const *args_)
 		return;
 	}
 
+	ListingCache::invalidate (m_rename);
+	ListingCache::invalidate (path);
+	BlockCache::invalidate (m_rename);
+	BlockCache::invalidate (path);
+
 	// clear the rename state
 	m_rename.clear ();
 
@@ -2876,6 +4168,7 @@ void FtpSession::SITE (char const *args_)
 #ifdef __3DS__
 		              " Set getMTime: SITE MTIME [0|1]\r\n"
 #endif
+		              " Set stat cache: SITE STATCACHE [0|1]\r\n"
 		              " Save config: SITE SAVE\r\n"
 		              "211 End\r\n");
 		return;
@@ -2965,6 +4258,21 @@ void FtpSession::SITE (char const *args_)
 		}
 	}
 #endif
+	else if (compare (command, "STATCACHE") == 0)
+	{
+		if (arg == "0")
+			IOAbstraction::setStatCacheEnabled (false);
+		else if (arg == "1")
+			IOAbstraction::setStatCacheEnabled (true);
+		else
+		{
+			sendResponse ("550 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		sendResponse ("200 OK\r\n");
+		return;
+	}
 	else if (compare (command, "SAVE") == 0)
 	{
 		bool error;
@@ -2993,12 +4301,6 @@ void FtpSession::SIZE (char const *args_)
 {
 	setState (State::COMMAND, false, false);
 
-	if (!authorized ())
-	{
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// build the path to stat
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -3055,10 +4357,29 @@ void FtpSession::STAT (char const *args_)
 
 		sendResponse ("211-FTP server status\r\n"
 		              " Uptime: %02u:%02u:%02u\r\n"
-		              "211 End\r\n",
+		              " Listing cache: %" PRIu64 " hits, %" PRIu64 " misses\r\n"
+		              " Block cache: %s, %" PRIu64 " hits, %" PRIu64 " misses\r\n"
+		              " Stat cache: %s, %" PRIu64 " hits, %" PRIu64 " misses\r\n",
 		    hours,
 		    minutes,
-		    seconds);
+		    seconds,
+		    ListingCache::hits (),
+		    ListingCache::misses (),
+		    fs::printSize (BlockCache::size ()).c_str (),
+		    BlockCache::hits (),
+		    BlockCache::misses (),
+		    IOAbstraction::statCacheEnabled () ? "on" : "off",
+		    IOAbstraction::statCacheHits (),
+		    IOAbstraction::statCacheMisses ());
+
+		for (auto const &stats : BufferPool::stats ())
+			sendResponse (" Buffer pool %zu: %zu in use, %zu peak, %zu cached\r\n",
+			    stats.size,
+			    stats.inUse,
+			    stats.highWater,
+			    stats.cached);
+
+		sendResponse ("211 End\r\n");
 		return;
 	}
 
@@ -3074,13 +4395,6 @@ void FtpSession::STAT (char const *args_)
 
 void FtpSession::STOR (char const *args_)
 {
-	if (!authorized ())
-	{
-		setState (State::COMMAND, false, false);
-		sendResponse ("530 Not logged in\r\n");
-		return;
-	}
-
 	// open the file to store
 	xferFile (args_, XferFileMode::STOR);
 }
@@ -3158,50 +4472,92 @@ void FtpSession::USER (char const *args_)
 	sendResponse ("430 Invalid user\r\n");
 }
 
+void FtpSession::XCRC (char const *args_)
+{
+	xhash (args_, Checksum::Algorithm::CRC32);
+}
+
+void FtpSession::XMD5 (char const *args_)
+{
+	xhash (args_, Checksum::Algorithm::MD5);
+}
+
+void FtpSession::XSHA1 (char const *args_)
+{
+	xhash (args_, Checksum::Algorithm::SHA1);
+}
+
+void FtpSession::XSHA256 (char const *args_)
+{
+	xhash (args_, Checksum::Algorithm::SHA256);
+}
+
 // clang-format off
-std::vector<std::pair<std::string_view, void (FtpSession::*) (char const *)>> const
-    FtpSession::handlers =
-{
-	{"ABOR", &FtpSession::ABOR}, 
-	{"ALLO", &FtpSession::ALLO}, 
-	{"APPE", &FtpSession::APPE}, 
-	{"CDUP", &FtpSession::CDUP}, 
-	{"CWD",  &FtpSession::CWD},
-	{"DELE", &FtpSession::DELE}, 
-	{"FEAT", &FtpSession::FEAT}, 
-	{"HELP", &FtpSession::HELP}, 
-	{"LIST", &FtpSession::LIST}, 
-	{"MDTM", &FtpSession::MDTM}, 
-	{"MKD",  &FtpSession::MKD},
-	{"MLSD", &FtpSession::MLSD}, 
-	{"MLST", &FtpSession::MLST}, 
-	{"MODE", &FtpSession::MODE}, 
-	{"NLST", &FtpSession::NLST}, 
-	{"NOOP", &FtpSession::NOOP}, 
-	{"OPTS", &FtpSession::OPTS}, 
-	{"PASS", &FtpSession::PASS}, 
-	{"PASV", &FtpSession::PASV}, 
-	{"PORT", &FtpSession::PORT}, 
-	{"PWD",  &FtpSession::PWD},
-	{"QUIT", &FtpSession::QUIT}, 
-	{"REST", &FtpSession::REST}, 
-	{"RETR", &FtpSession::RETR}, 
-	{"RMD",  &FtpSession::RMD},
-	{"RNFR", &FtpSession::RNFR}, 
-	{"RNTO", &FtpSession::RNTO}, 
-	{"SITE", &FtpSession::SITE}, 
-	{"SIZE", &FtpSession::SIZE}, 
-	{"STAT", &FtpSession::STAT}, 
-	{"STOR", &FtpSession::STOR}, 
-	{"STOU", &FtpSession::STOU}, 
-	{"STRU", &FtpSession::STRU}, 
-	{"SYST", &FtpSession::SYST}, 
-	{"TYPE", &FtpSession::TYPE}, 
-	{"USER", &FtpSession::USER}, 
-	{"XCUP", &FtpSession::CDUP},
-	{"XCWD", &FtpSession::CWD},
-	{"XMKD", &FtpSession::MKD},
-	{"XPWD", &FtpSession::PWD},
-	{"XRMD", &FtpSession::RMD},
+constexpr FtpSession::CommandHandler FtpSession::handlers[] =
+{
+	{"ABOR",    &FtpSession::ABOR,    CMD_TRANSFER | CMD_CLEAR_RNFR},
+	{"ALLO",    &FtpSession::ALLO,    CMD_CLEAR_RNFR},
+	{"APPE",    &FtpSession::APPE,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"CDUP",    &FtpSession::CDUP,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"CWD",     &FtpSession::CWD,     CMD_AUTH | CMD_CLEAR_RNFR},
+	{"DELE",    &FtpSession::DELE,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"FEAT",    &FtpSession::FEAT,    CMD_CLEAR_RNFR},
+	{"HASH",    &FtpSession::HASH,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"HELP",    &FtpSession::HELP,    CMD_CLEAR_RNFR},
+	{"LIST",    &FtpSession::LIST,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"MDTM",    &FtpSession::MDTM,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"MKD",     &FtpSession::MKD,     CMD_AUTH | CMD_CLEAR_RNFR},
+	{"MLSD",    &FtpSession::MLSD,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"MLST",    &FtpSession::MLST,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"MODE",    &FtpSession::MODE,    CMD_CLEAR_RNFR},
+	{"NLST",    &FtpSession::NLST,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"NOOP",    &FtpSession::NOOP,    CMD_TRANSFER | CMD_CLEAR_RNFR},
+	{"OPTS",    &FtpSession::OPTS,    CMD_CLEAR_RNFR},
+	{"PASS",    &FtpSession::PASS,    CMD_CLEAR_RNFR},
+	{"PASV",    &FtpSession::PASV,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"PORT",    &FtpSession::PORT,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"PWD",     &FtpSession::PWD,     CMD_TRANSFER | CMD_AUTH | CMD_CLEAR_RNFR},
+	{"QUIT",    &FtpSession::QUIT,    CMD_TRANSFER | CMD_CLEAR_RNFR},
+	{"RANG",    &FtpSession::RANG,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"REST",    &FtpSession::REST,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"RETR",    &FtpSession::RETR,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"RMD",     &FtpSession::RMD,     CMD_AUTH | CMD_CLEAR_RNFR},
+	{"RNFR",    &FtpSession::RNFR,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"RNTO",    &FtpSession::RNTO,    CMD_AUTH},
+	{"SITE",    &FtpSession::SITE,    CMD_CLEAR_RNFR},
+	{"SIZE",    &FtpSession::SIZE,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"STAT",    &FtpSession::STAT,    CMD_TRANSFER | CMD_CLEAR_RNFR},
+	{"STOR",    &FtpSession::STOR,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"STOU",    &FtpSession::STOU,    CMD_CLEAR_RNFR},
+	{"STRU",    &FtpSession::STRU,    CMD_CLEAR_RNFR},
+	{"SYST",    &FtpSession::SYST,    CMD_CLEAR_RNFR},
+	{"TYPE",    &FtpSession::TYPE,    CMD_CLEAR_RNFR},
+	{"USER",    &FtpSession::USER,    CMD_CLEAR_RNFR},
+	{"XCRC",    &FtpSession::XCRC,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XCUP",    &FtpSession::CDUP,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XCWD",    &FtpSession::CWD,     CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XMD5",    &FtpSession::XMD5,    CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XMKD",    &FtpSession::MKD,     CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XPWD",    &FtpSession::PWD,     CMD_TRANSFER | CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XRMD",    &FtpSession::RMD,     CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XSHA",    &FtpSession::XSHA1,   CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XSHA1",   &FtpSession::XSHA1,   CMD_AUTH | CMD_CLEAR_RNFR},
+	{"XSHA256", &FtpSession::XSHA256, CMD_AUTH | CMD_CLEAR_RNFR},
 };
 // clang-format on
+
+FtpSession::CommandHandler const *FtpSession::findHandler (std::string_view const name_)
+{
+	constexpr static auto hash = makeCommandHash (handlers);
+	static_assert (hash.multiplier != 0, "No perfect hash found for the command names");
+
+	auto const key = commandKey (name_);
+	if (key == 0)
+		return nullptr;
+
+	auto const slot = hash.slots[commandSlot (key, hash.multiplier)];
+	if (slot == 0 || hash.keys[slot - 1] != key)
+		return nullptr;
+
+	return &handlers[slot - 1];
+}
@@ -20,6 +20,7 @@
 
 #include "ioBuffer.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
@@ -27,7 +28,7 @@
 IOBuffer::~IOBuffer () = default;
 
 IOBuffer::IOBuffer (std::size_t const size_)
-    : m_buffer (std::make_unique<char[]> (size_)), m_size (size_)
+    : m_buffer (BufferPool::acquire (size_)), m_size (size_)
 {
 	assert (size_ > 0);
 }
@@ -106,3 +107,111 @@ void IOBuffer::coalesce ()
 	m_end -= m_start;
 	m_start = 0;
 }
+
+///////////////////////////////////////////////////////////////////////////
+RingBuffer::~RingBuffer () = default;
+
+RingBuffer::RingBuffer (std::size_t const size_)
+    : m_buffer (BufferPool::acquire (size_)), m_size (size_)
+{
+	assert (size_ > 0);
+}
+
+char *RingBuffer::freeArea () const
+{
+	assert (m_used < m_size);
+	return &m_buffer[(m_start + m_used) % m_size];
+}
+
+std::size_t RingBuffer::freeSize () const
+{
+	auto const end = m_start + m_used;
+	if (end < m_size)
+		return m_size - end;
+
+	// free space wrapped around to sit in front of the readable areas
+	return m_size - m_used;
+}
+
+std::size_t RingBuffer::freeTotal () const
+{
+	assert (m_size >= m_used);
+	return m_size - m_used;
+}
+
+unsigned RingBuffer::freeAreas (Areas &areas_) const
+{
+	if (m_used == m_size)
+		return 0;
+
+	auto const first = freeSize ();
+	areas_[0]        = std::span<char> (freeArea (), first);
+	if (first == freeTotal ())
+		return 1;
+
+	areas_[1] = std::span<char> (&m_buffer[0], freeTotal () - first);
+	return 2;
+}
+
+char *RingBuffer::usedArea () const
+{
+	assert (m_start < m_size);
+	return &m_buffer[m_start];
+}
+
+std::size_t RingBuffer::usedSize () const
+{
+	return std::min (m_used, m_size - m_start);
+}
+
+std::size_t RingBuffer::usedTotal () const
+{
+	return m_used;
+}
+
+unsigned RingBuffer::usedAreas (Areas &areas_) const
+{
+	if (m_used == 0)
+		return 0;
+
+	auto const first = usedSize ();
+	areas_[0]        = std::span<char> (usedArea (), first);
+	if (first == m_used)
+		return 1;
+
+	areas_[1] = std::span<char> (&m_buffer[0], m_used - first);
+	return 2;
+}
+
+void RingBuffer::markFree (std::size_t const size_)
+{
+	assert (m_used >= size_);
+	m_start = (m_start + size_) % m_size;
+	m_used -= size_;
+
+	// reset back to beginning so the next write is contiguous
+	if (m_used == 0)
+		m_start = 0;
+}
+
+void RingBuffer::markUsed (std::size_t const size_)
+{
+	assert (m_size - m_used >= size_);
+	m_used += size_;
+}
+
+bool RingBuffer::empty () const
+{
+	return m_used == 0;
+}
+
+std::size_t RingBuffer::capacity () const
+{
+	return m_size;
+}
+
+void RingBuffer::clear ()
+{
+	m_start = 0;
+	m_used  = 0;
+}
@@ -0,0 +1,198 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "listingCache.h"
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace
+{
+/// \brief Default number of directories to keep
+constexpr std::size_t DEFAULT_CAPACITY = 16;
+
+/// \brief How long a snapshot stays valid
+/// \note Rewriting a file in place does not change its directory's mtime
+constexpr auto SNAPSHOT_TTL = std::chrono::seconds (2);
+
+/// \brief Cached directory
+struct Node
+{
+	/// \brief Resolved directory path
+	std::string path;
+
+	/// \brief Snapshot
+	SharedDirSnapshot snapshot;
+
+	/// \brief When the snapshot expires
+	std::chrono::steady_clock::time_point expires;
+};
+
+/// \brief Cache mutex
+std::mutex s_lock;
+
+/// \brief Cached directories, most recently used first
+std::list<Node> s_lru;
+
+/// \brief Index into s_lru by path
+std::unordered_map<std::string, std::list<Node>::iterator> s_index;
+
+/// \brief Number of directories to keep
+std::size_t s_capacity = DEFAULT_CAPACITY;
+
+/// \brief Incremented by every invalidation
+std::uint64_t s_generation = 0;
+
+/// \brief Number of lookups that hit
+std::uint64_t s_hits = 0;
+
+/// \brief Number of lookups that missed
+std::uint64_t s_misses = 0;
+
+/// \brief Drop least recently used directories over capacity
+/// \note Cache lock must be held
+void trim ()
+{
+	while (s_lru.size () > s_capacity)
+	{
+		s_index.erase (s_lru.back ().path);
+		s_lru.pop_back ();
+	}
+}
+
+/// \brief Whether a cached directory is affected by a change to a path
+/// \param dir_ Cached directory
+/// \param path_ Changed path
+bool affected (std::string_view const dir_, std::string_view const path_)
+{
+	// the path itself or anything below it
+	if (dir_.starts_with (path_) &&
+	    (dir_.size () == path_.size () || dir_[path_.size ()] == '/' || path_ == "/"))
+		return true;
+
+	// the parent directory
+	auto const pos = path_.find_last_of ('/');
+	if (pos == std::string_view::npos)
+		return false;
+
+	return dir_ == (pos == 0 ? std::string_view ("/") : path_.substr (0, pos));
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+void ListingCache::setCapacity (std::size_t const capacity_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	s_capacity      = capacity_;
+	trim ();
+}
+
+SharedDirSnapshot ListingCache::lookup (std::string const &path_, std::time_t const mtime_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	if (s_capacity == 0)
+		return nullptr;
+
+	auto const it = s_index.find (path_);
+	if (it == std::end (s_index))
+	{
+		++s_misses;
+		return nullptr;
+	}
+
+	if (it->second->snapshot->mtime != mtime_ ||
+	    it->second->expires <= std::chrono::steady_clock::now ())
+	{
+		++s_misses;
+		s_lru.erase (it->second);
+		s_index.erase (it);
+		return nullptr;
+	}
+
+	++s_hits;
+
+	// move to front
+	s_lru.splice (std::begin (s_lru), s_lru, it->second);
+	return it->second->snapshot;
+}
+
+std::uint64_t ListingCache::generation ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_generation;
+}
+
+void ListingCache::store (std::string const &path_,
+    SharedDirSnapshot snapshot_,
+    std::uint64_t const generation_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	if (s_capacity == 0 || generation_ != s_generation)
+		return;
+
+	auto const expires = std::chrono::steady_clock::now () + SNAPSHOT_TTL;
+
+	auto const it = s_index.find (path_);
+	if (it != std::end (s_index))
+	{
+		it->second->snapshot = std::move (snapshot_);
+		it->second->expires  = expires;
+		s_lru.splice (std::begin (s_lru), s_lru, it->second);
+		return;
+	}
+
+	s_lru.emplace_front (Node{path_, std::move (snapshot_), expires});
+	s_index.emplace (path_, std::begin (s_lru));
+	trim ();
+}
+
+void ListingCache::invalidate (std::string_view const path_)
+{
+	auto const lock = std::scoped_lock (s_lock);
+	++s_generation;
+
+	auto it = std::begin (s_lru);
+	while (it != std::end (s_lru))
+	{
+		if (!affected (it->path, path_))
+		{
+			++it;
+			continue;
+		}
+
+		s_index.erase (it->path);
+		it = s_lru.erase (it);
+	}
+}
+
+std::uint64_t ListingCache::hits ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_hits;
+}
+
+std::uint64_t ListingCache::misses ()
+{
+	auto const lock = std::scoped_lock (s_lock);
+	return s_misses;
+}
@@ -26,9 +26,12 @@
 #include "imgui.h"
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <mutex>
-#include <ranges>
-#include <vector>
 
 #ifdef __WIIU__
 #include <coreinit/debug.h>
@@ -44,10 +47,22 @@ constexpr auto MAX_LOGS = 250;
 constexpr auto MAX_LOGS = 100;
 #endif
 
-#ifdef CLASSIC
-bool s_logUpdated = true;
+#if defined(__NDS__) || defined(__WIIU__)
+/// \brief Size of a log record, including the terminator
+constexpr std::size_t RECORD_SIZE = 128;
+
+/// \brief Number of records that can wait to be drawn; must be a power of two
+constexpr std::uint32_t RING_SIZE = 16;
+#else
+/// \brief Size of a log record, including the terminator
+constexpr std::size_t RECORD_SIZE = 512;
+
+/// \brief Number of records that can wait to be drawn; must be a power of two
+constexpr std::uint32_t RING_SIZE = 128;
 #endif
 
+static_assert ((RING_SIZE & (RING_SIZE - 1)) == 0, "RING_SIZE must be a power of two");
+
 /// \brief Message prefix
 static char const *const s_prefix[] = {
     [DEBUGLOG] = "[DEBUG]",
@@ -57,60 +72,182 @@ static char const *const s_prefix[] = {
     [RESPONSE] = "[RESPONSE]",
 };
 
-/// \brief Log message
-struct Message
+/// \brief Preformatted log record
+struct Record
 {
-	/// \brief Parameterized constructor
-	/// \param level_ Log level
-	/// \param message_ Log message
-	Message (LogLevel const level_, std::string message_)
-	    : level (level_), message (std::move (message_))
-	{
-	}
-
 	/// \brief Log level
 	LogLevel level;
-	/// \brief Log message
-	std::string message;
+	/// \brief Message length
+	std::uint16_t size;
+	/// \brief Message; nul-terminated
+	char message[RECORD_SIZE];
+};
+
+/// \brief Ring slot
+struct Slot
+{
+	/// \brief Sequence less the slot index
+	/// The slot is free for position p when this is p - index, and holds p's record when it is
+	/// p - index + 1. Storing it offset lets the ring start out zero-initialized.
+	std::atomic<std::uint32_t> sequence{0};
+	/// \brief Record
+	Record record;
 };
 
-/// \brief Log messages
-std::vector<Message> s_messages;
+/// \brief Records waiting for the reader; any thread may write, only the reader drains
+Slot s_ring[RING_SIZE];
+
+/// \brief Next position to write
+std::atomic<std::uint32_t> s_head{0};
+
+/// \brief Number of messages dropped since the reader last drained the ring
+std::atomic<std::uint32_t> s_dropped{0};
+
+/// \brief Next position to drain
+/// \note Reader lock must be held
+std::uint32_t s_tail = 0;
+
+/// \brief Drained records
+/// \note Reader lock must be held
+Record s_history[MAX_LOGS];
+
+/// \brief Index of the oldest drained record
+std::size_t s_historyStart = 0;
+
+/// \brief Number of drained records
+std::size_t s_historyCount = 0;
 
 #ifndef __NDS__
-/// \brief Log lock
+/// \brief Reader lock; writers never take it
 platform::Mutex s_lock;
 #endif
+
+/// \brief Claim a ring slot to write a record into
+/// \param pos_ Claimed position
+/// \returns nullptr if the ring is full; the message is counted as dropped
+Slot *claim (std::uint32_t &pos_)
+{
+	auto pos = s_head.load (std::memory_order_relaxed);
+	while (true)
+	{
+		auto const index = pos % RING_SIZE;
+		auto &slot       = s_ring[index];
+		auto const diff  = static_cast<std::int32_t> (
+		    slot.sequence.load (std::memory_order_acquire) - (pos - index));
+
+		if (diff == 0)
+		{
+			if (s_head.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed))
+			{
+				pos_ = pos;
+				return &slot;
+			}
+		}
+		else if (diff < 0)
+		{
+			// the reader has not drained this slot from the previous lap
+			s_dropped.fetch_add (1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		else
+			pos = s_head.load (std::memory_order_relaxed);
+	}
 }
 
-void drawLog ()
+/// \brief Hand a written record to the reader
+/// \param slot_ Slot returned by claim
+/// \param pos_ Claimed position
+void publish (Slot &slot_, std::uint32_t const pos_)
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
+	slot_.sequence.store (pos_ - pos_ % RING_SIZE + 1, std::memory_order_release);
+}
 
-#ifdef CLASSIC
-	if (!s_logUpdated)
+/// \brief Terminate a record, keeping the newline if the message was truncated
+/// \param record_ Record to terminate
+/// \param size_ Untruncated message length
+void terminate (Record &record_, std::size_t const size_)
+{
+	if (size_ < sizeof (record_.message))
+	{
+		record_.size           = static_cast<std::uint16_t> (size_);
+		record_.message[size_] = '\0';
 		return;
+	}
 
-	s_logUpdated = false;
-#endif
+	record_.size                      = sizeof (record_.message) - 1;
+	record_.message[record_.size - 1] = '\n';
+	record_.message[record_.size]     = '\0';
+}
 
-	auto const maxLogs =
-#if defined(CLASSIC) && !defined(__WIIU__)
-	    g_logConsole.windowHeight;
-#else
-	    MAX_LOGS;
-#endif
+/// \brief Get the record to drain into next, dropping the oldest if the history is full
+/// \note Reader lock must be held
+Record &historyPush ()
+{
+	if (s_historyCount == MAX_LOGS)
+	{
+		s_historyStart = (s_historyStart + 1) % MAX_LOGS;
+		--s_historyCount;
+	}
+
+	return s_history[(s_historyStart + s_historyCount++) % MAX_LOGS];
+}
+
+/// \brief Get a drained record
+/// \param index_ Index from the oldest record
+/// \note Reader lock must be held
+Record const &historyAt (std::size_t const index_)
+{
+	return s_history[(s_historyStart + index_) % MAX_LOGS];
+}
+
+/// \brief Move published records from the ring into the history
+/// \note Reader lock must be held
+void drain ()
+{
+	while (true)
+	{
+		auto const index = s_tail % RING_SIZE;
+		auto &slot       = s_ring[index];
+		if (slot.sequence.load (std::memory_order_acquire) != s_tail - index + 1)
+			break;
+
+		auto &record = historyPush ();
+		record.level = slot.record.level;
+		record.size  = slot.record.size;
+		std::memcpy (record.message, slot.record.message, slot.record.size + 1);
+
+		// free the slot for the next lap
+		slot.sequence.store (s_tail - index + RING_SIZE, std::memory_order_release);
+		++s_tail;
+	}
 
-	if (s_messages.size () > static_cast<unsigned> (maxLogs))
+	auto const dropped = s_dropped.exchange (0, std::memory_order_relaxed);
+	if (dropped != 0)
 	{
-		auto const begin = std::begin (s_messages);
-		auto const end   = std::next (begin, s_messages.size () - maxLogs);
-		s_messages.erase (begin, end);
+		auto &record  = historyPush ();
+		auto const rc = std::snprintf (record.message,
+		    sizeof (record.message),
+		    "Dropped %u log messages\n",
+		    static_cast<unsigned> (dropped));
+
+		record.level = ERROR;
+		terminate (record, std::max (rc, 0));
 	}
+}
+}
+
+void drawLog ()
+{
+#ifndef __NDS__
+	auto const lock = std::scoped_lock (s_lock);
+#endif
+
+	drain ();
 
 #ifdef CLASSIC
+	if (s_historyCount == 0)
+		return;
+
 	char const *const s_colors[] = {
 	    [DEBUGLOG] = "\x1b[33;1m", // yellow
 	    [INFO]     = "\x1b[37;1m", // white
@@ -120,25 +257,27 @@ void drawLog ()
 	};
 
 #ifdef __WIIU__
-	for (auto &cur : s_messages)
+	for (std::size_t i = 0; i < s_historyCount; ++i)
 	{
-		OSReport ("ftpiiu plugin: %s %s\x1b[0m", s_colors[cur.level], cur.message.c_str ());
+		auto const &cur = historyAt (i);
+		OSReport ("ftpiiu plugin: %s %s\x1b[0m", s_colors[cur.level], cur.message);
 	}
 #else
-	auto it = std::begin (s_messages);
-	if (s_messages.size () > static_cast<unsigned> (g_logConsole.windowHeight))
-		it = std::next (it, s_messages.size () - g_logConsole.windowHeight);
+	std::size_t i = 0;
+	if (s_historyCount > static_cast<unsigned> (g_logConsole.windowHeight))
+		i = s_historyCount - g_logConsole.windowHeight;
 
 	consoleSelect (&g_logConsole);
-	while (it != std::end (s_messages))
+	for (; i < s_historyCount; ++i)
 	{
-		std::fputs (s_colors[it->level], stdout);
-		std::fputs (it->message.c_str (), stdout);
-		++it;
+		auto const &cur = historyAt (i);
+		std::fputs (s_colors[cur.level], stdout);
+		std::fputs (cur.message, stdout);
 	}
 	std::fflush (stdout);
 #endif
-	s_messages.clear ();
+	s_historyStart = 0;
+	s_historyCount = 0;
 #else
 	ImVec4 const s_colors[] = {
 	    [DEBUG]    = ImVec4 (1.0f, 1.0f, 0.4f, 1.0f),          // yellow
@@ -148,12 +287,13 @@ void drawLog ()
 	    [RESPONSE] = ImVec4 (0.4f, 1.0f, 1.0f, 1.0f),          // cyan
 	};
 
-	for (auto const &message : s_messages)
+	for (std::size_t i = 0; i < s_historyCount; ++i)
 	{
+		auto const &message = historyAt (i);
 		ImGui::PushStyleColor (ImGuiCol_Text, s_colors[message.level]);
 		ImGui::TextUnformatted (s_prefix[message.level]);
 		ImGui::SameLine ();
-		ImGui::TextUnformatted (message.message.c_str ());
+		ImGui::TextUnformatted (message.message, message.message + message.size);
 		ImGui::PopStyleColor ();
 	}
 
@@ -170,27 +310,20 @@ std::string getLog ()
 	auto const lock = std::scoped_lock (s_lock);
 #endif
 
-	if (s_messages.empty ())
-		return {};
-
-	std::vector<Message const *> stack;
-	stack.reserve (s_messages.size ());
+	drain ();
 
 	std::size_t size = 0;
-	for (auto const &msg : s_messages | std::views::reverse)
-	{
-		if (size + msg.message.size () > 1024 * 1024)
-			break;
-
-		size += msg.message.size ();
-		stack.emplace_back (&msg);
-	}
+	for (std::size_t i = 0; i < s_historyCount; ++i)
+		size += historyAt (i).size;
 
 	std::string log;
 	log.reserve (size);
 
-	for (auto const &msg : stack | std::views::reverse)
-		log += msg->message;
+	for (std::size_t i = 0; i < s_historyCount; ++i)
+	{
+		auto const &msg = historyAt (i);
+		log.append (msg.message, msg.size);
+	}
 
 	return log;
 }
@@ -256,28 +389,19 @@ void addLog (LogLevel const level_, char const *const fmt_, va_list ap_)
 		return;
 #endif
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
-
-#if !defined(NDS) && !defined(__WIIU__)
-	thread_local
-#endif
-#if !defined(__WIIU__)
-	    static
-#endif
-	    char buffer[1024];
+	std::uint32_t pos;
+	auto const slot = claim (pos);
+	if (!slot)
+		return;
 
-	std::vsnprintf (buffer, sizeof (buffer), fmt_, ap_);
+	// format straight into the claimed slot; no other writer or the reader touches it until it is
+	// published
+	auto &record = slot->record;
+	auto const rc = std::vsnprintf (record.message, sizeof (record.message), fmt_, ap_);
 
-#ifndef NDEBUG
-	// std::fprintf (stderr, "%s", s_prefix[level_]);
-	// std::fputs (buffer, stderr);
-#endif
-	s_messages.emplace_back (level_, buffer);
-#ifdef CLASSIC
-	s_logUpdated = true;
-#endif
+	record.level = level_;
+	terminate (record, std::max (rc, 0));
+	publish (*slot, pos);
 }
 
 void addLog (LogLevel const level_, std::string_view const message_)
@@ -291,23 +415,19 @@ void addLog (LogLevel const level_, std::string_view const message_)
 		return;
 #endif
 
-	auto msg = std::string (message_);
-	for (auto &c : msg)
-	{
-		// replace nul-characters with ? to avoid truncation
-		if (c == '\0')
-			c = '?';
-	}
+	std::uint32_t pos;
+	auto const slot = claim (pos);
+	if (!slot)
+		return;
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
-#ifndef NDEBUG
-	// std::fprintf (stderr, "%s", s_prefix[level_]);
-	// std::fwrite (msg.data (), 1, msg.size (), stderr);
-#endif
-	s_messages.emplace_back (level_, msg);
-#ifdef CLASSIC
-	s_logUpdated = true;
-#endif
+	auto &record    = slot->record;
+	auto const size = std::min (message_.size (), sizeof (record.message) - 1);
+	std::memcpy (record.message, message_.data (), size);
+
+	// replace nul-characters with ? to avoid truncation
+	std::replace (record.message, record.message + size, '\0', '?');
+
+	record.level = level_;
+	terminate (record, message_.size ());
+	publish (*slot, pos);
 }
@@ -0,0 +1,247 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "pollSet.h"
+
+#include "log.h"
+
+#if FTPD_HAS_EPOLL
+#include <unistd.h>
+#endif
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#if FTPD_HAS_EPOLL
+namespace
+{
+/// \brief Convert poll events to epoll events
+/// \param events_ Poll events
+std::uint32_t toEpoll (int const events_)
+{
+	std::uint32_t events = 0;
+	if (events_ & POLLIN)
+		events |= EPOLLIN;
+	if (events_ & POLLPRI)
+		events |= EPOLLPRI;
+	if (events_ & POLLOUT)
+		events |= EPOLLOUT;
+
+	return events;
+}
+
+/// \brief Convert epoll events to poll events
+/// \param events_ epoll events
+int fromEpoll (std::uint32_t const events_)
+{
+	int events = 0;
+	if (events_ & EPOLLIN)
+		events |= POLLIN;
+	if (events_ & EPOLLPRI)
+		events |= POLLPRI;
+	if (events_ & EPOLLOUT)
+		events |= POLLOUT;
+	if (events_ & EPOLLERR)
+		events |= POLLERR;
+	if (events_ & EPOLLHUP)
+		events |= POLLHUP;
+
+	return events;
+}
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+PollSet::~PollSet ()
+{
+	for (auto &entry : m_entries)
+		entry.socket->m_pollSet = nullptr;
+
+#if FTPD_HAS_EPOLL
+	if (m_epollFd >= 0)
+		::close (m_epollFd);
+#endif
+}
+
+PollSet::PollSet ()
+{
+#if FTPD_HAS_EPOLL
+	m_epollFd = ::epoll_create1 (EPOLL_CLOEXEC);
+	if (m_epollFd < 0)
+		error ("epoll_create1: %s\n", std::strerror (errno));
+#endif
+}
+
+void PollSet::update (Socket &socket_, int const events_, void *const user_)
+{
+	if (events_ == 0)
+	{
+		remove (socket_);
+		return;
+	}
+
+	if (socket_.m_pollSet == this)
+	{
+		auto const slot      = socket_.m_pollSlot;
+		m_entries[slot].user = user_;
+
+		if (m_pollfds[slot].events == events_)
+			return;
+
+		m_pollfds[slot].events = events_;
+
+#if FTPD_HAS_EPOLL
+		if (m_epollFd >= 0)
+		{
+			epoll_event event{};
+			event.events   = toEpoll (events_);
+			event.data.ptr = &socket_;
+			if (::epoll_ctl (m_epollFd, EPOLL_CTL_MOD, socket_.m_fd, &event) != 0)
+				error ("epoll_ctl: %s\n", std::strerror (errno));
+		}
+#endif
+		return;
+	}
+
+	assert (!socket_.m_pollSet);
+
+#if FTPD_HAS_EPOLL
+	if (m_epollFd >= 0)
+	{
+		epoll_event event{};
+		event.events   = toEpoll (events_);
+		event.data.ptr = &socket_;
+		if (::epoll_ctl (m_epollFd, EPOLL_CTL_ADD, socket_.m_fd, &event) != 0)
+		{
+			error ("epoll_ctl: %s\n", std::strerror (errno));
+			return;
+		}
+	}
+#endif
+
+	socket_.m_pollSet  = this;
+	socket_.m_pollSlot = m_entries.size ();
+
+	pollfd pfd;
+	pfd.fd      = socket_.m_fd;
+	pfd.events  = events_;
+	pfd.revents = 0;
+
+	m_pollfds.emplace_back (pfd);
+	m_entries.emplace_back (Entry{&socket_, user_});
+}
+
+void PollSet::remove (Socket &socket_)
+{
+	if (socket_.m_pollSet != this)
+		return;
+
+#if FTPD_HAS_EPOLL
+	// must happen before the descriptor is closed
+	if (m_epollFd >= 0 && ::epoll_ctl (m_epollFd, EPOLL_CTL_DEL, socket_.m_fd, nullptr) != 0)
+		error ("epoll_ctl: %s\n", std::strerror (errno));
+#endif
+
+	// move the last entry into the hole
+	auto const slot = socket_.m_pollSlot;
+	if (slot != m_entries.size () - 1)
+	{
+		m_pollfds[slot]                    = m_pollfds.back ();
+		m_entries[slot]                    = m_entries.back ();
+		m_entries[slot].socket->m_pollSlot = slot;
+	}
+
+	m_pollfds.pop_back ();
+	m_entries.pop_back ();
+
+	socket_.m_pollSet = nullptr;
+
+	// don't report events for a socket that is going away
+	for (auto &event : m_ready)
+	{
+		if (event.socket == &socket_)
+			event.socket = nullptr;
+	}
+}
+
+bool PollSet::empty () const
+{
+	return m_entries.empty ();
+}
+
+int PollSet::poll (std::chrono::milliseconds const timeout_)
+{
+	m_ready.clear ();
+
+	if (m_pollfds.empty ())
+		return 0;
+
+#if FTPD_HAS_EPOLL
+	if (m_epollFd >= 0)
+	{
+		m_epollEvents.resize (m_entries.size ());
+
+		auto const rc = ::epoll_wait (
+		    m_epollFd, m_epollEvents.data (), m_epollEvents.size (), timeout_.count ());
+		if (rc < 0)
+		{
+			// a signal is not a failure
+			if (errno == EINTR)
+				return 0;
+
+			error ("epoll_wait: %s\n", std::strerror (errno));
+			return rc;
+		}
+
+		for (int i = 0; i < rc; ++i)
+		{
+			auto const socket = static_cast<Socket *> (m_epollEvents[i].data.ptr);
+			auto const &entry = m_entries[socket->m_pollSlot];
+			m_ready.emplace_back (Event{socket, entry.user, fromEpoll (m_epollEvents[i].events)});
+		}
+
+		return rc;
+	}
+#endif
+
+	auto const rc = ::poll (m_pollfds.data (), m_pollfds.size (), timeout_.count ());
+	if (rc < 0)
+	{
+		error ("poll: %s\n", std::strerror (errno));
+		return rc;
+	}
+
+	for (std::size_t i = 0; i < m_pollfds.size () && m_ready.size () < std::size_t (rc); ++i)
+	{
+		if (!m_pollfds[i].revents)
+			continue;
+
+		auto const &entry = m_entries[i];
+		m_ready.emplace_back (Event{entry.socket, entry.user, m_pollfds[i].revents});
+	}
+
+	return rc;
+}
+
+std::vector<PollSet::Event> const &PollSet::ready () const
+{
+	return m_ready;
+}
@@ -0,0 +1,134 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef __NDS__
+#include "sessionWorker.h"
+
+#include "log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <utility>
+using namespace std::chrono_literals;
+
+///////////////////////////////////////////////////////////////////////////
+SessionWorker::~SessionWorker ()
+{
+	m_quit = true;
+	m_thread.join ();
+}
+
+SessionWorker::SessionWorker (unsigned const cpuMask_)
+    : m_thread (std::bind (&SessionWorker::threadFunc, this), cpuMask_)
+{
+}
+
+void SessionWorker::add (UniqueFtpSession session_)
+{
+	auto const lock = std::scoped_lock (m_lock);
+	m_pending.emplace_back (std::move (session_));
+	++m_load;
+}
+
+void SessionWorker::clear ()
+{
+	// sessions are only destroyed on the worker thread, which may be polling them right now
+	m_clear = true;
+}
+
+std::size_t SessionWorker::load () const
+{
+	return m_load;
+}
+
+void SessionWorker::draw ()
+{
+	auto const lock = std::scoped_lock (m_lock);
+	for (auto &session : m_sessions)
+	{
+		session->draw ();
+#if defined(CLASSIC) && !defined(NO_CONSOLE)
+		std::fputc ('\n', stdout);
+#endif
+	}
+}
+
+void SessionWorker::loop ()
+{
+	{
+		std::vector<UniqueFtpSession> deadSessions;
+
+		auto const lock = std::scoped_lock (m_lock);
+
+		if (m_clear.exchange (false))
+		{
+			deadSessions = std::move (m_sessions);
+			for (auto &session : m_pending)
+				deadSessions.emplace_back (std::move (session));
+			m_sessions.clear ();
+			m_pending.clear ();
+		}
+
+		// take over new sessions
+		for (auto &session : m_pending)
+			m_sessions.emplace_back (std::move (session));
+		m_pending.clear ();
+
+		// remove dead sessions
+		auto it = std::begin (m_sessions);
+		while (it != std::end (m_sessions))
+		{
+			auto &session = *it;
+			if (session->dead ())
+			{
+				deadSessions.emplace_back (std::move (session));
+				it = m_sessions.erase (it);
+			}
+			else
+				++it;
+		}
+
+		m_load = m_sessions.size ();
+	}
+
+	// poll sessions
+	if (!m_sessions.empty ())
+	{
+		if (!FtpSession::poll (m_pollSet, m_sessions))
+			clear ();
+	}
+	// avoid busy polling in background thread
+	else
+		platform::Thread::sleep (16ms);
+}
+
+void SessionWorker::threadFunc ()
+{
+	while (!m_quit)
+		loop ();
+
+	auto const lock = std::scoped_lock (m_lock);
+	m_sessions.clear ();
+	m_pending.clear ();
+}
+#endif
@@ -21,13 +21,25 @@
 #include "socket.h"
 #include "log.h"
 #include "platform.h"
+#include "pollSet.h"
 
 #include <chrono>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#if __has_include(<netinet/tcp.h>)
+#include <netinet/tcp.h>
+#endif
+#if FTPD_HAS_READV
+#include <sys/uio.h>
+#endif
 #include <unistd.h>
 
+#if FTPD_HAS_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#include <array>
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
@@ -38,6 +50,9 @@ using namespace std::chrono_literals;
 ///////////////////////////////////////////////////////////////////////////
 Socket::~Socket ()
 {
+	if (m_pollSet)
+		m_pollSet->remove (*this);
+
 	if (m_listening)
 		info ("Stop listening on [%s]:%u\n", m_sockName.name (), m_sockName.port ());
 
@@ -235,6 +250,23 @@ bool Socket::setWinScale (const int val)
 	return true;
 }
 
+bool Socket::setNoDelay (bool const noDelay_)
+{
+#ifdef TCP_NODELAY
+	int const noDelay = noDelay_;
+	if (::setsockopt (m_fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay)) != 0)
+	{
+		error ("setsockopt(TCP_NODELAY, %s): %s\n", noDelay_ ? "yes" : "no", std::strerror (errno));
+		return false;
+	}
+
+	return true;
+#else
+	(void)noDelay_;
+	return false;
+#endif
+}
+
 bool Socket::setReuseAddress (bool const reuse_)
 {
 	int const reuse = reuse_;
@@ -271,6 +303,18 @@ bool Socket::setSendBufferSize (std::size_t const size_)
 	return true;
 }
 
+std::chrono::microseconds Socket::rtt () const
+{
+#if FTPD_HAS_TCP_INFO
+	tcp_info info{};
+	socklen_t size = sizeof (info);
+	if (::getsockopt (m_fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0)
+		return std::chrono::microseconds (info.tcpi_rtt);
+#endif
+
+	return {};
+}
+
 #ifndef __NDS__
 bool Socket::joinMulticastGroup (SockAddr const &addr_, SockAddr const &iface_)
 {
@@ -327,6 +371,30 @@ std::make_signed_t<std::size_t> Socket::read (IOBuffer &buffer_, bool const oob_
 	return rc;
 }
 
+std::make_signed_t<std::size_t> Socket::read (RingBuffer &buffer_)
+{
+	assert (buffer_.freeTotal () > 0);
+
+#if FTPD_HAS_READV
+	RingBuffer::Areas areas;
+	auto const count = buffer_.freeAreas (areas);
+
+	std::array<iovec, 2> iov;
+	for (unsigned i = 0; i < count; ++i)
+		iov[i] = {areas[i].data (), areas[i].size ()};
+
+	auto const rc = ::readv (m_fd, iov.data (), count);
+	if (rc < 0 && errno != EWOULDBLOCK)
+		error ("readv: %s\n", std::strerror (errno));
+#else
+	auto const rc = read (buffer_.freeArea (), buffer_.freeSize ());
+#endif
+	if (rc > 0)
+		buffer_.markUsed (rc);
+
+	return rc;
+}
+
 std::make_signed_t<std::size_t>
     Socket::readFrom (void *const buffer_, std::size_t const size_, SockAddr &addr_)
 {
@@ -365,6 +433,51 @@ std::make_signed_t<std::size_t> Socket::write (IOBuffer &buffer_)
 	return rc;
 }
 
+std::make_signed_t<std::size_t> Socket::write (RingBuffer &buffer_)
+{
+	assert (buffer_.usedTotal () > 0);
+
+#if FTPD_HAS_READV
+	RingBuffer::Areas areas;
+	auto const count = buffer_.usedAreas (areas);
+
+	std::array<iovec, 2> iov;
+	for (unsigned i = 0; i < count; ++i)
+		iov[i] = {areas[i].data (), areas[i].size ()};
+
+	auto const rc = ::writev (m_fd, iov.data (), count);
+	if (rc < 0 && errno != EWOULDBLOCK)
+		error ("writev: %s\n", std::strerror (errno));
+#else
+	auto const rc = write (buffer_.usedArea (), buffer_.usedSize ());
+#endif
+	if (rc > 0)
+		buffer_.markFree (rc);
+
+	return rc;
+}
+
+#if FTPD_HAS_SENDFILE
+std::make_signed_t<std::size_t>
+    Socket::sendFile (int const fd_, std::uint64_t &offset_, std::size_t const size_)
+{
+	assert (size_ > 0);
+
+	off_t offset  = offset_;
+	auto const rc = ::sendfile (m_fd, fd_, &offset, size_);
+	if (rc < 0)
+	{
+		// EINVAL/ENOSYS tell the caller to fall back to read/write
+		if (errno != EWOULDBLOCK && errno != EINVAL && errno != ENOSYS)
+			error ("sendfile: %s\n", std::strerror (errno));
+		return rc;
+	}
+
+	offset_ = offset;
+	return rc;
+}
+#endif
+
 std::make_signed_t<std::size_t>
     Socket::writeTo (void const *buffer_, std::size_t size_, SockAddr const &addr_)
 {
@@ -192,6 +192,7 @@ void start_server ()
 		DEBUG_FUNCTION_LINE_ERR (
 		    "Failed to init libmocha: %s [%d]\n", Mocha_GetStatusStr (res), res);
 	}
+	IOAbstraction::finalizeVirtualPaths ();
 
 	server = FtpServer::create ();
 }
@@ -408,11 +409,17 @@ public:
 
 	/// \brief Parameterized constructor
 	/// \param func_ Thread entry point
-	explicit privateData_t (std::function<void ()> &&func_) : thread (std::move (func_))
+	/// \param cpuMask_ Cores the thread may run on; 0 uses CPU2
+	explicit privateData_t (std::function<void ()> &&func_, unsigned const cpuMask_ = 0)
+	    : thread (std::move (func_))
 	{
+		auto affinity = cpuMask_ & OS_THREAD_ATTRIB_AFFINITY_ANY;
+		if (!affinity)
+			affinity = OS_THREAD_ATTRIB_AFFINITY_CPU2;
+
 		auto nativeHandle = (OSThread *)thread.native_handle ();
 		OSSetThreadName (nativeHandle, "ftpiiu");
-		while (!OSSetThreadAffinity (nativeHandle, OS_THREAD_ATTRIB_AFFINITY_CPU2))
+		while (!OSSetThreadAffinity (nativeHandle, affinity))
 		{
 			OSSleepTicks (OSMillisecondsToTicks (16));
 		}
@@ -438,6 +445,11 @@ platform::Thread::Thread (std::function<void ()> &&func_)
 {
 }
 
+platform::Thread::Thread (std::function<void ()> &&func_, unsigned const cpuMask_)
+    : m_d (new privateData_t (std::move (func_), cpuMask_))
+{
+}
+
 platform::Thread::Thread (Thread &&that_) : m_d (new privateData_t ())
 {
 	std::swap (m_d, that_.m_d);
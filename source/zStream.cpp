@@ -0,0 +1,150 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+//
+// Copyright (C) 2024 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "zStream.h"
+
+#if FTPD_HAS_ZLIB
+#include <cassert>
+
+namespace
+{
+/// \brief Input size over which compressibility is measured
+constexpr uLong SAMPLE_SIZE = 64 * 1024;
+
+/// \brief Samples to store uncompressed after one did not compress
+constexpr unsigned SKIP_SAMPLES = 8;
+}
+
+///////////////////////////////////////////////////////////////////////////
+ZStream::~ZStream ()
+{
+	if (!m_valid)
+		return;
+
+	if (m_direction == Direction::DEFLATE)
+		(void)deflateEnd (&m_stream);
+	else
+		(void)inflateEnd (&m_stream);
+}
+
+ZStream::ZStream (Direction const direction_, int const level_)
+    : m_direction (direction_), m_level (level_)
+{
+	if (m_direction == Direction::DEFLATE)
+		m_valid = deflateInit (&m_stream, m_level) == Z_OK;
+	else
+		m_valid = inflateInit (&m_stream) == Z_OK;
+}
+
+bool ZStream::valid () const
+{
+	return m_valid;
+}
+
+bool ZStream::done () const
+{
+	return m_done;
+}
+
+unsigned ZStream::skipped () const
+{
+	return m_skipped;
+}
+
+bool ZStream::process (RingBuffer &in_, RingBuffer &out_, bool const finish_)
+{
+	assert (m_valid);
+
+	while (!m_done && out_.freeTotal () != 0)
+	{
+		// zlib may only be told to finish once it has been handed all of the remaining input
+		auto const last = in_.usedSize () == in_.usedTotal ();
+		if (in_.empty () && !finish_)
+			break;
+
+		m_stream.next_in   = reinterpret_cast<Bytef *> (in_.empty () ? nullptr : in_.usedArea ());
+		m_stream.avail_in  = in_.usedSize ();
+		m_stream.next_out  = reinterpret_cast<Bytef *> (out_.freeArea ());
+		m_stream.avail_out = out_.freeSize ();
+
+		int rc;
+		if (m_direction == Direction::DEFLATE)
+		{
+			adapt ();
+			if (m_pendingLevel >= 0)
+			{
+				// switching levels flushes the current block, which needs output space
+				rc = deflateParams (&m_stream, m_pendingLevel, Z_DEFAULT_STRATEGY);
+				if (rc == Z_OK)
+					m_pendingLevel = -1;
+				else if (rc != Z_BUF_ERROR)
+					return false;
+			}
+
+			rc = deflate (&m_stream, finish_ && last ? Z_FINISH : Z_NO_FLUSH);
+		}
+		else
+			rc = inflate (&m_stream, Z_NO_FLUSH);
+
+		auto const consumed = in_.usedSize () - m_stream.avail_in;
+		auto const produced = out_.freeSize () - m_stream.avail_out;
+		in_.markFree (consumed);
+		out_.markUsed (produced);
+
+		if (rc == Z_STREAM_END)
+			m_done = true;
+		else if (rc == Z_BUF_ERROR || (consumed == 0 && produced == 0))
+			break;
+		else if (rc != Z_OK)
+			return false;
+	}
+
+	return true;
+}
+
+void ZStream::adapt ()
+{
+	if (m_level == 0 || m_stream.total_in - m_sampleIn < SAMPLE_SIZE)
+		return;
+
+	auto const in  = m_stream.total_in - m_sampleIn;
+	auto const out = m_stream.total_out - m_sampleOut;
+	m_sampleIn     = m_stream.total_in;
+	m_sampleOut    = m_stream.total_out;
+
+	if (m_skip != 0)
+	{
+		// probe again at the configured level once the skip runs out
+		if (--m_skip == 0)
+			m_pendingLevel = m_level;
+		else
+			++m_skipped;
+		return;
+	}
+
+	// already-compressed data barely shrinks; store it rather than burn CPU on it
+	if (out > in - in / 16)
+	{
+		m_skip         = SKIP_SAMPLES;
+		m_pendingLevel = 0;
+		++m_skipped;
+	}
+}
+#endif
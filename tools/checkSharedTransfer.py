@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# Regression check for commands that send their listing over the command socket.
+#
+# MLST <path> and STAT <path> reply on the control connection instead of a data connection. A
+# server that stops polling the control connection for them never answers, and the session can no
+# longer read ABOR or QUIT.
+#
+# usage: checkSharedTransfer.py <host> <port> <file> <directory>
+#   file, directory  An existing file and directory on the server, e.g. /fs/vol/external01/boot.elf
+
+import ftplib
+import sys
+import time
+
+TIMEOUT = 5.0
+
+
+def check(ftp, command):
+    start = time.monotonic()
+    try:
+        reply = ftp.sendcmd(command)
+    except (OSError, ftplib.Error) as e:
+        print("FAIL %s: %s" % (command, e))
+        return False
+
+    print("ok   %s (%.1f ms)" % (command, (time.monotonic() - start) * 1000.0))
+    return True
+
+
+def main():
+    if len(sys.argv) != 5:
+        print("usage: %s <host> <port> <file> <directory>" % sys.argv[0])
+        return 2
+
+    host, port, path, directory = sys.argv[1], int(sys.argv[2]), sys.argv[3], sys.argv[4]
+
+    ftp = ftplib.FTP()
+    ftp.connect(host, port, timeout=TIMEOUT)
+    ftp.login()
+
+    for command in ("MLST " + path, "STAT " + path, "MLST " + directory, "STAT " + directory):
+        # the session must still answer on the control connection afterwards
+        if not check(ftp, command) or not check(ftp, "NOOP"):
+            print("FAIL")
+            return 1
+
+    ftp.quit()
+    print("PASS")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
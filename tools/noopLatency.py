@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# Control connection latency under concurrent transfers.
+#
+# Runs background sessions that repeatedly list a directory or download a file, and measures how
+# long NOOP takes on another session meanwhile. A fair transfer scheduler keeps the NOOP latency
+# low whatever the other sessions are doing.
+#
+# usage: noopLatency.py <host> <port> LIST|RETR <path> [sessions] [seconds]
+
+import ftplib
+import multiprocessing
+import sys
+import time
+
+
+def load(host, port, command, path, stop):
+    ftp = ftplib.FTP()
+    ftp.connect(host, port, timeout=30)
+    ftp.login()
+    while not stop.is_set():
+        if command == "LIST":
+            # raw lines; parsing them would make this client the bottleneck
+            ftp.retrbinary("LIST " + path, lambda data: None)
+        else:
+            ftp.retrbinary("RETR " + path, lambda data: None)
+
+
+def percentile(samples, p):
+    return samples[min(len(samples) - 1, int(len(samples) * p / 100))]
+
+
+def main():
+    if len(sys.argv) < 5 or sys.argv[3] not in ("LIST", "RETR"):
+        print("usage: %s <host> <port> LIST|RETR <path> [sessions] [seconds]" % sys.argv[0])
+        return 2
+
+    host, port, command, path = sys.argv[1], int(sys.argv[2]), sys.argv[3], sys.argv[4]
+    sessions = int(sys.argv[5]) if len(sys.argv) > 5 else 6
+    seconds = float(sys.argv[6]) if len(sys.argv) > 6 else 10.0
+
+    # separate processes, so the load does not delay the NOOPs on this client
+    stop = multiprocessing.Event()
+    loads = [multiprocessing.Process(target=load, args=(host, port, command, path, stop),
+                                     daemon=True) for _ in range(sessions)]
+    for process in loads:
+        process.start()
+
+    ftp = ftplib.FTP()
+    ftp.connect(host, port, timeout=30)
+    ftp.login()
+
+    # let the transfers get going
+    time.sleep(1.0)
+
+    samples = []
+    end = time.monotonic() + seconds
+    while time.monotonic() < end:
+        start = time.monotonic()
+        ftp.voidcmd("NOOP")
+        samples.append((time.monotonic() - start) * 1000.0)
+        time.sleep(0.01)
+
+    stop.set()
+    samples.sort()
+    print("%d %s sessions, %d NOOPs: p50 %.2f ms, p99 %.2f ms, max %.2f ms" % (sessions,
+          command, len(samples), percentile(samples, 50), percentile(samples, 99), samples[-1]))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())